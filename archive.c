@@ -0,0 +1,267 @@
+// archive.c
+// .meta parsing and formatting, the volume split rule and volume lookup,
+// shared by compressor.c (for the index and checkpoints), decompressor.c and
+// the mount daemon.
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "archive.h"
+
+int meta_parse_line(const char *line, MetaEntry *e) {
+    char hex[2 * HASH_SIZE + 1], kind[32];
+    int nf = sscanf(line, "%d %" SCNu64 " %" SCNu64 " %64s %31s", &e->id, &e->orig_size, &e->comp_size, hex, kind);
+    if (nf < 4 || hex_to_hash(hex, e->hash) != 0) {
+        fprintf(stderr, "meta parse error\n");
+        return -1;
+    }
+    e->kind = CHUNK_ZSTD;
+    e->filter.type = FILTER_NONE;
+    e->filter.width = 0;
+    e->nframes = 0;
+    e->seek_first = 0;
+    if (nf == 5) {
+        if (strcmp(kind, "fill") == 0) e->kind = CHUNK_FILL;
+        else if (strcmp(kind, "hole") == 0) e->kind = CHUNK_HOLE;
+        else if (strcmp(kind, "raw") == 0) e->kind = CHUNK_RAW;
+        else if (filter_from_name(kind, &e->filter) != 0 || e->filter.type == FILTER_NONE) {
+            // anything else names the filter of a ZSTD payload
+            fprintf(stderr, "unknown chunk kind '%s'\n", kind);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void meta_write_line(FILE *f, const MetaEntry *e) {
+    char hex[2 * HASH_SIZE + 1], kind[40] = "";
+    hash_to_hex(e->hash, hex);
+    if (e->kind == CHUNK_FILL) strcpy(kind, " fill");
+    else if (e->kind == CHUNK_HOLE) strcpy(kind, " hole");
+    else if (e->kind == CHUNK_RAW) strcpy(kind, " raw");
+    else if (e->filter.type != FILTER_NONE) { kind[0] = ' '; filter_name(&e->filter, kind + 1, sizeof(kind) - 1); }
+    fprintf(f, "%d %" PRIu64 " %" PRIu64 " %s%s\n", e->id, e->orig_size, e->comp_size, hex, kind);
+}
+
+void meta_write_seek(FILE *f, int id, const uint64_t *csize, uint32_t n) {
+    for (uint32_t first = 0; first < n; first += SEEK_LINE_FRAMES) {
+        fprintf(f, "# seek %d %u", id, first);
+        for (uint32_t k = first; k < n && k < first + SEEK_LINE_FRAMES; ++k) fprintf(f, " %" PRIu64, csize[k]);
+        fputc('\n', f);
+    }
+}
+
+int meta_parse_seek(const char *line, int *id, uint32_t *first, uint64_t *csize, int max) {
+    int pos;
+    if (sscanf(line, "# seek %d %u%n", id, first, &pos) != 2 || *id < 0) return -1;
+    int n = 0;
+    const char *p = line + pos;
+    for (;;) {
+        char *end;
+        while (*p == ' ') ++p;
+        if (*p == '\n' || *p == 0) break;
+        uint64_t v = strtoull(p, &end, 10);
+        if (end == p || n == max || v == 0) return -1;
+        csize[n++] = v;
+        p = end;
+    }
+    return n;
+}
+
+int volume_break(uint64_t volume_size, uint64_t used, uint64_t reclen, int has_record) {
+    return volume_size > 0 && has_record && used + reclen > volume_size;
+}
+
+void free_meta(MetaIndex *mi) {
+    free(mi->entries);
+    free(mi->seek);
+    mi->entries = NULL;
+    mi->seek = NULL;
+}
+
+// Append one "# seek" line to chunk 'id's seek table; lines must come in
+// order, after the chunk line.
+static int add_seek(MetaIndex *mi, const char *line, uint32_t *cap) {
+    int id;
+    uint32_t first;
+    uint64_t csize[SEEK_LINE_FRAMES];
+    int n = meta_parse_seek(line, &id, &first, csize, SEEK_LINE_FRAMES);
+    if (n <= 0 || (uint32_t)id >= mi->count || mi->entries[id].nframes != first
+        || (first > 0 && mi->entries[id].seek_first + first != mi->nseek)) return -1;
+    if (mi->nseek + (uint32_t)n > *cap) {
+        *cap = *cap ? *cap * 2 : 1024;
+        uint64_t *ns = (uint64_t*)realloc(mi->seek, *cap * sizeof(uint64_t));
+        if (!ns) return -1;
+        mi->seek = ns;
+    }
+    if (first == 0) mi->entries[id].seek_first = mi->nseek;
+    memcpy(mi->seek + mi->nseek, csize, (size_t)n * sizeof(uint64_t));
+    mi->nseek += (uint32_t)n;
+    mi->entries[id].nframes += (uint32_t)n;
+    return 0;
+}
+
+// A seek table must cover exactly the chunk's payload and input.
+static int check_seek(const MetaIndex *mi) {
+    for (uint32_t i = 0; i < mi->count; ++i) {
+        const MetaEntry *e = &mi->entries[i];
+        if (!e->nframes) continue;
+        uint64_t sum = 0;
+        for (uint32_t k = 0; k < e->nframes; ++k) sum += mi->seek[e->seek_first + k];
+        if (e->kind != CHUNK_ZSTD || mi->frame_size == 0 || sum != e->comp_size
+            || (e->orig_size + mi->frame_size - 1) / mi->frame_size != e->nframes) {
+            fprintf(stderr, "chunk %u: seek table does not match the chunk\n", i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int load_meta(const char *path, MetaIndex *mi) {
+    memset(mi, 0, sizeof(*mi));
+    FILE *f = fopen(path, "r");
+    if (!f) { perror("open meta"); return -1; }
+    uint32_t cap = 0, seek_cap = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "# seek ", 7) == 0) {
+            if (add_seek(mi, line, &seek_cap) != 0) {
+                fprintf(stderr, "bad seek table line: %s", line);
+                fclose(f); free_meta(mi); return -1;
+            }
+            continue;
+        }
+        if (line[0] == '#') {
+            char key[64], val[256];
+            if (sscanf(line, "# %63s %255s", key, val) != 2) continue;
+            if (strcmp(key, "merkle_root") == 0) {
+                mi->has_root = hex_to_hash(val, mi->root) == 0;
+            } else if (strcmp(key, "hash") == 0 && hash_algo_from_name(val, &mi->hash_algo) != 0) {
+                fprintf(stderr, "unknown hash algorithm '%s'\n", val);
+                fclose(f); free_meta(mi); return -1;
+            } else if (strcmp(key, "volume_size") == 0) {
+                mi->volume_size = strtoull(val, NULL, 10);
+            } else if (strcmp(key, "volumes") == 0) {
+                mi->volumes = (uint32_t)strtoul(val, NULL, 10);
+            } else if (strcmp(key, "frame_size") == 0) {
+                mi->frame_size = strtoull(val, NULL, 10);
+            }
+            continue;
+        }
+        if (line[0] == '\n' || line[0] == 0) continue;
+        MetaEntry e;
+        if (meta_parse_line(line, &e) != 0) { fclose(f); free_meta(mi); return -1; }
+        if (mi->count == cap) {
+            cap = cap ? cap * 2 : 64;
+            MetaEntry *ne = (MetaEntry*)realloc(mi->entries, cap * sizeof(MetaEntry));
+            if (!ne) { fprintf(stderr, "OOM\n"); fclose(f); free_meta(mi); return -1; }
+            mi->entries = ne;
+        }
+        mi->entries[mi->count++] = e;
+    }
+    fclose(f);
+    if (check_seek(mi) != 0) { free_meta(mi); return -1; }
+    return 0;
+}
+
+int pread_full(int fd, void *buf, size_t len, off_t off) {
+    unsigned char *p = (unsigned char*)buf;
+    while (len > 0) {
+        ssize_t r = pread(fd, p, len, off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r; len -= (size_t)r; off += r;
+    }
+    return 0;
+}
+
+void close_volumes(VolumeMap *vm) {
+    for (uint32_t v = 0; vm->fds && v < vm->count; ++v) if (vm->fds[v] >= 0) close(vm->fds[v]);
+    free(vm->fds);
+    free(vm->first);
+    free(vm->vol);
+    free(vm->off);
+}
+
+// Strip a trailing ".NNN" volume number, so either "x.cmp" or "x.cmp.001"
+// names a multi-volume archive.
+void volume_prefix(const char *cmp_path, char *out, size_t len) {
+    snprintf(out, len, "%s", cmp_path);
+    char *dot = strrchr(out, '.');
+    const char *slash = strrchr(out, '/');
+    if (!dot || dot[1] == 0 || (slash && slash > dot)) return;
+    for (const char *p = dot + 1; *p; ++p) if (*p < '0' || *p > '9') return;
+    *dot = 0;
+}
+
+int open_volumes(const char *cmp_path, const MetaIndex *mi, char **dirs, int ndirs, VolumeMap *vm) {
+    memset(vm, 0, sizeof(*vm));
+    uint32_t n = mi->count;
+    vm->vol = (uint32_t*)malloc(((size_t)n + 1) * sizeof(uint32_t));
+    vm->off = (uint64_t*)malloc(((size_t)n + 1) * sizeof(uint64_t));
+    vm->first = (uint32_t*)malloc(((size_t)n + 2) * sizeof(uint32_t));
+    if (!vm->vol || !vm->off || !vm->first) { fprintf(stderr, "OOM\n"); close_volumes(vm); return -1; }
+
+    // replay the compressor's split rule over the record sizes
+    uint64_t used = CMP_HEADER_SIZE;
+    uint32_t v = 0;
+    vm->first[0] = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        uint64_t reclen = sizeof(uint64_t) + mi->entries[i].comp_size;
+        if (volume_break(mi->volume_size, used, reclen, i > 0)) {
+            vm->first[++v] = i;
+            used = 0;
+        }
+        vm->vol[i] = v;
+        vm->off[i] = used;
+        used += reclen;
+    }
+    vm->count = v + 1;
+    vm->first[vm->count] = n;
+    if (mi->volumes && mi->volumes != vm->count) {
+        fprintf(stderr, "meta lists %u volumes but its chunks span %u\n", mi->volumes, vm->count);
+        close_volumes(vm);
+        return -1;
+    }
+
+    vm->fds = (int*)malloc(vm->count * sizeof(int));
+    if (!vm->fds) { fprintf(stderr, "OOM\n"); close_volumes(vm); return -1; }
+    for (v = 0; v < vm->count; ++v) vm->fds[v] = -1;
+    char prefix[1024], path[1100];
+    if (mi->volumes) volume_prefix(cmp_path, prefix, sizeof(prefix));
+    for (v = 0; v < vm->count; ++v) {
+        if (!mi->volumes) {
+            vm->fds[v] = open(cmp_path, O_RDONLY);
+            snprintf(path, sizeof(path), "%s", cmp_path);
+        } else {
+            snprintf(path, sizeof(path), "%s.%03u", prefix, v + 1);
+            vm->fds[v] = open(path, O_RDONLY);
+            const char *vbase = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+            char name[1100];
+            snprintf(name, sizeof(name), "%s", vbase);
+            for (int d = 0; vm->fds[v] < 0 && d < ndirs; ++d) {
+                if (snprintf(path, sizeof(path), "%s/%s", dirs[d], name) >= (int)sizeof(path)) continue;
+                vm->fds[v] = open(path, O_RDONLY);
+            }
+        }
+        if (vm->fds[v] < 0) { perror(path); close_volumes(vm); return -1; }
+    }
+    return 0;
+}
+
+uint64_t parse_size(const char *s) {
+    char *end;
+    uint64_t v = strtoull(s, &end, 10);
+    if (end == s) return 0;
+    const char *units = "KMGT";
+    const char *u = *end ? strchr(units, *end) : NULL;
+    if (*end && (!u || (end[1] && strcmp(end + 1, "B") != 0))) return 0;
+    if (u) {
+        uint64_t base = end[1] == 'B' ? 1000 : 1024;
+        for (const char *p = units; p <= u; ++p) v *= base;
+    }
+    return v;
+}
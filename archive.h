@@ -0,0 +1,119 @@
+// archive.h
+// On-disk layout shared by compressor.c and decompressor.c.
+//
+// .cmp:  original size (8), chunk_size (8), num_chunks (4), then per chunk
+//        comp_size (8) followed by comp_size payload bytes.
+// .meta: optional "# key value" header lines, then one line per chunk:
+//        "id orig_size comp_size digesthex [kind]". Without a kind token the
+//        payload is a ZSTD frame. A hole chunk's digest is that of its
+//        orig_size zero bytes, as for the same chunk stored dense. Raw
+//        chunks hold the input bytes as they are (media payloads ZSTD could
+//        not shrink). A filter name as the kind ("delta:2", see filter.h)
+//        marks a ZSTD payload of filtered bytes; framed chunks are filtered
+//        frame by frame.
+//
+// Seekable chunks: with "# frame_size N", a chunk larger than N may be stored
+// as a run of independent ZSTD frames of N input bytes each (the last one
+// shorter), so a reader can decode only the frames a small read touches. Its
+// chunk line is followed by "# seek id first csize..." lines giving each
+// frame's compressed size, SEEK_LINE_FRAMES per line; readers without seek
+// support skip them as unknown headers and decode the frames back to back.
+//
+// A multi-volume archive ("# volumes N" in the .meta) splits the .cmp stream
+// into <name>.cmp.001, .002, ... at record boundaries; concatenating the
+// volumes gives the single-file .cmp. Which volume holds a record follows
+// from the record sizes and "# volume_size", see volume_break().
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "hash.h"
+#include "filter.h"
+
+#define CMP_HEADER_SIZE (sizeof(uint64_t) + sizeof(uint64_t) + sizeof(uint32_t))
+#define SEEK_LINE_FRAMES 16
+
+typedef enum {
+    CHUNK_ZSTD = 0,    // payload is a ZSTD frame
+    CHUNK_FILL = 1,    // payload is one byte repeated orig_size times
+    CHUNK_HOLE = 2,    // no payload; a hole in a sparse input, restored by seeking
+    CHUNK_RAW = 3      // payload is the orig_size input bytes, stored as is
+} ChunkKind;
+
+// One parsed chunk line of a .meta file.
+typedef struct {
+    int id;
+    uint64_t orig_size;
+    uint64_t comp_size;
+    unsigned char hash[HASH_SIZE];
+    ChunkKind kind;
+    Filter filter;          // CHUNK_ZSTD only
+    uint32_t nframes;       // 0: a single frame; else see MetaIndex.seek
+    uint32_t seek_first;
+} MetaEntry;
+
+// A loaded .meta: the chunk lines plus the header fields readers need.
+typedef struct {
+    MetaEntry *entries;
+    uint32_t count;
+    HashAlgo hash_algo;
+    int has_root;
+    unsigned char root[HASH_SIZE];
+    uint64_t volume_size;   // 0: single-file .cmp
+    uint32_t volumes;
+    uint64_t frame_size;    // input bytes per seek frame, 0 if none
+    uint64_t *seek;         // compressed frame sizes; chunk e has
+    uint32_t nseek;         // seek[e.seek_first .. e.seek_first + e.nframes)
+} MetaIndex;
+
+// Parse "id orig_size comp_size digesthex [kind|filter]"; returns 0 or -1 (and
+// prints why).
+int meta_parse_line(const char *line, MetaEntry *e);
+void meta_write_line(FILE *f, const MetaEntry *e);
+
+// The "# seek" lines for a chunk stored as n frames.
+void meta_write_seek(FILE *f, int id, const uint64_t *csize, uint32_t n);
+// Parse one "# seek id first csize..." line into csize[0..max); returns the
+// number of sizes, or -1 if the line is malformed.
+int meta_parse_seek(const char *line, int *id, uint32_t *first, uint64_t *csize, int max);
+
+// Whether a record of 'reclen' bytes starts a new volume when the current one
+// already holds 'used' bytes (header included). Records never straddle
+// volumes, and a record larger than volume_size gets a volume of its own.
+// volume_size 0 means a single volume.
+int volume_break(uint64_t volume_size, uint64_t used, uint64_t reclen, int has_record);
+
+// Parse a .meta file: "# key value" header lines, then one chunk line per
+// chunk. Returns 0 or -1 (and prints why); free_meta() when done.
+int load_meta(const char *path, MetaIndex *mi);
+void free_meta(MetaIndex *mi);
+
+// Where each chunk record lives. Volumes hold consecutive runs of chunks:
+// volume v holds chunks first[v] .. first[v + 1] - 1.
+typedef struct {
+    uint32_t count;
+    int *fds;
+    uint32_t *first;       // count + 1 entries
+    uint32_t *vol;         // per chunk
+    uint64_t *off;         // per chunk, record offset inside its volume
+} VolumeMap;
+
+// Open the archive's volumes. Each volume is looked for next to cmp_path and
+// then in each of 'dirs', so volumes spread over several mounts can be read
+// in place. Either "x.cmp" or "x.cmp.001" names a multi-volume archive.
+int open_volumes(const char *cmp_path, const MetaIndex *mi, char **dirs, int ndirs, VolumeMap *vm);
+void close_volumes(VolumeMap *vm);
+// Strip a trailing ".NNN" volume number from cmp_path.
+void volume_prefix(const char *cmp_path, char *out, size_t len);
+
+// pread exactly len bytes, retrying short reads and EINTR; -1 on error or EOF.
+int pread_full(int fd, void *buf, size_t len, off_t off);
+
+// Size arguments: "5000000000", "512M", "5G" (K/M/G/T are binary, KB/MB/GB/TB
+// decimal). Returns 0 on a malformed size.
+uint64_t parse_size(const char *s);
+
+#endif
@@ -0,0 +1,302 @@
+"""Compression regression suite.
+
+Compresses and decompresses a deterministic synthetic corpus (gen_corpus)
+and records, per input, compression and decompression throughput, the
+compression ratio (.cmp volumes plus .meta over input) and the peak RSS of
+each process. Every run is appended to a history file tagged with the git
+commit. Given a baseline, a throughput drop, ratio loss or RSS growth
+beyond the thresholds fails the run (exit status 1).
+
+    make compressor decompressor gen_corpus peak_rss
+    python3 bench.py --save-baseline          # on the reference commit
+    python3 bench.py                          # later: compare and record
+
+Sizes range from KB to tens of GB (--preset huge, or --sizes 32G); the
+corpus is generated once into --corpus and reused.
+
+With --determinism N it instead compresses every input with
+--deterministic at 1..N threads, in both emit modes, and fails unless all
+the archives are byte-identical.
+"""
+
+import argparse
+import hashlib
+import json
+import os
+import platform
+import shutil
+import subprocess
+import sys
+import time
+
+KINDS = ["text", "logs", "json", "random", "zero", "sparse", "vm", "media"]
+PRESETS = {
+    "quick": "64K,16M",
+    "full": "64K,16M,1G",
+    "huge": "64K,16M,1G,32G",
+}
+
+
+def parse_size(s):
+    units = {"K": 1 << 10, "M": 1 << 20, "G": 1 << 30}
+    if s[-1:].upper() in units:
+        return int(s[:-1]) * units[s[-1].upper()]
+    return int(s)
+
+
+# Bumped when peak RSS is measured differently; RSS from a baseline with
+# another method is not compared.
+RSS_METHOD = "peak_rss"
+
+
+def run(args, cmd):
+    """Run cmd; returns (wall seconds, peak RSS in KiB of that process).
+
+    A child of this interpreter would inherit its RSS high-water mark across
+    exec, so cmd runs under the small peak_rss helper, which reports the
+    peak of the command alone."""
+    start = time.perf_counter()
+    proc = subprocess.run([args.peak_rss] + cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    wall = time.perf_counter() - start
+    if proc.returncode != 0:
+        raise RuntimeError("%s failed:\n%s" % (" ".join(cmd), proc.stderr.decode(errors="replace")))
+    return wall, int(proc.stdout)
+
+
+def same_file(a, b):
+    if os.path.getsize(a) != os.path.getsize(b):
+        return False
+    with open(a, "rb") as fa, open(b, "rb") as fb:
+        while True:
+            x = fa.read(1 << 22)
+            if x != fb.read(1 << 22):
+                return False
+            if not x:
+                return True
+
+
+def file_digest(path):
+    h = hashlib.sha256()
+    with open(path, "rb") as f:
+        while True:
+            x = f.read(1 << 22)
+            if not x:
+                return h.hexdigest()
+            h.update(x)
+
+
+def check_determinism(args, case, path):
+    """Returns the runs whose archive differs from the 1-thread ordered one."""
+    out = os.path.join(args.work, "det")
+    ref = None
+    bad = []
+    for threads in range(1, args.determinism + 1):
+        for emit in ("ordered", "parallel"):
+            shutil.rmtree(out, ignore_errors=True)
+            os.makedirs(out)
+            run(args, [args.compressor] + args.compressor_args.split() +
+                ["--deterministic", "--threads", str(threads), "--emit", emit, path, out])
+            digests = {f: file_digest(os.path.join(out, f)) for f in sorted(os.listdir(out))}
+            if ref is None:
+                ref = digests
+            elif digests != ref:
+                bad.append("%s --threads %d --emit %s" % (case, threads, emit))
+    shutil.rmtree(out, ignore_errors=True)
+    return bad
+
+
+def git_commit():
+    # the tree bench.py lives in, wherever it is run from
+    repo = os.path.dirname(os.path.abspath(__file__))
+    try:
+        rev = subprocess.check_output(["git", "rev-parse", "--short", "HEAD"], cwd=repo,
+                                      stderr=subprocess.DEVNULL).decode().strip()
+        dirty = subprocess.call(["git", "diff", "--quiet", "HEAD", "--", "*.c", "*.h", "Makefile"], cwd=repo,
+                                stderr=subprocess.DEVNULL) != 0
+        return rev, dirty
+    except (OSError, subprocess.CalledProcessError):
+        return "unknown", False
+
+
+def check_mp4(path):
+    """Raises unless path's top-level boxes tile it exactly, starting with ftyp
+    (what the compressor's --container mp4 requires)."""
+    size = os.path.getsize(path)
+    off = 0
+    with open(path, "rb") as f:
+        while off < size:
+            f.seek(off)
+            h = f.read(16)
+            n, typ = int.from_bytes(h[:4], "big"), h[4:8]
+            if n == 1:
+                n = int.from_bytes(h[8:16], "big")
+            elif n == 0:
+                n = size - off
+            if len(h) < 8 or n < 8 or off + n > size or (off == 0 and typ != b"ftyp"):
+                raise RuntimeError("%s: not a valid MP4 (bad box at offset %d)" % (path, off))
+            off += n
+
+
+def corpus_file(args, kind, size_name):
+    path = os.path.join(args.corpus, "%s-%s-s%d.bin" % (kind, size_name, args.seed))
+    if not os.path.exists(path) or os.path.getsize(path) != parse_size(size_name):
+        subprocess.check_call([args.gen, kind, size_name, path, str(args.seed)])
+    if kind == "media":
+        check_mp4(path)
+    return path
+
+
+def bench_one(args, path):
+    size = os.path.getsize(path)
+    base = os.path.basename(path)
+    cdir = os.path.join(args.work, "c")
+    ddir = os.path.join(args.work, "d")
+    best_c = best_d = None
+    rss_c = rss_d = 0
+    ratio = None
+    for _ in range(args.repeat):
+        for d in (cdir, ddir):
+            shutil.rmtree(d, ignore_errors=True)
+            os.makedirs(d)
+        wall, rss = run(args, [args.compressor] + args.compressor_args.split() + [path, cdir])
+        best_c = wall if best_c is None else min(best_c, wall)
+        rss_c = max(rss_c, rss)
+        stored = sum(os.path.getsize(os.path.join(cdir, f)) for f in os.listdir(cdir))
+        ratio = stored / size
+        cmp_path = os.path.join(cdir, base + ".cmp")
+        meta_path = os.path.join(cdir, base + ".meta")
+        wall, rss = run(args, [args.decompressor, cmp_path, meta_path, ddir])
+        best_d = wall if best_d is None else min(best_d, wall)
+        rss_d = max(rss_d, rss)
+        if not same_file(path, os.path.join(ddir, base)):
+            raise RuntimeError("%s: decompressed output differs from the input" % base)
+    shutil.rmtree(cdir, ignore_errors=True)
+    shutil.rmtree(ddir, ignore_errors=True)
+    return {
+        "bytes": size,
+        "compress_mbps": size / best_c / 1e6,
+        "decompress_mbps": size / best_d / 1e6,
+        "ratio": ratio,
+        "compress_rss_kb": rss_c,
+        "decompress_rss_kb": rss_d,
+    }
+
+
+def compare(args, results, baseline):
+    """Returns the list of regressions against the baseline's results."""
+    bad = []
+    same_rss = baseline.get("rss_method") == RSS_METHOD
+    for case, cur in sorted(results.items()):
+        ref = baseline["results"].get(case)
+        if ref is None:
+            continue
+        for key in ("compress_mbps", "decompress_mbps"):
+            if cur[key] < ref[key] * (1 - args.threshold):
+                bad.append("%s %s %.1f < %.1f (-%.0f%%)" % (case, key, cur[key], ref[key],
+                                                           100 * (1 - cur[key] / ref[key])))
+        if cur["ratio"] > ref["ratio"] * (1 + args.ratio_threshold):
+            bad.append("%s ratio %.4f > %.4f" % (case, cur["ratio"], ref["ratio"]))
+        for key in ("compress_rss_kb", "decompress_rss_kb") if same_rss else ():
+            if cur[key] > ref[key] * (1 + args.rss_threshold):
+                bad.append("%s %s %d > %d KiB" % (case, key, cur[key], ref[key]))
+    return bad
+
+
+def main():
+    ap = argparse.ArgumentParser(description="compression regression suite")
+    ap.add_argument("--preset", choices=sorted(PRESETS), default="quick")
+    ap.add_argument("--sizes", help="comma-separated sizes, overrides --preset (e.g. 64K,16M,32G)")
+    ap.add_argument("--kinds", default=",".join(KINDS))
+    ap.add_argument("--seed", type=int, default=1)
+    ap.add_argument("--repeat", type=int, default=3, help="runs per input; the fastest counts")
+    ap.add_argument("--corpus", default="bench_corpus")
+    ap.add_argument("--work", default="bench_work")
+    ap.add_argument("--compressor", default="./compressor")
+    ap.add_argument("--decompressor", default="./decompressor")
+    ap.add_argument("--gen", default="./gen_corpus")
+    ap.add_argument("--peak-rss", default="./peak_rss", help="helper that runs a tool and reports its peak RSS")
+    ap.add_argument("--compressor-args", default="", help="extra compressor options, e.g. '--hash blake3'")
+    ap.add_argument("--baseline", default="bench_baseline.json")
+    ap.add_argument("--save-baseline", action="store_true", help="store this run as the baseline")
+    ap.add_argument("--history", default="bench_history.jsonl")
+    ap.add_argument("--threshold", type=float, default=0.10, help="allowed throughput drop (fraction)")
+    ap.add_argument("--ratio-threshold", type=float, default=0.01, help="allowed ratio growth (fraction)")
+    ap.add_argument("--rss-threshold", type=float, default=0.10, help="allowed peak RSS growth (fraction)")
+    ap.add_argument("--determinism", type=int, metavar="N",
+                    help="only check that --deterministic output is identical for 1..N threads")
+    args = ap.parse_args()
+
+    sizes = (args.sizes or PRESETS[args.preset]).split(",")
+    kinds = args.kinds.split(",")
+    for k in kinds:
+        if k not in KINDS:
+            ap.error("unknown kind %s" % k)
+    os.makedirs(args.corpus, exist_ok=True)
+    os.makedirs(args.work, exist_ok=True)
+
+    if args.determinism:
+        bad = []
+        for size_name in sizes:
+            for kind in kinds:
+                case = "%s-%s" % (kind, size_name)
+                diff = check_determinism(args, case, corpus_file(args, kind, size_name))
+                print("%-16s %s" % (case, "differs" if diff else "identical for 1..%d threads" % args.determinism))
+                sys.stdout.flush()
+                bad += diff
+        if bad:
+            print("NOT DETERMINISTIC:")
+            for line in bad:
+                print("  " + line)
+            return 1
+        return 0
+
+    print("%-16s %12s %10s %10s %8s %10s %10s" % ("input", "bytes", "comp MB/s", "dec MB/s", "ratio",
+                                                   "comp RSS", "dec RSS"))
+    results = {}
+    for size_name in sizes:
+        for kind in kinds:
+            case = "%s-%s" % (kind, size_name)
+            r = bench_one(args, corpus_file(args, kind, size_name))
+            results[case] = r
+            print("%-16s %12d %10.1f %10.1f %8.4f %8d K %8d K" % (case, r["bytes"], r["compress_mbps"],
+                  r["decompress_mbps"], r["ratio"], r["compress_rss_kb"], r["decompress_rss_kb"]))
+            sys.stdout.flush()
+
+    commit, dirty = git_commit()
+    record = {
+        "commit": commit,
+        "dirty": dirty,
+        "date": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+        "host": platform.node(),
+        "compressor_args": args.compressor_args,
+        "seed": args.seed,
+        "rss_method": RSS_METHOD,
+        "results": results,
+    }
+    with open(args.history, "a") as f:
+        f.write(json.dumps(record, sort_keys=True) + "\n")
+
+    if args.save_baseline:
+        with open(args.baseline, "w") as f:
+            json.dump(record, f, indent=1, sort_keys=True)
+        print("baseline saved to %s (commit %s)" % (args.baseline, commit))
+        return 0
+    if not os.path.exists(args.baseline):
+        print("no baseline %s; run with --save-baseline first" % args.baseline)
+        return 0
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+    if baseline.get("rss_method") != RSS_METHOD:
+        print("baseline RSS was measured another way and is not compared; re-save it with --save-baseline")
+    bad = compare(args, results, baseline)
+    if bad:
+        print("REGRESSIONS against %s (commit %s):" % (args.baseline, baseline.get("commit")))
+        for line in bad:
+            print("  " + line)
+        return 1
+    print("no regressions against %s (commit %s)" % (args.baseline, baseline.get("commit")))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
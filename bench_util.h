@@ -0,0 +1,49 @@
+// bench_util.h
+// Fixtures shared by the C benchmarks (decode_bench, hugemem_bench,
+// micro_bench): a fixed-seed PRNG, the text-like input generator and a
+// monotonic clock. Header-only, each benchmark is a single program.
+
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// xorshift64, same sequence on every run
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+static inline uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// Text-like data: words from a small vocabulary with some noise, which
+// compresses about 3-4x at level 3 like typical mixed inputs. With
+// 'repeats', also copies of earlier stretches (past the first 64 KiB), so
+// a match finder walks its chains across the whole window.
+static inline void fill_data(unsigned char *p, size_t len, int repeats) {
+    static const char *words[] = { "chunk ", "archive ", "volume ", "merkle ", "digest ", "zstd ",
+                                   "offset ", "record ", "index ", "thread ", "buffer ", "stream " };
+    size_t i = 0;
+    while (i < len) {
+        uint64_t r = rng();
+        if ((r & 15) == 0) { p[i++] = (unsigned char)(r >> 8); continue; }
+        if (repeats && (r & 255) == 1 && i > 65536) {
+            size_t from = (size_t)(r >> 16) % (i - 4096), n = 64 + (r >> 40) % 1024;
+            for (size_t k = 0; k < n && i < len; ++k) p[i++] = p[from + k];
+            continue;
+        }
+        const char *w = words[(r >> 4) % 12];
+        for (; *w && i < len; ++w) p[i++] = (unsigned char)*w;
+    }
+}
+
+static inline double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#endif
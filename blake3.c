@@ -0,0 +1,359 @@
+// blake3.c
+// Self-contained BLAKE3 hash (default mode, 32-byte output).
+// Chunks of 1 KiB are compressed independently and combined in a binary
+// tree, so runs of full chunks are hashed in SIMD lanes (one chunk per lane)
+// and big subtrees are handed to helper threads.
+
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+#include "blake3.h"
+
+#define CHUNK_LEN   BLAKE3_CHUNK_LEN
+#define BLOCK_LEN   64
+#define CHUNK_START 1
+#define CHUNK_END   2
+#define PARENT      4
+#define ROOT        8
+
+// subtrees of at most this many chunks are hashed as one flat batch
+#define BATCH_CHUNKS 64
+// smallest subtree worth handing to another thread
+#define MIN_THREAD_BYTES (1u << 20)
+
+static const uint32_t IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+// message word order for each of the 7 rounds (the permutation applied 0..6 times)
+static const uint8_t MSG_SCHEDULE[7][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+    { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+    { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+    { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+    { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+    { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+static inline uint32_t load32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void store32(unsigned char *p, uint32_t w) {
+    p[0] = (unsigned char)w; p[1] = (unsigned char)(w >> 8);
+    p[2] = (unsigned char)(w >> 16); p[3] = (unsigned char)(w >> 24);
+}
+
+static inline uint32_t rotr32(uint32_t w, int c) {
+    return (w >> c) | (w << (32 - c));
+}
+
+static inline void g(uint32_t *v, int a, int b, int c, int d, uint32_t x, uint32_t y) {
+    v[a] = v[a] + v[b] + x; v[d] = rotr32(v[d] ^ v[a], 16);
+    v[c] = v[c] + v[d];     v[b] = rotr32(v[b] ^ v[c], 12);
+    v[a] = v[a] + v[b] + y; v[d] = rotr32(v[d] ^ v[a], 8);
+    v[c] = v[c] + v[d];     v[b] = rotr32(v[b] ^ v[c], 7);
+}
+
+// One compression; writes the 8-word chaining value (first half of the output).
+static void compress_cv(const uint32_t cv[8], const unsigned char block[BLOCK_LEN], uint32_t block_len,
+                        uint64_t counter, uint32_t flags, uint32_t out[8]) {
+    uint32_t m[16], v[16];
+    for (int i = 0; i < 16; ++i) m[i] = load32(block + 4 * i);
+    for (int i = 0; i < 8; ++i) v[i] = cv[i];
+    v[8] = IV[0]; v[9] = IV[1]; v[10] = IV[2]; v[11] = IV[3];
+    v[12] = (uint32_t)counter; v[13] = (uint32_t)(counter >> 32);
+    v[14] = block_len; v[15] = flags;
+    for (int r = 0; r < 7; ++r) {
+        const uint8_t *s = MSG_SCHEDULE[r];
+        g(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+        g(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+        g(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+        g(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+        g(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+        g(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+        g(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+        g(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+    for (int i = 0; i < 8; ++i) out[i] = v[i] ^ v[i + 8];
+}
+
+// Chaining value of one (possibly partial) chunk; 'root' marks a single-chunk input.
+static void chunk_cv(const unsigned char *in, size_t len, uint64_t counter, uint32_t root, uint32_t out[8]) {
+    uint32_t cv[8];
+    memcpy(cv, IV, sizeof(cv));
+    size_t nblocks = len ? (len + BLOCK_LEN - 1) / BLOCK_LEN : 1;
+    for (size_t b = 0; b < nblocks; ++b) {
+        unsigned char block[BLOCK_LEN];
+        size_t blen = len - b * BLOCK_LEN;
+        if (blen > BLOCK_LEN) blen = BLOCK_LEN;
+        memset(block, 0, sizeof(block));
+        if (blen) memcpy(block, in + b * BLOCK_LEN, blen);
+        uint32_t flags = 0;
+        if (b == 0) flags |= CHUNK_START;
+        if (b == nblocks - 1) flags |= CHUNK_END | root;
+        compress_cv(cv, block, (uint32_t)blen, counter, flags, cv);
+    }
+    memcpy(out, cv, sizeof(cv));
+}
+
+static void parent_cv(const uint32_t l[8], const uint32_t r[8], uint32_t flags, uint32_t out[8]) {
+    unsigned char block[BLOCK_LEN];
+    for (int i = 0; i < 8; ++i) {
+        store32(block + 4 * i, l[i]);
+        store32(block + 32 + 4 * i, r[i]);
+    }
+    compress_cv(IV, block, BLOCK_LEN, 0, PARENT | flags, out);
+}
+
+#ifdef __AVX2__
+#define ROTR8(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+#define G8(a, b, c, d, x, y) do { \
+    v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), (x)); v[d] = ROTR8(_mm256_xor_si256(v[d], v[a]), 16); \
+    v[c] = _mm256_add_epi32(v[c], v[d]);                        v[b] = ROTR8(_mm256_xor_si256(v[b], v[c]), 12); \
+    v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), (y)); v[d] = ROTR8(_mm256_xor_si256(v[d], v[a]), 8);  \
+    v[c] = _mm256_add_epi32(v[c], v[d]);                        v[b] = ROTR8(_mm256_xor_si256(v[b], v[c]), 7);  \
+} while (0)
+
+// Eight full chunks at once, one per 32-bit lane.
+static void hash8_avx2(const unsigned char *in, uint64_t counter, uint32_t out[][8]) {
+    const __m256i idx = _mm256_setr_epi32(0, 256, 512, 768, 1024, 1280, 1536, 1792);   // CHUNK_LEN/4 strides
+    uint32_t lo[8], hi[8];
+    for (int j = 0; j < 8; ++j) { lo[j] = (uint32_t)(counter + j); hi[j] = (uint32_t)((counter + j) >> 32); }
+    const __m256i ctr_lo = _mm256_loadu_si256((const __m256i*)lo);
+    const __m256i ctr_hi = _mm256_loadu_si256((const __m256i*)hi);
+    __m256i h[8], v[16], m[16];
+    for (int i = 0; i < 8; ++i) h[i] = _mm256_set1_epi32((int)IV[i]);
+    for (int b = 0; b < CHUNK_LEN / BLOCK_LEN; ++b) {
+        for (int w = 0; w < 16; ++w)
+            m[w] = _mm256_i32gather_epi32((const int*)(in + b * BLOCK_LEN + 4 * w), idx, 4);
+        uint32_t flags = (b == 0 ? CHUNK_START : 0) | (b == CHUNK_LEN / BLOCK_LEN - 1 ? CHUNK_END : 0);
+        for (int i = 0; i < 8; ++i) v[i] = h[i];
+        for (int i = 0; i < 4; ++i) v[8 + i] = _mm256_set1_epi32((int)IV[i]);
+        v[12] = ctr_lo; v[13] = ctr_hi;
+        v[14] = _mm256_set1_epi32(BLOCK_LEN); v[15] = _mm256_set1_epi32((int)flags);
+        for (int r = 0; r < 7; ++r) {
+            const uint8_t *s = MSG_SCHEDULE[r];
+            G8(0, 4, 8, 12, m[s[0]], m[s[1]]);
+            G8(1, 5, 9, 13, m[s[2]], m[s[3]]);
+            G8(2, 6, 10, 14, m[s[4]], m[s[5]]);
+            G8(3, 7, 11, 15, m[s[6]], m[s[7]]);
+            G8(0, 5, 10, 15, m[s[8]], m[s[9]]);
+            G8(1, 6, 11, 12, m[s[10]], m[s[11]]);
+            G8(2, 7, 8, 13, m[s[12]], m[s[13]]);
+            G8(3, 4, 9, 14, m[s[14]], m[s[15]]);
+        }
+        for (int i = 0; i < 8; ++i) h[i] = _mm256_xor_si256(v[i], v[i + 8]);
+    }
+    uint32_t t[8][8];
+    for (int i = 0; i < 8; ++i) _mm256_storeu_si256((__m256i*)t[i], h[i]);
+    for (int j = 0; j < 8; ++j)
+        for (int i = 0; i < 8; ++i) out[j][i] = t[i][j];
+}
+#endif
+
+#ifdef __AVX512F__
+#define G16(a, b, c, d, x, y) do { \
+    v[a] = _mm512_add_epi32(_mm512_add_epi32(v[a], v[b]), (x)); v[d] = _mm512_ror_epi32(_mm512_xor_si512(v[d], v[a]), 16); \
+    v[c] = _mm512_add_epi32(v[c], v[d]);                        v[b] = _mm512_ror_epi32(_mm512_xor_si512(v[b], v[c]), 12); \
+    v[a] = _mm512_add_epi32(_mm512_add_epi32(v[a], v[b]), (y)); v[d] = _mm512_ror_epi32(_mm512_xor_si512(v[d], v[a]), 8);  \
+    v[c] = _mm512_add_epi32(v[c], v[d]);                        v[b] = _mm512_ror_epi32(_mm512_xor_si512(v[b], v[c]), 7);  \
+} while (0)
+
+// Sixteen full chunks at once, one per 32-bit lane.
+static void hash16_avx512(const unsigned char *in, uint64_t counter, uint32_t out[][8]) {
+    const __m512i idx = _mm512_setr_epi32(0, 256, 512, 768, 1024, 1280, 1536, 1792,
+                                          2048, 2304, 2560, 2816, 3072, 3328, 3584, 3840);
+    uint32_t lo[16], hi[16];
+    for (int j = 0; j < 16; ++j) { lo[j] = (uint32_t)(counter + j); hi[j] = (uint32_t)((counter + j) >> 32); }
+    const __m512i ctr_lo = _mm512_loadu_si512(lo);
+    const __m512i ctr_hi = _mm512_loadu_si512(hi);
+    __m512i h[8], v[16], m[16];
+    for (int i = 0; i < 8; ++i) h[i] = _mm512_set1_epi32((int)IV[i]);
+    for (int b = 0; b < CHUNK_LEN / BLOCK_LEN; ++b) {
+        for (int w = 0; w < 16; ++w)
+            m[w] = _mm512_i32gather_epi32(idx, (const void*)(in + b * BLOCK_LEN + 4 * w), 4);
+        uint32_t flags = (b == 0 ? CHUNK_START : 0) | (b == CHUNK_LEN / BLOCK_LEN - 1 ? CHUNK_END : 0);
+        for (int i = 0; i < 8; ++i) v[i] = h[i];
+        for (int i = 0; i < 4; ++i) v[8 + i] = _mm512_set1_epi32((int)IV[i]);
+        v[12] = ctr_lo; v[13] = ctr_hi;
+        v[14] = _mm512_set1_epi32(BLOCK_LEN); v[15] = _mm512_set1_epi32((int)flags);
+        for (int r = 0; r < 7; ++r) {
+            const uint8_t *s = MSG_SCHEDULE[r];
+            G16(0, 4, 8, 12, m[s[0]], m[s[1]]);
+            G16(1, 5, 9, 13, m[s[2]], m[s[3]]);
+            G16(2, 6, 10, 14, m[s[4]], m[s[5]]);
+            G16(3, 7, 11, 15, m[s[6]], m[s[7]]);
+            G16(0, 5, 10, 15, m[s[8]], m[s[9]]);
+            G16(1, 6, 11, 12, m[s[10]], m[s[11]]);
+            G16(2, 7, 8, 13, m[s[12]], m[s[13]]);
+            G16(3, 4, 9, 14, m[s[14]], m[s[15]]);
+        }
+        for (int i = 0; i < 8; ++i) h[i] = _mm512_xor_si512(v[i], v[i + 8]);
+    }
+    uint32_t t[8][16];
+    for (int i = 0; i < 8; ++i) _mm512_storeu_si512(t[i], h[i]);
+    for (int j = 0; j < 16; ++j)
+        for (int i = 0; i < 8; ++i) out[j][i] = t[i][j];
+}
+#endif
+
+const char *blake3_simd_name(void) {
+#if defined(__AVX512F__)
+    return "avx512";
+#elif defined(__AVX2__)
+    return "avx2";
+#else
+    return "portable";
+#endif
+}
+
+// Chaining values for 'n' consecutive full chunks starting at chunk 'counter'.
+static void hash_full_chunks(const unsigned char *in, size_t n, uint64_t counter, uint32_t cvs[][8]) {
+    size_t i = 0;
+#ifdef __AVX512F__
+    for (; i + 16 <= n; i += 16) hash16_avx512(in + i * CHUNK_LEN, counter + i, cvs + i);
+#endif
+#ifdef __AVX2__
+    for (; i + 8 <= n; i += 8) hash8_avx2(in + i * CHUNK_LEN, counter + i, cvs + i);
+#endif
+    for (; i < n; ++i) chunk_cv(in + i * CHUNK_LEN, CHUNK_LEN, counter + i, 0, cvs[i]);
+}
+
+static size_t left_chunks(size_t nchunks) {
+    // largest power of two strictly below nchunks (nchunks >= 2)
+    size_t k = 1;
+    while (k << 1 < nchunks) k <<= 1;
+    return k;
+}
+
+static void fold_cvs(uint32_t cvs[][8], size_t n, uint32_t out[8]) {
+    if (n == 1) { memcpy(out, cvs[0], 8 * sizeof(uint32_t)); return; }
+    size_t k = left_chunks(n);
+    uint32_t l[8], r[8];
+    fold_cvs(cvs, k, l);
+    fold_cvs(cvs + k, n - k, r);
+    parent_cv(l, r, 0, out);
+}
+
+typedef struct {
+    const unsigned char *in;
+    size_t len;
+    uint64_t counter;
+    int nthreads;
+    uint32_t cv[8];
+} SubtreeArg;
+
+static void subtree_cv(const unsigned char *in, size_t len, uint64_t counter, int nthreads, uint32_t out[8]);
+
+static void *subtree_thread(void *varg) {
+    SubtreeArg *a = (SubtreeArg*)varg;
+    subtree_cv(a->in, a->len, a->counter, a->nthreads, a->cv);
+    return NULL;
+}
+
+// Split a multi-chunk input at the BLAKE3 tree boundary and hash both halves,
+// the left one on a helper thread when there are threads to spare.
+static void split_cvs(const unsigned char *in, size_t len, uint64_t counter, int nthreads,
+                      uint32_t l[8], uint32_t r[8]) {
+    size_t nchunks = (len + CHUNK_LEN - 1) / CHUNK_LEN;
+    size_t left_len = left_chunks(nchunks) * CHUNK_LEN;
+    int lthreads = nthreads / 2, rthreads = nthreads - nthreads / 2;
+    SubtreeArg la = { in, left_len, counter, lthreads, { 0 } };
+    pthread_t th;
+    int spawned = nthreads > 1 && left_len >= MIN_THREAD_BYTES
+                  && pthread_create(&th, NULL, subtree_thread, &la) == 0;
+    if (!spawned) rthreads = nthreads;
+    subtree_cv(in + left_len, len - left_len, counter + left_len / CHUNK_LEN, rthreads, r);
+    if (spawned) pthread_join(th, NULL);
+    else subtree_cv(in, left_len, counter, nthreads, la.cv);
+    memcpy(l, la.cv, sizeof(la.cv));
+}
+
+static void subtree_cv(const unsigned char *in, size_t len, uint64_t counter, int nthreads, uint32_t out[8]) {
+    size_t nchunks = (len + CHUNK_LEN - 1) / CHUNK_LEN;
+    if (nchunks <= BATCH_CHUNKS) {
+        uint32_t cvs[BATCH_CHUNKS][8];
+        size_t full = len / CHUNK_LEN;
+        hash_full_chunks(in, full, counter, cvs);
+        if (full < nchunks) chunk_cv(in + full * CHUNK_LEN, len - full * CHUNK_LEN, counter + full, 0, cvs[full]);
+        fold_cvs(cvs, nchunks, out);
+        return;
+    }
+    uint32_t l[8], r[8];
+    split_cvs(in, len, counter, nthreads, l, r);
+    parent_cv(l, r, 0, out);
+}
+
+void blake3_hash(const unsigned char *data, size_t len, unsigned char out[BLAKE3_OUT_LEN], int nthreads) {
+    uint32_t cv[8];
+    if (nthreads < 1) nthreads = 1;
+    if (len <= CHUNK_LEN) {
+        chunk_cv(data, len, 0, ROOT, cv);
+    } else {
+        uint32_t l[8], r[8];
+        split_cvs(data, len, 0, nthreads, l, r);
+        parent_cv(l, r, ROOT, cv);
+    }
+    for (int i = 0; i < 8; ++i) store32(out + 4 * i, cv[i]);
+}
+
+void blake3_hasher_init(Blake3Hasher *h) {
+    h->stack_len = 0;
+    h->chunks = 0;
+    h->buf_len = 0;
+}
+
+// Push a finished (non-final) chunk, first merging every subtree it completes.
+static void hasher_push_cv(Blake3Hasher *h, uint32_t cv[8]) {
+    uint64_t total = h->chunks + 1;
+    while ((total & 1) == 0) {
+        parent_cv(h->cv_stack[--h->stack_len], cv, 0, cv);
+        total >>= 1;
+    }
+    memcpy(h->cv_stack[h->stack_len++], cv, 8 * sizeof(uint32_t));
+    h->chunks++;
+}
+
+void blake3_hasher_update(Blake3Hasher *h, const unsigned char *data, size_t len) {
+    while (len > 0) {
+        // a buffered chunk is only finished once we know more input follows
+        if (h->buf_len == CHUNK_LEN) {
+            uint32_t cv[8];
+            chunk_cv(h->buf, CHUNK_LEN, h->chunks, 0, cv);
+            hasher_push_cv(h, cv);
+            h->buf_len = 0;
+        }
+        if (h->buf_len == 0 && len > CHUNK_LEN) {
+            // whole chunks straight from the caller's buffer, SIMD batched;
+            // always leave at least one byte for the buffer
+            size_t n = (len - 1) / CHUNK_LEN;
+            if (n > BATCH_CHUNKS) n = BATCH_CHUNKS;
+            uint32_t cvs[BATCH_CHUNKS][8];
+            hash_full_chunks(data, n, h->chunks, cvs);
+            for (size_t i = 0; i < n; ++i) hasher_push_cv(h, cvs[i]);
+            data += n * CHUNK_LEN;
+            len -= n * CHUNK_LEN;
+            continue;
+        }
+        size_t take = CHUNK_LEN - h->buf_len;
+        if (take > len) take = len;
+        memcpy(h->buf + h->buf_len, data, take);
+        h->buf_len += take;
+        data += take;
+        len -= take;
+    }
+}
+
+void blake3_hasher_finalize(const Blake3Hasher *h, unsigned char out[BLAKE3_OUT_LEN]) {
+    uint32_t cv[8];
+    chunk_cv(h->buf, h->buf_len, h->chunks, h->stack_len == 0 ? ROOT : 0, cv);
+    for (size_t i = h->stack_len; i-- > 0; )
+        parent_cv(h->cv_stack[i], cv, i == 0 ? ROOT : 0, cv);
+    for (int i = 0; i < 8; ++i) store32(out + 4 * i, cv[i]);
+}
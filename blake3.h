@@ -0,0 +1,38 @@
+// blake3.h
+// BLAKE3 (unkeyed, 32-byte output) for chunk digests. Full 1 KiB BLAKE3
+// chunks are compressed 8 or 16 at a time with AVX2 / AVX-512 when the build
+// targets them, and large inputs can be split into subtrees hashed on
+// several threads.
+
+#ifndef BLAKE3_H
+#define BLAKE3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLAKE3_OUT_LEN   32
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54
+
+// Incremental hasher: finished chunk chaining values are merged on a stack
+// as soon as a subtree is complete, so memory stays O(log n).
+typedef struct {
+    uint32_t cv_stack[BLAKE3_MAX_DEPTH][8];
+    size_t stack_len;
+    uint64_t chunks;                        // chunks pushed onto the stack
+    unsigned char buf[BLAKE3_CHUNK_LEN];    // current, not yet finished chunk
+    size_t buf_len;
+} Blake3Hasher;
+
+void blake3_hasher_init(Blake3Hasher *h);
+void blake3_hasher_update(Blake3Hasher *h, const unsigned char *data, size_t len);
+void blake3_hasher_finalize(const Blake3Hasher *h, unsigned char out[BLAKE3_OUT_LEN]);
+
+// Hash 'len' bytes of 'data' using up to 'nthreads' threads (<= 1 means
+// hash on the calling thread only).
+void blake3_hash(const unsigned char *data, size_t len, unsigned char out[BLAKE3_OUT_LEN], int nthreads);
+
+// Name of the SIMD kernel compiled in ("avx512", "avx2" or "portable").
+const char *blake3_simd_name(void);
+
+#endif
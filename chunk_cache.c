@@ -0,0 +1,277 @@
+// chunk_cache.c
+// Sharded W-TinyLFU cache of decompressed chunks.
+
+#include <stdlib.h>
+#include <string.h>
+#include "chunk_cache.h"
+
+#define CACHE_BUCKETS 1024
+// share of each shard given to the admission window; chunks are large, so
+// this is much more than the usual 1% to hold a few of them
+#define CACHE_WINDOW_DIV 8
+
+static uint64_t cache_hash(uint32_t archive, uint32_t chunk) {
+    uint64_t h = ((uint64_t)archive << 32 | chunk) * 0x9e3779b97f4a7c15ull;
+    return h ^ (h >> 29);
+}
+
+static CacheShard *shard_of(ChunkCache *c, uint64_t h) {
+    return &c->shard[h % (uint64_t)c->nshards];
+}
+
+static CacheEntry **bucket_of(ChunkCache *c, CacheShard *s, uint64_t h) {
+    return &s->buckets[(h / (uint64_t)c->nshards) % s->nbuckets];
+}
+
+int chunk_cache_init(ChunkCache *c, size_t capacity, size_t max_entry) {
+    // at least four of the largest chunks per shard
+    size_t n = max_entry ? capacity / (4 * max_entry) : CACHE_MAX_SHARDS;
+    c->nshards = n < 1 ? 1 : n > CACHE_MAX_SHARDS ? CACHE_MAX_SHARDS : (int)n;
+    for (int i = 0; i < c->nshards; ++i) {
+        CacheShard *s = &c->shard[i];
+        memset(s, 0, sizeof(*s));
+        pthread_mutex_init(&s->lock, NULL);
+        s->nbuckets = CACHE_BUCKETS;
+        s->buckets = (CacheEntry**)calloc(s->nbuckets, sizeof(CacheEntry*));
+        if (!s->buckets) return -1;
+        size_t cap = capacity / (size_t)c->nshards;
+        // the window must fit a whole chunk, or a chunk being read piecewise
+        // would be decoded again for every piece until it earned admission
+        s->window.capacity = cap / CACHE_WINDOW_DIV;
+        if (s->window.capacity < max_entry) s->window.capacity = max_entry < cap / 2 ? max_entry : cap / 2;
+        s->main.capacity = cap - s->window.capacity;
+        s->stats.capacity = cap;
+    }
+    return 0;
+}
+
+static void entry_free(CacheEntry *e) {
+    free(e->data);
+    free(e);
+}
+
+static void ring_free(ClockRing *r) {
+    CacheEntry *e = r->hand;
+    if (!e) return;
+    e->prev->next = NULL;
+    while (e) {
+        CacheEntry *next = e->next;
+        entry_free(e);
+        e = next;
+    }
+    r->hand = NULL;
+}
+
+void chunk_cache_destroy(ChunkCache *c) {
+    for (int i = 0; i < c->nshards; ++i) {
+        CacheShard *s = &c->shard[i];
+        ring_free(&s->window);
+        ring_free(&s->main);
+        free(s->buckets);
+        pthread_mutex_destroy(&s->lock);
+    }
+}
+
+// Count-min sketch of access frequency, 8-bit saturating counters, halved
+// periodically so old popularity fades.
+static void sketch_add(CacheShard *s, uint64_t h) {
+    for (int r = 0; r < CACHE_SKETCH_ROWS; ++r) {
+        uint8_t *ctr = &s->sketch[r][(h >> (r * 16)) % CACHE_SKETCH_WIDTH];
+        if (*ctr < 255) (*ctr)++;
+    }
+    if (++s->sketch_adds >= 10 * CACHE_SKETCH_WIDTH) {
+        for (int r = 0; r < CACHE_SKETCH_ROWS; ++r)
+            for (int i = 0; i < CACHE_SKETCH_WIDTH; ++i) s->sketch[r][i] >>= 1;
+        s->sketch_adds /= 2;
+    }
+}
+
+static unsigned sketch_freq(const CacheShard *s, uint64_t h) {
+    unsigned f = 255;
+    for (int r = 0; r < CACHE_SKETCH_ROWS; ++r) {
+        unsigned v = s->sketch[r][(h >> (r * 16)) % CACHE_SKETCH_WIDTH];
+        if (v < f) f = v;
+    }
+    return f;
+}
+
+// New entries go just behind the hand, so they are examined last.
+static void ring_insert(ClockRing *r, CacheEntry *e) {
+    if (!r->hand) {
+        e->prev = e->next = e;
+        r->hand = e;
+    } else {
+        e->next = r->hand;
+        e->prev = r->hand->prev;
+        e->prev->next = e;
+        r->hand->prev = e;
+    }
+    r->bytes += e->size;
+}
+
+static void ring_remove(ClockRing *r, CacheEntry *e) {
+    if (e->next == e) {
+        r->hand = NULL;
+    } else {
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+        if (r->hand == e) r->hand = e->next;
+    }
+    e->prev = e->next = NULL;
+    r->bytes -= e->size;
+}
+
+// Sweep the hand past referenced entries, clearing their bit; the first
+// unreferenced one is the victim. Ring must be non-empty.
+static CacheEntry *clock_victim(ClockRing *r) {
+    for (;;) {
+        CacheEntry *e = r->hand;
+        if (!e->referenced) return e;
+        e->referenced = 0;
+        r->hand = e->next;
+    }
+}
+
+static void bucket_remove(ChunkCache *c, CacheShard *s, CacheEntry *e) {
+    CacheEntry **pp = bucket_of(c, s, cache_hash(e->archive, e->chunk));
+    while (*pp && *pp != e) pp = &(*pp)->hnext;
+    if (*pp) *pp = e->hnext;
+}
+
+// Drop e from the cache; held entries are freed by the last release.
+static void shard_drop(ChunkCache *c, CacheShard *s, ClockRing *r, CacheEntry *e) {
+    ring_remove(r, e);
+    bucket_remove(c, s, e);
+    s->stats.entries--;
+    s->stats.bytes -= e->size;
+    if (--e->refs == 0) entry_free(e);
+}
+
+// A candidate (already indexed, in no ring) asks for a place in main. It
+// gets one if main has room, or if it is more frequently used than main's
+// CLOCK victim, which is then evicted (with more, until it fits).
+static void admit_to_main(ChunkCache *c, CacheShard *s, CacheEntry *cand) {
+    int admit = cand->size <= s->main.capacity;
+    if (admit && s->main.bytes + cand->size > s->main.capacity) {
+        CacheEntry *victim = clock_victim(&s->main);
+        admit = sketch_freq(s, cache_hash(cand->archive, cand->chunk))
+              > sketch_freq(s, cache_hash(victim->archive, victim->chunk));
+    }
+    if (!admit) {
+        s->stats.rejected++;
+        // not in a ring: undo the indexing done at insert time
+        bucket_remove(c, s, cand);
+        s->stats.entries--;
+        s->stats.bytes -= cand->size;
+        if (--cand->refs == 0) entry_free(cand);
+        return;
+    }
+    while (s->main.bytes + cand->size > s->main.capacity) {
+        shard_drop(c, s, &s->main, clock_victim(&s->main));
+        s->stats.evicted++;
+    }
+    cand->in_main = 1;
+    cand->referenced = 0;
+    ring_insert(&s->main, cand);
+    s->stats.admitted++;
+}
+
+static CacheEntry *lookup(ChunkCache *c, uint32_t archive, uint32_t chunk, int access) {
+    uint64_t h = cache_hash(archive, chunk);
+    CacheShard *s = shard_of(c, h);
+    pthread_mutex_lock(&s->lock);
+    if (access) sketch_add(s, h);
+    CacheEntry *e = *bucket_of(c, s, h);
+    while (e && (e->archive != archive || e->chunk != chunk)) e = e->hnext;
+    if (e) e->refs++;
+    if (access) {
+        if (e) {
+            e->referenced = 1;
+            s->stats.hits++;
+        } else {
+            s->stats.misses++;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return e;
+}
+
+CacheEntry *chunk_cache_get(ChunkCache *c, uint32_t archive, uint32_t chunk) {
+    return lookup(c, archive, chunk, 1);
+}
+
+CacheEntry *chunk_cache_peek(ChunkCache *c, uint32_t archive, uint32_t chunk) {
+    return lookup(c, archive, chunk, 0);
+}
+
+CacheEntry *chunk_cache_put(ChunkCache *c, uint32_t archive, uint32_t chunk, unsigned char *data, size_t size) {
+    CacheEntry *ne = (CacheEntry*)calloc(1, sizeof(CacheEntry));
+    if (!ne) { free(data); return NULL; }
+    ne->archive = archive;
+    ne->chunk = chunk;
+    ne->data = data;
+    ne->size = size;
+
+    uint64_t h = cache_hash(archive, chunk);
+    CacheShard *s = shard_of(c, h);
+    pthread_mutex_lock(&s->lock);
+    CacheEntry **bucket = bucket_of(c, s, h);
+    CacheEntry *e = *bucket;
+    while (e && (e->archive != archive || e->chunk != chunk)) e = e->hnext;
+    if (e) {
+        e->refs++;
+        pthread_mutex_unlock(&s->lock);
+        entry_free(ne);
+        return e;
+    }
+    if (size > s->main.capacity) {
+        // too big to cache: hand it to the caller only
+        ne->refs = 1;
+        pthread_mutex_unlock(&s->lock);
+        return ne;
+    }
+    ne->refs = 2;
+    ne->hnext = *bucket;
+    *bucket = ne;
+    s->stats.entries++;
+    s->stats.bytes += size;
+    if (size > s->window.capacity) {
+        admit_to_main(c, s, ne);
+    } else {
+        // make room in the window; what leaves it competes for main
+        while (s->window.bytes + size > s->window.capacity) {
+            CacheEntry *cand = clock_victim(&s->window);
+            ring_remove(&s->window, cand);
+            admit_to_main(c, s, cand);
+        }
+        ring_insert(&s->window, ne);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return ne;
+}
+
+void chunk_cache_release(ChunkCache *c, CacheEntry *e) {
+    if (!e) return;
+    CacheShard *s = shard_of(c, cache_hash(e->archive, e->chunk));
+    pthread_mutex_lock(&s->lock);
+    int last = --e->refs == 0;
+    pthread_mutex_unlock(&s->lock);
+    if (last) entry_free(e);
+}
+
+void chunk_cache_stats(ChunkCache *c, CacheStats *out) {
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < c->nshards; ++i) {
+        CacheShard *s = &c->shard[i];
+        pthread_mutex_lock(&s->lock);
+        out->hits += s->stats.hits;
+        out->misses += s->stats.misses;
+        out->admitted += s->stats.admitted;
+        out->rejected += s->stats.rejected;
+        out->evicted += s->stats.evicted;
+        out->bytes += s->stats.bytes;
+        out->entries += s->stats.entries;
+        out->capacity += s->stats.capacity;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
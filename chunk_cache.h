@@ -0,0 +1,90 @@
+// chunk_cache.h
+// Size-bounded cache of decompressed chunks shared by reader threads, keyed
+// by (archive, chunk index). The key space is split over shards, each with
+// its own lock, so concurrent readers rarely contend.
+//
+// Each shard is a W-TinyLFU cache: new chunks enter a small CLOCK window,
+// and a chunk leaving the window only displaces a chunk of the main CLOCK
+// area if a count-min sketch of recent accesses says it is used more often.
+// A one-off scan through a large file therefore cannot flush the hot
+// chunks (headers, index pages), while a chunk prefetched just before it
+// is read still gets its window slot.
+
+#ifndef CHUNK_CACHE_H
+#define CHUNK_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define CACHE_MAX_SHARDS 16
+#define CACHE_SKETCH_ROWS 4
+#define CACHE_SKETCH_WIDTH 4096
+
+typedef struct CacheEntry {
+    uint32_t archive;
+    uint32_t chunk;
+    unsigned char *data;
+    size_t size;
+    int refs;                          // holders, plus one while cached
+    int referenced;                    // CLOCK bit, set on every hit
+    int in_main;
+    struct CacheEntry *prev, *next;    // CLOCK ring (window or main)
+    struct CacheEntry *hnext;          // hash bucket chain
+} CacheEntry;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t admitted;     // window chunks that won their place in main
+    uint64_t rejected;     // window chunks the frequency filter turned away
+    uint64_t evicted;      // main chunks displaced by admitted ones
+    uint64_t bytes;
+    uint64_t entries;
+    uint64_t capacity;
+} CacheStats;
+
+typedef struct {
+    CacheEntry *hand;      // NULL when empty
+    size_t bytes;
+    size_t capacity;
+} ClockRing;
+
+typedef struct {
+    pthread_mutex_t lock;
+    CacheEntry **buckets;
+    size_t nbuckets;
+    ClockRing window, main;
+    uint8_t sketch[CACHE_SKETCH_ROWS][CACHE_SKETCH_WIDTH];
+    uint32_t sketch_adds;  // counters are halved every 10 x width accesses
+    CacheStats stats;
+} CacheShard;
+
+typedef struct {
+    int nshards;
+    CacheShard shard[CACHE_MAX_SHARDS];
+} ChunkCache;
+
+// 'max_entry' is the largest chunk expected; shards are kept large enough
+// for several of them.
+int chunk_cache_init(ChunkCache *c, size_t capacity, size_t max_entry);
+void chunk_cache_destroy(ChunkCache *c);
+
+// Returns a held entry, or NULL on a miss. Pass held entries back to
+// chunk_cache_release(); they stay valid even if evicted meanwhile.
+CacheEntry *chunk_cache_get(ChunkCache *c, uint32_t archive, uint32_t chunk);
+
+// Like chunk_cache_get, but not counted as an access (for prefetching, which
+// would otherwise make every chunk of a scan look used twice).
+CacheEntry *chunk_cache_peek(ChunkCache *c, uint32_t archive, uint32_t chunk);
+
+// Insert a chunk, taking ownership of 'data' (malloc'd). Returns a held
+// entry: the new one, or the existing one if another thread got there first.
+CacheEntry *chunk_cache_put(ChunkCache *c, uint32_t archive, uint32_t chunk, unsigned char *data, size_t size);
+
+void chunk_cache_release(ChunkCache *c, CacheEntry *e);
+
+// Totals over all shards.
+void chunk_cache_stats(ChunkCache *c, CacheStats *out);
+
+#endif
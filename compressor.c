@@ -1,108 +1,1065 @@
 // compressor.c
-// CPU-only multithreaded compressor using ZSTD + SHA256 (EVP).
-// Writes compress/<basename>.cmp (binary) and compress/<basename>.meta (text).
+// CPU-only multithreaded compressor using ZSTD + SHA256 (EVP) or BLAKE3.
+// The .meta index also records a Merkle root over the chunk hashes.
+// Writes compress/<basename>.cmp (binary) and compress/<basename>.meta (text);
+// with --volume-size the .cmp is split into <basename>.cmp.001, .002, ...
 
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#define ZSTD_STATIC_LINKING_ONLY   // ZSTD_getCParams, for the chunk size tuner
 #include <zstd.h>
-#include <openssl/evp.h>
 #include <pthread.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include "hash.h"
+#include "archive.h"
+#include "cpus.h"
+#include "hugemem.h"
+#include "perfctr.h"
+#include "jobqueue.h"
+#include "mp4.h"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// fused mode walks each chunk in slices small enough to stay in L2
+#define FUSED_SLICE (256 * 1024)
+// default seconds between checkpoints when --resume is given without --checkpoint
+#define CHECKPOINT_INTERVAL 60
+// chunks of at least SEEK_MIN_CHUNK are stored as seek frames of
+// SEEK_FRAME_SIZE unless --frame-size says otherwise; smaller chunks already
+// bound the work of a random read
+#define SEEK_FRAME_SIZE (256 * 1024)
+#define SEEK_MIN_CHUNK (16 * 1024 * 1024)
+// --container mp4: metadata boxes are small and read first, so they get the
+// strongest level; mdat is already entropy coded, so a fast level finds what
+// little there is, and chunks it cannot shrink by 1/RAW_MIN_GAIN are stored
+// raw, which readers copy without decoding
+#define MP4_META_LEVEL 19
+#define MP4_MEDIA_LEVEL 1
+#define RAW_MIN_GAIN 64
 
 typedef struct {
     int id;
     unsigned char *data;   // original chunk bytes
+    uint64_t in_offset;    // where the chunk starts in the input file
     size_t orig_size;
     unsigned char *cdata;  // compressed data
     size_t csize;
-    unsigned char sha256[32];
+    uint64_t csize64;      // on-disk record header, points into the writer's iovec
+    uint32_t vol;          // volume holding the record (0 without --volume-size)
+    uint64_t out_offset;   // where the record starts in its volume
+    ChunkKind kind;
+    unsigned char digest[HASH_SIZE];
+    uint32_t nframes;      // seek frames in cdata, 0 for a single frame
+    uint64_t *frame_csize;
+    int level;             // ZSTD level for this chunk; 0: the run's level
+    Filter filter;         // applied to the input bytes before ZSTD
+    int media;             // stored raw unless ZSTD saves at least 1/RAW_MIN_GAIN
 } ChunkJob;
 
+// The .cmp output: one file, or volumes <prefix>.001, .002, ... that are
+// opened (and truncated) the first time a record lands in them.
 typedef struct {
-    ChunkJob *jobs;
-    int count;
-    int next_idx;
+    char prefix[1024];     // <compress_dir>/<basename>.cmp
+    int split;
+    int *fds;              // per volume, -1 until opened
+    uint32_t cap;
     pthread_mutex_t lock;
-} JobQueue;
+} VolumeSet;
+
+static void volume_name(const VolumeSet *vs, uint32_t v, char *out, size_t len) {
+    if (vs->split) snprintf(out, len, "%s.%03u", vs->prefix, v + 1);
+    else snprintf(out, len, "%s", vs->prefix);
+}
+
+// fd of volume v; 'create' opens a volume not yet open as a new, empty file,
+// otherwise the existing file is opened as is (resume).
+static int volume_fd(VolumeSet *vs, uint32_t v, int create) {
+    if (v >= vs->cap) { errno = EFBIG; return -1; }
+    pthread_mutex_lock(&vs->lock);
+    if (vs->fds[v] < 0) {
+        char path[1100];
+        volume_name(vs, v, path, sizeof(path));
+        vs->fds[v] = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+    }
+    int fd = vs->fds[v];
+    pthread_mutex_unlock(&vs->lock);
+    return fd;
+}
 
-static void jobqueue_init(JobQueue *q, ChunkJob *jobs, int count) {
-    q->jobs = jobs;
-    q->count = count;
-    q->next_idx = 0;
-    pthread_mutex_init(&q->lock, NULL);
+static int volumes_sync(VolumeSet *vs) {
+    int rc = 0;
+    pthread_mutex_lock(&vs->lock);
+    for (uint32_t v = 0; v < vs->cap; ++v)
+        if (vs->fds[v] >= 0 && fdatasync(vs->fds[v]) != 0) rc = -1;
+    pthread_mutex_unlock(&vs->lock);
+    return rc;
 }
 
-static ChunkJob* jobqueue_pop(JobQueue *q) {
-    pthread_mutex_lock(&q->lock);
-    if (q->next_idx >= q->count) { pthread_mutex_unlock(&q->lock); return NULL; }
-    ChunkJob *j = &q->jobs[q->next_idx++];
-    pthread_mutex_unlock(&q->lock);
-    return j;
+// Close every volume; returns the number of volumes written, or -1 if a
+// close failed.
+static int volumes_close(VolumeSet *vs) {
+    int n = 0, rc = 0;
+    for (uint32_t v = 0; v < vs->cap; ++v) {
+        if (vs->fds[v] < 0) continue;
+        if (close(vs->fds[v]) != 0) rc = -1;
+        vs->fds[v] = -1;
+        n = (int)v + 1;
+    }
+    return rc == 0 ? n : -1;
 }
 
+// Parallel emission: workers publish their compressed size and a lock-free
+// prefix sum over chunk order hands out offsets in the .cmp stream (all
+// volumes back to back). 'frontier' is the first chunk that has not been
+// sized yet; offsets[i] and vol[i] are final once frontier > i.
+typedef struct {
+    ChunkJob *jobs;
+    int count;
+    VolumeSet *vols;
+    uint64_t volume_size;
+    atomic_int frontier;
+    atomic_uint_least64_t *offsets;   // count + 1 entries
+    atomic_uint *vol;                 // volume of each record
+    atomic_uint_least64_t *vol_start; // stream offset where each volume begins
+    atomic_int *sized;                // per-chunk "csize published" flag
+    atomic_int *written;              // per-chunk "record is in the file" flag
+    atomic_int err;
+} EmitState;
+
+// Digests of constant-fill and hole chunks, keyed by (byte, length). A sparse
+// image has thousands of identical zero chunks; each distinct one is hashed
+// once.
+#define FILL_CACHE_SLOTS 16
+typedef struct {
+    pthread_mutex_t lock;
+    int n;
+    struct { int byte; size_t len; unsigned char digest[HASH_SIZE]; } e[FILL_CACHE_SLOTS];
+} FillCache;
+
 typedef struct {
     JobQueue *queue;
+    ChunkJob *jobs;        // indexed by what the queue hands out
+    FillCache *fills;
+    int fdin;
+    int sparse;            // the input has holes: read only its data extents
+    atomic_int read_err;
     int zstd_level;
+    HashAlgo hash_algo;
+    int hash_threads;      // intra-chunk hashing threads (BLAKE3 only)
+    int fused;             // hash and compress each slice while it is cache-hot
+    size_t frame_size;     // split larger chunks into seek frames; 0: never
+    Filter filter;         // --filter for every chunk
+    int filter_auto;       // --filter auto: pick one per chunk from a sample
+    HugeMode huge_mode;    // backing of the per-worker ZSTD context
+    PerfTotals *perf;      // --perf (profile builds): counters per chunk; else NULL
+    EmitState *emit;       // NULL => records are written after all workers finish
 } WorkerArg;
 
-static void compute_sha256_evp(const unsigned char *data, size_t len, unsigned char out[32]) {
-    EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
-    if (!mdctx) { memset(out, 0, 32); return; }
-    EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL);
-    EVP_DigestUpdate(mdctx, data, len);
-    unsigned int outlen = 0;
-    EVP_DigestFinal_ex(mdctx, out, &outlen);
-    EVP_MD_CTX_free(mdctx);
+// Returns the byte value if every byte of the chunk equals it, else -1.
+// Non-fill data almost always differs within the first vector, so the cost
+// on ordinary chunks is negligible; fill chunks are scanned at memory speed.
+static int detect_fill(const unsigned char *p, size_t len) {
+    unsigned char b = p[0];
+    size_t i = 0;
+#ifdef __AVX2__
+    const __m256i want = _mm256_set1_epi8((char)b);
+    while (i + 128 <= len) {
+        __m256i d = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p + i)), want);
+        d = _mm256_or_si256(d, _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p + i + 32)), want));
+        d = _mm256_or_si256(d, _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p + i + 64)), want));
+        d = _mm256_or_si256(d, _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p + i + 96)), want));
+        if (!_mm256_testz_si256(d, d)) return -1;
+        i += 128;
+    }
+#endif
+    for (; i < len; ++i) if (p[i] != b) return -1;
+    return b;
+}
+
+static void fill_digest(FillCache *fc, HashAlgo algo, const ChunkJob *job, int byte, unsigned char out[HASH_SIZE]) {
+    pthread_mutex_lock(&fc->lock);
+    for (int i = 0; i < fc->n; ++i) {
+        if (fc->e[i].byte == byte && fc->e[i].len == job->orig_size) {
+            memcpy(out, fc->e[i].digest, HASH_SIZE);
+            pthread_mutex_unlock(&fc->lock);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&fc->lock);
+
+    // a hole has no data read; its bytes are zeros all the same
+    if (job->data) hash_chunk(algo, job->data, job->orig_size, out, 1);
+    else hash_zeros(algo, job->orig_size, out);
+
+    pthread_mutex_lock(&fc->lock);
+    if (fc->n < FILL_CACHE_SLOTS) {
+        fc->e[fc->n].byte = byte;
+        fc->e[fc->n].len = job->orig_size;
+        memcpy(fc->e[fc->n].digest, out, HASH_SIZE);
+        fc->n++;
+    }
+    pthread_mutex_unlock(&fc->lock);
+}
+
+// compress with ZSTD using the worker's context; on failure the chunk is
+// recorded with csize 0
+static void compress_chunk(ZSTD_CCtx *cctx, ChunkJob *job, int level) {
+    if (!cctx) { job->cdata = NULL; job->csize = 0; return; }
+
+    size_t bound = ZSTD_compressBound(job->orig_size);
+    job->cdata = (unsigned char*)malloc(bound);
+    if (!job->cdata) { job->csize = 0; return; }
+
+    size_t csz = ZSTD_compressCCtx(cctx, job->cdata, bound, job->data, job->orig_size, level);
+    if (ZSTD_isError(csz)) {
+        free(job->cdata);
+        job->cdata = NULL;
+        job->csize = 0;
+    } else {
+        job->csize = csz;
+    }
+}
+
+// Single pass over the chunk: each FUSED_SLICE is hashed and then fed to the
+// streaming compressor while it is still in cache, instead of hashing the
+// whole chunk and then re-reading it from DRAM to compress it. The chunk is
+// one stable input buffer that grows by a slice per call, so ZSTD matches
+// against it in place rather than copying each slice into its own window.
+static void hash_compress_fused(ZSTD_CCtx *cctx, ChunkJob *job, int level, HashAlgo algo) {
+    HashState hs;
+    job->cdata = NULL;
+    job->csize = 0;
+    if (hash_init(&hs, algo) != 0) { memset(job->digest, 0, HASH_SIZE); return; }
+
+    size_t bound = ZSTD_compressBound(job->orig_size);
+    unsigned char *cdata = cctx ? (unsigned char*)malloc(bound) : NULL;
+    int ok = cdata != NULL
+             && !ZSTD_isError(ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters))
+             && !ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level))
+             && !ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_stableInBuffer, 1))
+             && !ZSTD_isError(ZSTD_CCtx_setPledgedSrcSize(cctx, job->orig_size));
+
+    ZSTD_outBuffer out = { cdata, bound, 0 };
+    ZSTD_inBuffer in = { job->data, 0, 0 };
+    size_t pos = 0;
+    do {
+        size_t n = job->orig_size - pos;
+        if (n > FUSED_SLICE) n = FUSED_SLICE;
+        hash_update(&hs, job->data + pos, n);
+        pos += n;
+        if (!ok) continue;
+        in.size = pos;
+        ZSTD_EndDirective mode = pos == job->orig_size ? ZSTD_e_end : ZSTD_e_continue;
+        size_t rem;
+        do {
+            rem = ZSTD_compressStream2(cctx, &out, &in, mode);
+            if (ZSTD_isError(rem)) { ok = 0; break; }
+        } while (mode == ZSTD_e_end ? rem != 0 : in.pos < in.size);
+    } while (pos < job->orig_size);
+    hash_final(&hs, job->digest);
+
+    if (ok) {
+        job->cdata = cdata;
+        job->csize = out.pos;
+    } else {
+        free(cdata);
+    }
+}
+
+// Seekable layout for chunks over frame_size: the payload is a run of
+// independent ZSTD frames of frame_size input bytes (the last one shorter),
+// and their compressed sizes go to the .meta seek table. With 'fused', each
+// frame is hashed right before it is compressed, while it is in cache;
+// otherwise the caller has hashed the chunk up front.
+static void compress_frames(ZSTD_CCtx *cctx, ChunkJob *job, int level, size_t frame_size, HashAlgo algo, int fused) {
+    HashState hs;
+    job->cdata = NULL;
+    job->csize = 0;
+    if (fused && hash_init(&hs, algo) != 0) { memset(job->digest, 0, HASH_SIZE); return; }
+
+    uint32_t n = (uint32_t)((job->orig_size + frame_size - 1) / frame_size);
+    size_t bound = (size_t)n * ZSTD_compressBound(frame_size);
+    unsigned char *cdata = cctx ? (unsigned char*)malloc(bound) : NULL;
+    uint64_t *fc = (uint64_t*)malloc((size_t)n * sizeof(uint64_t));
+    int ok = cdata && fc;
+    size_t pos = 0, out = 0;
+    for (uint32_t f = 0; f < n; ++f) {
+        size_t len = job->orig_size - pos < frame_size ? job->orig_size - pos : frame_size;
+        if (fused) hash_update(&hs, job->data + pos, len);
+        if (ok) {
+            size_t c = ZSTD_compressCCtx(cctx, cdata + out, bound - out, job->data + pos, len, level);
+            if (ZSTD_isError(c)) ok = 0;
+            else { fc[f] = c; out += c; }
+        }
+        pos += len;
+    }
+    if (fused) hash_final(&hs, job->digest);
+
+    if (ok) {
+        job->cdata = cdata;
+        job->csize = out;
+        job->nframes = n;
+        job->frame_csize = fc;
+    } else {
+        free(cdata);
+        free(fc);
+    }
+}
+
+// --filter auto tries each candidate on a sample from the middle of the
+// chunk at a fast level; a filter has to save 1/FILTER_MIN_GAIN of the
+// unfiltered sample to be used. The sample starts 64-byte aligned, so
+// element boundaries line up with the chunk's.
+#define FILTER_SAMPLE (64 * 1024)
+#define FILTER_PROBE_LEVEL 3
+#define FILTER_MIN_GAIN 32
+static const Filter filter_candidates[] = {
+    { FILTER_DELTA, 1 }, { FILTER_DELTA, 2 }, { FILTER_DELTA, 4 }, { FILTER_BCJ, 0 },
+    { FILTER_SHUFFLE, 2 }, { FILTER_SHUFFLE, 4 }, { FILTER_SHUFFLE, 8 },
+    { FILTER_BITSHUFFLE, 1 }, { FILTER_BITSHUFFLE, 4 }, { FILTER_BITSHUFFLE, 8 },
+};
+
+static Filter choose_filter(ZSTD_CCtx *cctx, const unsigned char *data, size_t len) {
+    Filter best = { FILTER_NONE, 0 };
+    size_t n = len < FILTER_SAMPLE ? len : FILTER_SAMPLE;
+    const unsigned char *sample = data + (((len - n) / 2) & ~(size_t)63);
+    size_t bound = ZSTD_compressBound(n);
+    unsigned char *tmp = (unsigned char*)malloc(n);
+    unsigned char *out = (unsigned char*)malloc(bound);
+    if (cctx && tmp && out) {
+        size_t c = ZSTD_compressCCtx(cctx, out, bound, sample, n, FILTER_PROBE_LEVEL);
+        size_t best_size = ZSTD_isError(c) ? n : c - c / FILTER_MIN_GAIN;
+        for (size_t k = 0; k < sizeof(filter_candidates) / sizeof(filter_candidates[0]); ++k) {
+            filter_encode(&filter_candidates[k], tmp, sample, n, 0);
+            c = ZSTD_compressCCtx(cctx, out, bound, tmp, n, FILTER_PROBE_LEVEL);
+            if (!ZSTD_isError(c) && c < best_size) {
+                best_size = c;
+                best = filter_candidates[k];
+            }
+        }
+    }
+    free(tmp);
+    free(out);
+    return best;
+}
+
+// The digest covers the input bytes; then a filtered copy replaces them and
+// is compressed as usual, frame by frame if the chunk is framed (each frame
+// is its own filter block, so frames still decode on their own).
+static void compress_filtered(ZSTD_CCtx *cctx, ChunkJob *job, int level, Filter flt, size_t frame_size,
+                              HashAlgo algo, int hash_threads) {
+    hash_chunk(algo, job->data, job->orig_size, job->digest, hash_threads);
+    unsigned char *fdata = (unsigned char*)malloc(job->orig_size);
+    if (!fdata) { job->cdata = NULL; job->csize = 0; return; }
+    int framed = frame_size && job->orig_size > frame_size;
+    filter_encode(&flt, fdata, job->data, job->orig_size, framed ? frame_size : 0);
+    free(job->data);
+    job->data = fdata;
+    job->filter = flt;
+    if (framed) compress_frames(cctx, job, level, frame_size, algo, 0);
+    else compress_chunk(cctx, job, level);
+}
+
+static void emit_publish(EmitState *es, ChunkJob *job);
+
+// A chunk that is only partly hole (see plan_chunks()) reads its data extents
+// and zero-fills the rest, so I/O scales with the data actually stored.
+static int pread_sparse(int fd, unsigned char *buf, size_t len, uint64_t off) {
+    uint64_t pos = off, end = off + len;
+    while (pos < end) {
+        off_t data = lseek(fd, (off_t)pos, SEEK_DATA);
+        if (data < 0) {
+            // no hole reporting: read the rest as is
+            if (errno != ENXIO) return pread_full(fd, buf + (pos - off), (size_t)(end - pos), (off_t)pos);
+            data = (off_t)end;
+        }
+        if ((uint64_t)data > end) data = (off_t)end;
+        memset(buf + (pos - off), 0, (size_t)((uint64_t)data - pos));
+        if ((uint64_t)data >= end) break;
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || (uint64_t)hole > end) hole = (off_t)end;
+        if (pread_full(fd, buf + ((uint64_t)data - off), (size_t)(hole - data), data) != 0) return -1;
+        pos = (uint64_t)hole;
+    }
+    return 0;
 }
 
 static void *worker_thread(void *varg) {
     WorkerArg *warg = (WorkerArg*)varg;
     JobQueue *q = warg->queue;
-    int level = warg->zstd_level;
+    // one context per worker for the whole run, its tables on huge pages;
+    // NULL (out of memory) makes every chunk fail as before
+    HugeArena *arena = huge_arena_new(warg->huge_mode);
+    ZSTD_CCtx *cctx = arena ? ZSTD_createCCtx_advanced(huge_arena_mem(arena)) : NULL;
+#ifdef PERF_COUNTERS
+    PerfGroup pg;
+    PerfSample before, after;
+    int counting = warg->perf && perf_group_open(&pg) == 0;
+#endif
 
     while (1) {
-        ChunkJob *job = jobqueue_pop(q);
-        if (!job) break;
+        int idx = jobqueue_pop(q);
+        if (idx < 0) break;
+        ChunkJob *job = &warg->jobs[idx];
 
-        // compute SHA256
-        compute_sha256_evp(job->data, job->orig_size, job->sha256);
+        // each worker reads its own chunk, so only in-flight chunks are in memory
+        if (job->kind != CHUNK_HOLE) {
+            job->data = (unsigned char*)malloc(job->orig_size);
+            int rd = !job->data ? -1
+                     : warg->sparse ? pread_sparse(warg->fdin, job->data, job->orig_size, job->in_offset)
+                     : pread_full(warg->fdin, job->data, job->orig_size, (off_t)job->in_offset);
+            if (rd != 0) {
+                fprintf(stderr, "chunk %d: read failed\n", job->id);
+                free(job->data);
+                job->data = NULL;
+                atomic_store(&warg->read_err, 1);
+                jobqueue_abort(q);
+                continue;
+            }
+        }
 
-        // compress with ZSTD using per-thread context
-        ZSTD_CCtx *cctx = ZSTD_createCCtx();
-        if (!cctx) { job->cdata = NULL; job->csize = 0; continue; }
+#ifdef PERF_COUNTERS
+        int sampled = counting && job->kind != CHUNK_HOLE && perf_group_read(&pg, &before) == 0;
+#endif
+        int level = job->level ? job->level : warg->zstd_level;
+        int fb = job->kind == CHUNK_HOLE ? -1 : detect_fill(job->data, job->orig_size);
+        // media chunks may be stored raw, which needs their input bytes
+        Filter flt = warg->filter;
+        if (job->media) flt.type = FILTER_NONE;
+        else if (warg->filter_auto && fb < 0 && job->kind != CHUNK_HOLE)
+            flt = choose_filter(cctx, job->data, job->orig_size);
+        if (job->kind == CHUNK_HOLE) {
+            // never read, nothing stored; hashed as the zeros it stands for
+            fill_digest(warg->fills, warg->hash_algo, job, 0, job->digest);
+        } else if (fb >= 0) {
+            // stored as a one-byte "fill byte x orig_size" record
+            fill_digest(warg->fills, warg->hash_algo, job, fb, job->digest);
+            job->kind = CHUNK_FILL;
+            job->cdata = (unsigned char*)malloc(1);
+            job->csize = job->cdata ? 1 : 0;
+            if (job->cdata) job->cdata[0] = (unsigned char)fb;
+        } else if (flt.type != FILTER_NONE) {
+            compress_filtered(cctx, job, level, flt, warg->frame_size, warg->hash_algo, warg->hash_threads);
+        } else if (warg->frame_size && job->orig_size > warg->frame_size) {
+            if (!warg->fused) hash_chunk(warg->hash_algo, job->data, job->orig_size, job->digest, warg->hash_threads);
+            compress_frames(cctx, job, level, warg->frame_size, warg->hash_algo, warg->fused);
+        } else if (warg->fused) {
+            hash_compress_fused(cctx, job, level, warg->hash_algo);
+        } else {
+            hash_chunk(warg->hash_algo, job->data, job->orig_size, job->digest, warg->hash_threads);
+            compress_chunk(cctx, job, level);
+        }
+        if (job->media && job->kind == CHUNK_ZSTD
+            && (!job->cdata || job->csize > job->orig_size - job->orig_size / RAW_MIN_GAIN)) {
+            // the input bytes become the payload; the digest is already taken
+            free(job->cdata);
+            free(job->frame_csize);
+            job->frame_csize = NULL;
+            job->nframes = 0;
+            job->cdata = job->data;
+            job->data = NULL;
+            job->csize = job->orig_size;
+            job->kind = CHUNK_RAW;
+        }
+#ifdef PERF_COUNTERS
+        if (sampled && perf_group_read(&pg, &after) == 0) perf_totals_add(warg->perf, &pg, &before, &after, job->orig_size);
+#endif
 
-        size_t bound = ZSTD_compressBound(job->orig_size);
-        job->cdata = (unsigned char*)malloc(bound);
-        if (!job->cdata) { ZSTD_freeCCtx(cctx); job->csize = 0; continue; }
+        // the original bytes are not needed once hashed and compressed
+        free(job->data);
+        job->data = NULL;
 
-        size_t csz = ZSTD_compressCCtx(cctx, job->cdata, bound, job->data, job->orig_size, level);
-        if (ZSTD_isError(csz)) {
-            free(job->cdata);
-            job->cdata = NULL;
-            job->csize = 0;
+        if (warg->emit) {
+            emit_publish(warg->emit, job);
+            if (q->window) jobqueue_notify(q);
+        }
+    }
+#ifdef PERF_COUNTERS
+    if (counting) perf_group_close(&pg);
+#endif
+    ZSTD_freeCCtx(cctx);
+    huge_arena_free(arena);
+    return NULL;
+}
+
+// Write the whole iovec at 'off', retrying on short writes and EINTR.
+static int pwritev_full(int fd, struct iovec *iov, int iovcnt, off_t off) {
+    while (iovcnt > 0) {
+        ssize_t w = pwritev(fd, iov, iovcnt, off);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        off += w;
+        while (iovcnt > 0 && (size_t)w >= iov->iov_len) {
+            w -= (ssize_t)iov->iov_len;
+            ++iov; --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + w;
+            iov->iov_len -= (size_t)w;
+        }
+    }
+    return 0;
+}
+
+static int write_chunk_record(VolumeSet *vols, ChunkJob *job) {
+    int fd = volume_fd(vols, job->vol, 1);
+    if (fd < 0) return -1;
+    struct iovec iov[2];
+    job->csize64 = (uint64_t)job->csize;
+    iov[0].iov_base = &job->csize64;
+    iov[0].iov_len = sizeof(uint64_t);
+    iov[1].iov_base = job->cdata;
+    iov[1].iov_len = job->csize;
+    return pwritev_full(fd, iov, job->csize > 0 ? 2 : 1, (off_t)job->out_offset);
+}
+
+// Chunks before 'first' are already in the file (resume); the record of
+// chunk 'first' starts at stream offset 'first_offset', and the one before it
+// ended in volume 'last_vol', which begins at stream offset 'last_vol_start'.
+static void emit_init(EmitState *es, ChunkJob *jobs, int count, VolumeSet *vols, uint64_t volume_size,
+                      int first, uint64_t first_offset, uint32_t last_vol, uint64_t last_vol_start) {
+    es->jobs = jobs;
+    es->count = count;
+    es->vols = vols;
+    es->volume_size = volume_size;
+    atomic_init(&es->frontier, first);
+    atomic_init(&es->err, 0);
+    es->offsets = (atomic_uint_least64_t*)malloc(((size_t)count + 1) * sizeof(*es->offsets));
+    es->vol = (atomic_uint*)malloc((size_t)count * sizeof(*es->vol));
+    es->vol_start = (atomic_uint_least64_t*)malloc((size_t)count * sizeof(*es->vol_start));
+    es->sized = (atomic_int*)malloc((size_t)count * sizeof(*es->sized));
+    es->written = (atomic_int*)malloc((size_t)count * sizeof(*es->written));
+    for (int i = 0; i < count; ++i) {
+        atomic_init(&es->offsets[i], i == first ? first_offset : 0);
+        atomic_init(&es->vol[i], i == first - 1 ? last_vol : 0);
+        atomic_init(&es->vol_start[i], 0);
+        atomic_init(&es->sized[i], i < first);
+        atomic_init(&es->written[i], i < first);
+    }
+    atomic_init(&es->offsets[count], first == count ? first_offset : 0);
+    if (first > 0) atomic_init(&es->vol_start[last_vol], last_vol_start);
+}
+
+static void emit_destroy(EmitState *es) {
+    free(es->offsets);
+    free(es->vol);
+    free(es->vol_start);
+    free(es->sized);
+    free(es->written);
+}
+
+// Publish job's compressed size, then push the frontier as far as the sized
+// prefix reaches. Whoever wins the CAS moving the frontier past chunk f owns
+// writing f: its offset is final and its size is known, so exactly one thread
+// writes every chunk and nobody waits on a predecessor that is still working.
+static void emit_publish(EmitState *es, ChunkJob *job) {
+    atomic_store(&es->sized[job->id], 1);
+    for (;;) {
+        int f = atomic_load(&es->frontier);
+        if (f >= es->count || !atomic_load(&es->sized[f])) return;
+        ChunkJob *fj = &es->jobs[f];
+        uint64_t start = atomic_load(&es->offsets[f]);
+        uint64_t reclen = sizeof(uint64_t) + fj->csize;
+        // racing threads compute the same values, so the stores are idempotent
+        unsigned v = 0;
+        if (f > 0) {
+            unsigned pv = atomic_load(&es->vol[f - 1]);
+            v = pv + volume_break(es->volume_size, start - atomic_load(&es->vol_start[pv]), reclen, 1);
+            if (v != pv) atomic_store(&es->vol_start[v], start);
+        }
+        atomic_store(&es->vol[f], v);
+        atomic_store(&es->offsets[f + 1], start + reclen);
+        if (!atomic_compare_exchange_strong(&es->frontier, &f, f + 1)) continue;
+
+        fj->vol = v;
+        fj->out_offset = start - atomic_load(&es->vol_start[v]);
+        if (write_chunk_record(es->vols, fj) != 0) {
+            int expected = 0;
+            atomic_compare_exchange_strong(&es->err, &expected, errno);
         } else {
-            job->csize = csz;
+            atomic_store(&es->written[f], 1);
+        }
+        free(fj->cdata);
+        fj->cdata = NULL;
+    }
+}
+
+typedef struct {
+    ChunkJob *jobs;
+    int first, last;       // half-open range of chunks owned by this writer
+    VolumeSet *vols;
+    int err;
+} WriterArg;
+
+// Each writer owns a contiguous run of chunks whose offsets were fixed by the
+// prefix sum in main(), so writers never touch the same bytes.
+static void *writer_thread(void *varg) {
+    WriterArg *wa = (WriterArg*)varg;
+    for (int i = wa->first; i < wa->last; ++i) {
+        if (write_chunk_record(wa->vols, &wa->jobs[i]) != 0) {
+            wa->err = errno;
+            return NULL;
         }
-        ZSTD_freeCCtx(cctx);
     }
     return NULL;
 }
 
-static size_t choose_chunk_size(size_t filesize) {
-    // Automatic chunk sizing depending on file size
-    // small files => small chunks; huge files => bigger chunks
-    const size_t KB = 1024;
-    const size_t MB = 1024 * KB;
+// Assign jobs[0..n) their volume and in-volume offset, record by record as
+// emit_publish() does. Returns the stream offset after the last record and
+// the volume it ended in, with that volume's starting stream offset.
+static uint64_t layout_records(ChunkJob *jobs, int n, uint64_t volume_size, uint32_t *last_vol, uint64_t *last_vol_start) {
+    uint64_t off = CMP_HEADER_SIZE, vstart = 0;
+    uint32_t v = 0;
+    for (int i = 0; i < n; ++i) {
+        uint64_t reclen = sizeof(uint64_t) + jobs[i].csize;
+        if (volume_break(volume_size, off - vstart, reclen, i > 0)) {
+            ++v;
+            vstart = off;
+        }
+        jobs[i].vol = v;
+        jobs[i].out_offset = off - vstart;
+        off += reclen;
+    }
+    *last_vol = v;
+    *last_vol_start = vstart;
+    return off;
+}
+
+static void job_meta(const ChunkJob *job, MetaEntry *e) {
+    e->id = job->id;
+    e->orig_size = (uint64_t)job->orig_size;
+    e->comp_size = (uint64_t)job->csize;
+    memcpy(e->hash, job->digest, HASH_SIZE);
+    e->kind = job->kind;
+    e->filter = job->filter;
+}
+
+// Durable progress for --checkpoint/--resume. The file holds the longest run
+// of chunks already in the .cmp, their .meta lines, and the .cmp offset just
+// after them, plus enough about the input and options to refuse a mismatched
+// resume. It is written to a temp file and renamed into place after the
+// .cmp data it describes has been fdatasync'd.
+typedef struct {
+    char path[1100];
+    EmitState *es;
+    VolumeSet *vols;
+    int interval;          // seconds
+    uint64_t filesize;
+    struct timespec mtime;
+    size_t chunk_size;
+    size_t frame_size;
+    HashAlgo hash_algo;
+    int container;         // chunks planned along MP4 boxes
+    int done;              // chunks covered by the last checkpoint
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Checkpointer;
 
-    if (filesize <= 8 * MB) return 1 * MB;      // <=8MB -> 1MB chunks
-    if (filesize <= 128 * MB) return 4 * MB;    // <=128MB -> 4MB
-    if (filesize <= 1024 * MB) return 16 * MB;  // <=1GB -> 16MB
-    return 64 * MB;                              // >1GB -> 64MB
+static int checkpoint_write(Checkpointer *cp) {
+    EmitState *es = cp->es;
+    int k = cp->done;
+    while (k < es->count && atomic_load(&es->written[k])) ++k;
+    if (k == cp->done) return 0;
+    if (volumes_sync(cp->vols) != 0) return -1;
+
+    char tmp[1200];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cp->path);
+    FILE *f = fopen(tmp, "w");
+    if (!f) return -1;
+    fprintf(f, "# checkpoint 1\n");
+    fprintf(f, "# input_size %" PRIu64 "\n", cp->filesize);
+    fprintf(f, "# input_mtime %lld.%09ld\n", (long long)cp->mtime.tv_sec, cp->mtime.tv_nsec);
+    fprintf(f, "# chunk_size %zu\n", cp->chunk_size);
+    fprintf(f, "# chunks %d\n", es->count);
+    fprintf(f, "# hash %s\n", hash_algo_name(cp->hash_algo));
+    fprintf(f, "# volume_size %" PRIu64 "\n", es->volume_size);
+    fprintf(f, "# frame_size %zu\n", cp->frame_size);
+    if (cp->container) fprintf(f, "# container mp4\n");
+    fprintf(f, "# next_chunk %d\n", k);
+    fprintf(f, "# cmp_offset %" PRIu64 "\n", (uint64_t)atomic_load(&es->offsets[k]));
+    for (int i = 0; i < k; ++i) {
+        MetaEntry e;
+        job_meta(&es->jobs[i], &e);
+        meta_write_line(f, &e);
+        if (es->jobs[i].nframes) meta_write_seek(f, i, es->jobs[i].frame_csize, es->jobs[i].nframes);
+    }
+    int rc = (fflush(f) == 0 && fsync(fileno(f)) == 0) ? 0 : -1;
+    if (fclose(f) != 0) rc = -1;
+    if (rc == 0) rc = rename(tmp, cp->path);
+    if (rc == 0) cp->done = k;
+    return rc;
+}
+
+static void *checkpoint_thread(void *varg) {
+    Checkpointer *cp = (Checkpointer*)varg;
+    pthread_mutex_lock(&cp->lock);
+    while (!cp->stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += cp->interval;
+        pthread_cond_timedwait(&cp->cond, &cp->lock, &ts);
+        if (cp->stop) break;
+        if (checkpoint_write(cp) != 0) perror("checkpoint");
+    }
+    pthread_mutex_unlock(&cp->lock);
+    return NULL;
+}
+
+// Load a checkpoint written for this input and chunk plan into jobs[].
+// Returns the first chunk still to do, or -1 if the checkpoint does not match.
+static int checkpoint_load(const char *path, ChunkJob *jobs, int num_chunks, const struct stat *st,
+                           size_t chunk_size, uint64_t volume_size, size_t frame_size, int container,
+                           HashAlgo *algo, uint64_t *cmp_offset) {
+    FILE *f = fopen(path, "r");
+    if (!f) { perror("open checkpoint"); return -1; }
+    int next = -1, n = 0, ok = 1, ck_container = 0;
+    uint64_t ck_volume_size = 0, ck_frame_size = 0;
+    char line[512];
+    while (ok && fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "# seek ", 7) == 0) {
+            // seek lines follow their chunk line, in order
+            int id;
+            uint32_t first;
+            uint64_t csize[SEEK_LINE_FRAMES];
+            int k = meta_parse_seek(line, &id, &first, csize, SEEK_LINE_FRAMES);
+            ChunkJob *j = id == n - 1 ? &jobs[id] : NULL;
+            uint32_t total = j && frame_size ? (uint32_t)((j->orig_size + frame_size - 1) / frame_size) : 0;
+            if (k <= 0 || !j || first != j->nframes || first + (uint32_t)k > total) { ok = 0; break; }
+            if (!j->frame_csize) j->frame_csize = (uint64_t*)malloc((size_t)total * sizeof(uint64_t));
+            if (!j->frame_csize) { ok = 0; break; }
+            memcpy(j->frame_csize + first, csize, (size_t)k * sizeof(uint64_t));
+            j->nframes += (uint32_t)k;
+            continue;
+        }
+        if (line[0] == '#') {
+            char key[64], val[256];
+            if (sscanf(line, "# %63s %255s", key, val) != 2) continue;
+            if (strcmp(key, "input_size") == 0) ok = strtoull(val, NULL, 10) == (uint64_t)st->st_size;
+            else if (strcmp(key, "input_mtime") == 0) {
+                char want[64];
+                snprintf(want, sizeof(want), "%lld.%09ld", (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec);
+                ok = strcmp(val, want) == 0;
+            }
+            else if (strcmp(key, "chunk_size") == 0) ok = strtoull(val, NULL, 10) == chunk_size;
+            else if (strcmp(key, "chunks") == 0) ok = atoi(val) == num_chunks;
+            else if (strcmp(key, "hash") == 0) ok = hash_algo_from_name(val, algo) == 0;
+            else if (strcmp(key, "volume_size") == 0) ck_volume_size = strtoull(val, NULL, 10);
+            else if (strcmp(key, "frame_size") == 0) ck_frame_size = strtoull(val, NULL, 10);
+            else if (strcmp(key, "container") == 0) ck_container = strcmp(val, "mp4") == 0;
+            else if (strcmp(key, "next_chunk") == 0) next = atoi(val);
+            else if (strcmp(key, "cmp_offset") == 0) *cmp_offset = strtoull(val, NULL, 10);
+            continue;
+        }
+        MetaEntry e;
+        if (meta_parse_line(line, &e) != 0 || e.id != n || n >= num_chunks
+            || e.orig_size != jobs[n].orig_size || (e.kind == CHUNK_HOLE) != (jobs[n].kind == CHUNK_HOLE)) {
+            ok = 0;
+            break;
+        }
+        jobs[n].csize = (size_t)e.comp_size;
+        jobs[n].kind = e.kind;
+        jobs[n].filter = e.filter;
+        memcpy(jobs[n].digest, e.hash, HASH_SIZE);
+        ++n;
+    }
+    fclose(f);
+    // a chunk's seek table must be complete
+    for (int i = 0; ok && i < n; ++i)
+        if (jobs[i].nframes && jobs[i].nframes != (jobs[i].orig_size + frame_size - 1) / frame_size) ok = 0;
+    if (!ok || next < 0 || next != n || ck_volume_size != volume_size || ck_frame_size != frame_size
+        || ck_container != container) {
+        fprintf(stderr, "checkpoint %s does not match this input\n", path);
+        return -1;
+    }
+    return next;
+}
+
+// Before appending to a resumed .cmp, check that its header matches and that
+// the last checkpointed record is intact: its volume must be long enough and
+// the record must decode to the recorded digest. jobs[0..next) have already
+// been laid out; 'vol_end' is where the records end in the last volume.
+static int verify_tail(VolumeSet *vols, ChunkJob *jobs, int next, uint32_t last_vol, uint64_t vol_end,
+                       HashAlgo algo, uint64_t filesize, size_t chunk_size, int num_chunks) {
+    unsigned char hdr[CMP_HEADER_SIZE], want[CMP_HEADER_SIZE];
+    uint64_t fs64 = filesize, cs64 = (uint64_t)chunk_size;
+    uint32_t nch32 = (uint32_t)num_chunks;
+    memcpy(want, &fs64, 8); memcpy(want + 8, &cs64, 8); memcpy(want + 16, &nch32, 4);
+    int fd = volume_fd(vols, 0, 0);
+    if (fd < 0 || pread_full(fd, hdr, sizeof(hdr), 0) != 0 || memcmp(hdr, want, sizeof(hdr)) != 0) return -1;
+
+    struct stat cst;
+    fd = volume_fd(vols, last_vol, 0);
+    if (fd < 0 || fstat(fd, &cst) != 0 || (uint64_t)cst.st_size < vol_end) return -1;
+    if (next == 0) return 0;
+
+    ChunkJob *last = &jobs[next - 1];
+    uint64_t csize64;
+    if (pread_full(fd, &csize64, sizeof(csize64), (off_t)last->out_offset) != 0 || csize64 != last->csize) return -1;
+    if (last->kind == CHUNK_HOLE) {
+        unsigned char h[HASH_SIZE];
+        hash_zeros(algo, last->orig_size, h);
+        return csize64 == 0 && memcmp(h, last->digest, HASH_SIZE) == 0 ? 0 : -1;
+    }
+
+    unsigned char *cbuf = (unsigned char*)malloc(last->csize ? last->csize : 1);
+    unsigned char *obuf = (unsigned char*)malloc(last->orig_size);
+    int rc = -1;
+    if (cbuf && obuf && pread_full(fd, cbuf, last->csize, (off_t)(last->out_offset + sizeof(uint64_t))) == 0) {
+        size_t r;
+        if (last->kind == CHUNK_FILL) {
+            r = last->csize == 1 ? last->orig_size : 0;
+            if (r) memset(obuf, cbuf[0], r);
+        } else if (last->kind == CHUNK_RAW) {
+            r = last->csize == last->orig_size ? last->orig_size : 0;
+            memcpy(obuf, cbuf, r);
+        } else if (last->filter.type != FILTER_NONE) {
+            // one filter block per ZSTD frame, as in decode_chunk()
+            unsigned long long block = ZSTD_getFrameContentSize(cbuf, last->csize);
+            unsigned char *tmp = (unsigned char*)malloc(last->orig_size);
+            r = tmp && block != ZSTD_CONTENTSIZE_UNKNOWN && block != ZSTD_CONTENTSIZE_ERROR
+                ? ZSTD_decompress(tmp, last->orig_size, cbuf, last->csize) : 0;
+            if (!ZSTD_isError(r) && r == last->orig_size) filter_decode(&last->filter, obuf, tmp, r, (size_t)block);
+            free(tmp);
+        } else {
+            r = ZSTD_decompress(obuf, last->orig_size, cbuf, last->csize);
+        }
+        if (!ZSTD_isError(r) && r == last->orig_size) {
+            unsigned char h[HASH_SIZE];
+            hash_chunk(algo, obuf, r, h, 1);
+            rc = memcmp(h, last->digest, HASH_SIZE) == 0 ? 0 : -1;
+        }
+    }
+    free(cbuf);
+    free(obuf);
+    return rc;
+}
+
+// Chunk size tuning. Chunks are compressed independently, so:
+//  - compressible data wants chunks as large as the ZSTD window at our level
+//    (matches further back are never found anyway), while data that does
+//    not compress gains nothing from large chunks;
+//  - every thread wants several chunks, so the last wave is short;
+//  - in-flight chunks must fit the memory budget (see peak_memory());
+//  - per-chunk costs (record, .meta line, context reset) must stay noise,
+//    and the index bounded, hence CHUNK_MIN and CHUNK_MAX_COUNT.
+#define CHUNK_MIN (256 * 1024)
+#define CHUNK_MAX (64 * 1024 * 1024)
+#define CHUNK_MAX_COUNT 65536
+#define CHUNK_INCOMPRESSIBLE (1024 * 1024)
+#define CHUNKS_PER_THREAD 4
+// compressibility sample: slices spread over the file, at ZSTD level 1
+#define SAMPLE_COUNT 8
+#define SAMPLE_SIZE (64 * 1024)
+#define COMPRESSIBLE_RATIO 1.1
+// --deterministic: the plan must not depend on the machine, so the tuner
+// assumes the thread cap and, without --max-memory, this budget
+#define MAX_THREADS 16
+#define DETERMINISTIC_MEM_BUDGET (1ull << 30)
+
+static double sample_ratio(int fd, uint64_t filesize) {
+    unsigned char *in = (unsigned char*)malloc(SAMPLE_SIZE);
+    size_t bound = ZSTD_compressBound(SAMPLE_SIZE);
+    unsigned char *out = (unsigned char*)malloc(bound);
+    uint64_t total_in = 0, total_out = 0;
+    for (int k = 0; in && out && k < SAMPLE_COUNT; ++k) {
+        uint64_t len = filesize < SAMPLE_SIZE ? filesize : SAMPLE_SIZE;
+        uint64_t off = (filesize - len) / SAMPLE_COUNT * (uint64_t)k;
+        if (pread_full(fd, in, (size_t)len, (off_t)off) != 0) break;
+        size_t c = ZSTD_compress(out, bound, in, (size_t)len, 1);
+        if (ZSTD_isError(c)) break;
+        total_in += len;
+        total_out += c;
+        if (filesize <= SAMPLE_SIZE) break;
+    }
+    free(in);
+    free(out);
+    return total_out ? (double)total_in / (double)total_out : 1.0;
+}
+
+// What the workers hold besides chunk buffers. The default budget (a
+// quarter of RAM) only shapes the chunk size, so the tuner uses the zeroed
+// model; --max-memory is a bound on the whole process.
+typedef struct {
+    uint64_t base;         // the process itself, see BASE_MEMORY
+    HugeMode huge;         // contexts on the huge page arena
+    int filtered;          // chunks may be filtered: a second copy of the input
+    int probing;           // --filter auto: choose_filter()'s sample buffers
+} MemModel;
+
+// Code, libraries, thread stacks and allocator slack: what a run over a
+// tiny input peaks at, plus the per-thread malloc arenas' free lists.
+#define BASE_MEMORY (6u << 20)
+
+// Peak memory of the workers: each holds a chunk's input (and its filtered
+// copy) and a compression context sized for it, and up to 'window' chunks
+// hold compressed output (being produced, or waiting for their turn to be
+// written).
+static uint64_t peak_memory(size_t chunk, int level, int threads, int window, const MemModel *mm) {
+    size_t cctx = ZSTD_estimateCCtxSize_usingCParams(ZSTD_getCParams(level, chunk, 0));
+    cctx = huge_arena_footprint(mm->huge, cctx);
+    uint64_t worker = (uint64_t)chunk * (mm->filtered ? 2 : 1) + cctx;
+    if (mm->probing) worker += FILTER_SAMPLE + ZSTD_compressBound(FILTER_SAMPLE);
+    return mm->base + (uint64_t)threads * worker + (uint64_t)window * ZSTD_compressBound(chunk);
+}
+
+static size_t pow2_floor(uint64_t v) {
+    size_t p = 1;
+    while ((uint64_t)p * 2 <= v) p *= 2;
+    return p;
+}
+
+// Pick the chunk size for this input, and say why in 'why'.
+static size_t choose_chunk_size(int fd, uint64_t filesize, int nthreads, int level, uint64_t mem_budget,
+                                const MemModel *mm, char *why, size_t whylen) {
+    double ratio = sample_ratio(fd, filesize);
+    size_t window = (size_t)1 << ZSTD_getCParams(level, 0, 0).windowLog;
+    int compressible = ratio >= COMPRESSIBLE_RATIO;
+    uint64_t c = compressible ? window : CHUNK_INCOMPRESSIBLE;
+    uint64_t par_cap = filesize / ((uint64_t)nthreads * CHUNKS_PER_THREAD);
+    uint64_t count_floor = filesize / CHUNK_MAX_COUNT;
+    uint64_t mem_cap = CHUNK_MAX;
+    while (mem_cap > CHUNK_MIN && peak_memory((size_t)mem_cap, level, nthreads, 2 * nthreads, mm) > mem_budget) mem_cap /= 2;
+    if (c > par_cap) c = par_cap;
+    if (c < count_floor) c = count_floor;
+    if (c > mem_cap) c = mem_cap;
+    if (c < CHUNK_MIN) c = CHUNK_MIN;
+    if (c > CHUNK_MAX) c = CHUNK_MAX;
+    size_t chunk = pow2_floor(c);
+    snprintf(why, whylen,
+             "sample ratio %.2f (%s, ZSTD window %zu KiB); %d threads x %d chunks caps at %" PRIu64 " KiB; "
+             "index floor %" PRIu64 " KiB; memory budget %" PRIu64 " MiB caps at %" PRIu64 " KiB",
+             ratio, compressible ? "compressible" : "incompressible", window >> 10, nthreads, CHUNKS_PER_THREAD,
+             par_cap >> 10, count_floor >> 10, mem_budget >> 20, mem_cap >> 10);
+    return chunk;
+}
+
+// chunk_size recorded in a checkpoint, so a resume keeps the same chunks even
+// if the tuner would now choose differently; 0 if unreadable
+static size_t checkpoint_chunk_size(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    char line[512];
+    size_t cs = 0;
+    while (!cs && fgets(line, sizeof(line), f) && line[0] == '#') {
+        unsigned long long v;
+        if (sscanf(line, "# chunk_size %llu", &v) == 1) cs = (size_t)v;
+    }
+    fclose(f);
+    return cs;
+}
+
+static int plan_push(ChunkJob **jobs, int *n, int *cap, uint64_t off, uint64_t len, ChunkKind kind) {
+    if (*n == *cap) {
+        int ncap = *cap ? *cap * 2 : 64;
+        ChunkJob *nj = (ChunkJob*)realloc(*jobs, (size_t)ncap * sizeof(ChunkJob));
+        if (!nj) return -1;
+        *jobs = nj;
+        *cap = ncap;
+    }
+    ChunkJob *j = &(*jobs)[*n];
+    memset(j, 0, sizeof(*j));
+    j->id = *n;
+    j->in_offset = off;
+    j->orig_size = (size_t)len;
+    j->kind = kind;
+    (*n)++;
+    return 0;
+}
+
+// cut a data run on the global chunk_size grid, so a dense file gets exactly
+// the same chunks as before sparse support
+static int plan_data(ChunkJob **jobs, int *n, int *cap, uint64_t a, uint64_t b, size_t chunk_size) {
+    while (a < b) {
+        uint64_t next = (a / chunk_size + 1) * chunk_size;
+        if (next > b) next = b;
+        if (plan_push(jobs, n, cap, a, next - a, CHUNK_ZSTD) != 0) return -1;
+        a = next;
+    }
+    return 0;
+}
+
+// Chunks along the top-level boxes of an ISO-BMFF file: each run of
+// metadata boxes between mdat boxes becomes its own chunks, compressed hard,
+// and each mdat is cut into media chunks of chunk_size. No chunk spans a
+// metadata/media boundary.
+static ChunkJob *plan_mp4(const Mp4Box *boxes, int nboxes, size_t chunk_size, int meta_level, int *count,
+                          int *meta_chunks) {
+    ChunkJob *jobs = NULL;
+    int n = 0, cap = 0, err = 0;
+    *meta_chunks = 0;
+    for (int b = 0; b < nboxes && !err; ) {
+        int media = mp4_is_media(&boxes[b]);
+        int e = b + 1;
+        while (!media && e < nboxes && !mp4_is_media(&boxes[e])) ++e;
+        uint64_t start = boxes[b].off, end = boxes[e - 1].off + boxes[e - 1].len;
+        for (uint64_t off = start; off < end && !err; off += chunk_size) {
+            uint64_t len = end - off < chunk_size ? end - off : chunk_size;
+            err = plan_push(&jobs, &n, &cap, off, len, CHUNK_ZSTD);
+            if (err) break;
+            jobs[n - 1].media = media;
+            jobs[n - 1].level = media ? MP4_MEDIA_LEVEL : meta_level;
+            if (!media) (*meta_chunks)++;
+        }
+        b = e;
+    }
+    if (err) { free(jobs); return NULL; }
+    *count = n;
+    return jobs;
+}
+
+// Build the chunk list from the file's data extents (SEEK_DATA/SEEK_HOLE).
+// Chunks lying wholly inside a hole become CHUNK_HOLE entries that are never
+// read; a chunk that is partly hole is read like any other. Chunks stay on the
+// chunk_size grid either way, so a sparse file and its dense copy get the
+// same chunks and, with hole digests taken over zeros, the same Merkle root.
+// On filesystems without hole reporting, or without 'sparse', the whole file
+// is one data extent.
+static ChunkJob *plan_chunks(int fd, uint64_t filesize, size_t chunk_size, int sparse, int *count, int *holes) {
+    ChunkJob *jobs = NULL;
+    int n = 0, cap = 0, err = 0;
+    *holes = 0;
+    uint64_t pos = 0;
+    uint64_t done = 0;     // chunks are planned up to here
+    while (sparse && pos < filesize && !err) {
+        off_t data = lseek(fd, (off_t)pos, SEEK_DATA);
+        if (data < 0) data = errno == ENXIO ? (off_t)filesize : (off_t)pos;
+        if ((uint64_t)data > pos) {
+            // the whole grid chunks in [pos, data); the last one may be short
+            uint64_t hs = (pos + chunk_size - 1) / chunk_size * chunk_size;
+            uint64_t he = (uint64_t)data >= filesize ? filesize : (uint64_t)data / chunk_size * chunk_size;
+            if (he > hs) {
+                err |= plan_data(&jobs, &n, &cap, done, hs, chunk_size);
+                for (uint64_t off = hs; off < he && !err; off += chunk_size) {
+                    err |= plan_push(&jobs, &n, &cap, off, he - off < chunk_size ? he - off : chunk_size, CHUNK_HOLE);
+                    (*holes)++;
+                }
+                done = he;
+            }
+        }
+        if ((uint64_t)data >= filesize) break;
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || (uint64_t)hole > filesize) hole = (off_t)filesize;
+        pos = (uint64_t)hole;
+    }
+    if (!err) err |= plan_data(&jobs, &n, &cap, done, filesize, chunk_size);
+    if (err) { free(jobs); return NULL; }
+    *count = n;
+    return jobs;
 }
 
 static const char* get_basename(const char* path) {
@@ -110,13 +1067,169 @@ static const char* get_basename(const char* path) {
     return p ? p+1 : path;
 }
 
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--writers N] [--emit ordered|parallel] [--hash sha256|blake3] [--fused]\n"
+                    "       [--checkpoint SECS] [--resume] [--volume-size BYTES] [--frame-size BYTES]\n"
+                    "       [--chunk-size BYTES] [--access sequential|random] [--max-memory BYTES]\n"
+                    "       [--hugepages off|thp|explicit] [--container off|mp4] [--perf]\n"
+                    "       [--filter none|auto|delta:N|bcj|shuffle:N|bitshuffle:N] [--shuffle N]\n"
+                    "       [--threads N] [--deterministic]\n"
+                    "       <input.bin> <compress_dir>\n", prog);
+}
+
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <input.bin> <compress_dir>\n", argv[0]);
+    int nwriters = 1;
+    int parallel_emit = 0;
+    HashAlgo hash_algo = HASH_SHA256;
+    int fused = 0;
+    int checkpoint_secs = 0;
+    int resume = 0;
+    uint64_t volume_size = 0;
+    int64_t frame_opt = -1;    // -1: automatic
+    size_t chunk_opt = 0;      // 0: automatic
+    int random_access = 0;
+    uint64_t max_memory = 0;
+    HugeMode huge_mode = HUGE_THP;
+    int huge_set = 0;          // --hugepages given
+    int container = 0;         // 1: plan chunks along MP4 boxes
+    Filter filter = { FILTER_NONE, 0 };
+    int filter_auto = 0;
+    int filter_set = 0;        // --filter given
+    size_t record_size = 0;    // --shuffle: chunks and frames hold whole records
+    int threads_opt = 0;       // 0: one per available CPU
+    int deterministic = 0;
+#ifdef PERF_COUNTERS
+    int perf = 0;
+#endif
+    static const struct option longopts[] = {
+        { "writers", required_argument, NULL, 'w' },
+        { "emit",    required_argument, NULL, 'e' },
+        { "hash",    required_argument, NULL, 'H' },
+        { "fused",   no_argument,       NULL, 'f' },
+        { "checkpoint", required_argument, NULL, 'c' },
+        { "resume",  no_argument,       NULL, 'r' },
+        { "volume-size", required_argument, NULL, 'V' },
+        { "frame-size", required_argument, NULL, 'F' },
+        { "chunk-size", required_argument, NULL, 'C' },
+        { "access",  required_argument, NULL, 'a' },
+        { "max-memory", required_argument, NULL, 'M' },
+        { "hugepages", required_argument, NULL, 'P' },
+        { "container", required_argument, NULL, 'B' },
+        { "filter",  required_argument, NULL, 'x' },
+        { "shuffle", required_argument, NULL, 'S' },
+        { "threads", required_argument, NULL, 'T' },
+        { "deterministic", no_argument, NULL, 'D' },
+        { "perf",    no_argument,       NULL, 'p' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "w:e:H:fc:rV:F:C:a:M:P:B:x:S:T:Dp", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'w': nwriters = atoi(optarg); break;
+        case 'e':
+            if (strcmp(optarg, "parallel") == 0) parallel_emit = 1;
+            else if (strcmp(optarg, "ordered") == 0) parallel_emit = 0;
+            else { usage(argv[0]); return 1; }
+            break;
+        case 'H':
+            if (hash_algo_from_name(optarg, &hash_algo) != 0) { usage(argv[0]); return 1; }
+            break;
+        case 'f': fused = 1; break;
+        case 'c': checkpoint_secs = atoi(optarg); break;
+        case 'r': resume = 1; break;
+        case 'V':
+            volume_size = parse_size(optarg);
+            if (volume_size == 0) { usage(argv[0]); return 1; }
+            break;
+        case 'F':
+            // 0 turns seek frames off
+            frame_opt = strcmp(optarg, "0") == 0 ? 0 : (int64_t)parse_size(optarg);
+            if (frame_opt == 0 && strcmp(optarg, "0") != 0) { usage(argv[0]); return 1; }
+            break;
+        case 'C':
+            chunk_opt = (size_t)parse_size(optarg);
+            if (chunk_opt == 0) { usage(argv[0]); return 1; }
+            break;
+        case 'a':
+            if (strcmp(optarg, "random") == 0) random_access = 1;
+            else if (strcmp(optarg, "sequential") == 0) random_access = 0;
+            else { usage(argv[0]); return 1; }
+            break;
+        case 'M':
+            max_memory = parse_size(optarg);
+            if (max_memory == 0) { usage(argv[0]); return 1; }
+            break;
+        case 'P':
+            if (huge_mode_from_name(optarg, &huge_mode) != 0) { usage(argv[0]); return 1; }
+            huge_set = 1;
+            break;
+        case 'B':
+            if (strcmp(optarg, "mp4") == 0) container = 1;
+            else if (strcmp(optarg, "off") == 0) container = 0;
+            else { usage(argv[0]); return 1; }
+            break;
+        case 'x':
+            filter_auto = strcmp(optarg, "auto") == 0;
+            if (!filter_auto && filter_from_name(optarg, &filter) != 0) { usage(argv[0]); return 1; }
+            filter_set = 1;
+            break;
+        case 'S': {
+            // columnar mode for fixed-width records: shuffle:N on every chunk
+            char name[32];
+            snprintf(name, sizeof(name), "shuffle:%s", optarg);
+            if (filter_from_name(name, &filter) != 0) { usage(argv[0]); return 1; }
+            filter_auto = 0;
+            record_size = (size_t)filter.width;
+            break;
+        }
+        case 'T':
+            threads_opt = atoi(optarg);
+            if (threads_opt < 1) { usage(argv[0]); return 1; }
+            break;
+        case 'D': deterministic = 1; break;
+        case 'p':
+#ifdef PERF_COUNTERS
+            perf = 1;
+            break;
+#else
+            fprintf(stderr, "--perf needs a build with hardware counters (make profile)\n");
+            return 1;
+#endif
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (record_size && filter_set) {
+        // either would silently override the other's filter
+        fprintf(stderr, "--shuffle and --filter cannot be combined (--shuffle N is shuffle:N on whole records)\n");
         return 1;
     }
-    const char *inpath = argv[1];
-    const char *outdir = argv[2];
+    if (record_size && container) {
+        // box boundaries fall anywhere in a record; the grid keeps records whole
+        fprintf(stderr, "--shuffle: chunking on whole records, ignoring --container mp4\n");
+        container = 0;
+    }
+    if (resume && checkpoint_secs <= 0) checkpoint_secs = CHECKPOINT_INTERVAL;
+    // checkpoints describe records already in the file, and a memory budget
+    // cannot hold every compressed chunk until the end: both need the
+    // streaming writer
+    if (checkpoint_secs > 0 || max_memory) parallel_emit = 1;
+    // the huge page arena rounds contexts up to 2 MiB and caches freed
+    // mappings, which a tight budget pays for several times over; under
+    // --max-memory contexts use malloc unless --hugepages asks otherwise
+    if (max_memory && !huge_set) huge_mode = HUGE_OFF;
+    MemModel mm = { 0, HUGE_OFF, 0, 0 };
+    if (max_memory) {
+        mm.base = BASE_MEMORY;
+        mm.huge = huge_mode;
+        mm.filtered = filter.type != FILTER_NONE || filter_auto;
+        mm.probing = filter_auto;
+    }
+    if (argc - optind != 2 || nwriters < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *inpath = argv[optind];
+    const char *outdir = argv[optind + 1];
 
     // create compress directory if needed
     mkdir(outdir, 0755);
@@ -127,52 +1240,232 @@ int main(int argc, char **argv) {
     size_t filesize = (size_t)st.st_size;
     if (filesize == 0) { fprintf(stderr, "Empty file\n"); return 1; }
 
-    size_t chunk_size = choose_chunk_size(filesize);
-    int num_chunks = (int)((filesize + chunk_size - 1) / chunk_size);
+    int fdin = open(inpath, O_RDONLY);
+    if (fdin < 0) { perror("open input"); return 1; }
 
-    printf("File: %s, size=%zu bytes, chunk=%zu, chunks=%d\n", inpath, filesize, chunk_size, num_chunks);
+    // the CPUs the container's quota and cpuset allow, not the host's
+    int ncpus = available_cpus();
+    int nthreads = threads_opt ? threads_opt : ncpus;
+    // Cap threads to a reasonable number
+    if (nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+    // choose max zstd level intelligently but safe
+    int zstd_max_level = ZSTD_maxCLevel(); // recommended maximum
+    // but ZSTD_maxCLevel() can be large; choose 19 or system max whichever smaller
+    int zstd_level = (zstd_max_level > 19) ? 19 : zstd_max_level;
 
-    // allocate jobs
-    ChunkJob *jobs = (ChunkJob*)calloc((size_t)num_chunks, sizeof(ChunkJob));
-    if (!jobs) { perror("calloc jobs"); return 1; }
+    // prepare output filenames
+    const char *base = get_basename(inpath);
+    char out_cmp[1024], out_meta[1024], out_ckpt[1024];
+    snprintf(out_cmp, sizeof(out_cmp), "%s/%s.cmp", outdir, base);
+    snprintf(out_meta, sizeof(out_meta), "%s/%s.meta", outdir, base);
+    snprintf(out_ckpt, sizeof(out_ckpt), "%s/%s.ckpt", outdir, base);
 
-    // read the file chunk by chunk into jobs (streaming)
-    FILE *fin = fopen(inpath, "rb");
-    if (!fin) { perror("open input"); free(jobs); return 1; }
+    size_t chunk_size = chunk_opt;
+    if (!chunk_size && resume) chunk_size = checkpoint_chunk_size(out_ckpt);
+    if (chunk_size) {
+        printf("Chunk size %zu: %s\n", chunk_size, chunk_opt ? "given by --chunk-size" : "from checkpoint");
+    } else {
+        char why[512];
+        long pages = sysconf(_SC_PHYS_PAGES), page_size = sysconf(_SC_PAGESIZE);
+        // without --max-memory, a quarter of RAM for in-flight chunks
+        uint64_t mem_budget = max_memory ? max_memory
+                              : deterministic ? DETERMINISTIC_MEM_BUDGET
+                              : pages > 0 && page_size > 0 ? (uint64_t)pages * (uint64_t)page_size / 4 : (1ull << 30);
+        chunk_size = choose_chunk_size(fdin, (uint64_t)filesize, deterministic ? MAX_THREADS : nthreads, zstd_level,
+                                       mem_budget, &mm, why, sizeof(why));
+        printf("Chunk size %zu: %s\n", chunk_size, why);
+    }
+    if (max_memory) {
+        // Fit the budget: fewer threads first, then (if ours to choose)
+        // smaller chunks, then lower levels, which also shrink the window.
+        // Chunk size and level only give way once a single thread is left,
+        // so they do not depend on the thread count we started from.
+        int tuned = !chunk_opt && !resume;
+        while (peak_memory(chunk_size, zstd_level, nthreads, 2 * nthreads, &mm) > max_memory) {
+            if (nthreads > 1) --nthreads;
+            else if (tuned && chunk_size > CHUNK_MIN) chunk_size /= 2;
+            else if (zstd_level > 1) --zstd_level;
+            else break;
+        }
+        uint64_t peak = peak_memory(chunk_size, zstd_level, nthreads, 2 * nthreads, &mm);
+        if (peak > max_memory) {
+            fprintf(stderr, "--max-memory %" PRIu64 " is too small: chunk size %zu needs at least %" PRIu64 " bytes\n",
+                    max_memory, chunk_size, peak);
+            close(fdin);
+            return 1;
+        }
+        printf("Memory budget %" PRIu64 ": %d threads, chunk %zu, ZSTD level %d, %d chunks in flight; "
+               "estimated peak %" PRIu64 "\n", max_memory, nthreads, chunk_size, zstd_level, 2 * nthreads, peak);
+    }
+    if (record_size && chunk_size % record_size) {
+        // a record split across chunks would put its bytes in the wrong planes;
+        // plan_chunks() cuts data and holes on multiples of chunk_size only
+        chunk_size = chunk_size < record_size ? record_size : chunk_size - chunk_size % record_size;
+        printf("Chunk size %zu: whole %zu-byte records\n", chunk_size, record_size);
+    }
+    // random access wants every chunk seekable; sequential only the big ones
+    size_t frame_size = frame_opt >= 0 ? (size_t)frame_opt
+                        : random_access || chunk_size >= SEEK_MIN_CHUNK ? SEEK_FRAME_SIZE : 0;
+    if (record_size && frame_size) frame_size = frame_size < record_size ? record_size : frame_size - frame_size % record_size;
+    if (frame_size >= chunk_size) frame_size = 0;
 
-    for (int i = 0; i < num_chunks; ++i) {
-        size_t toread = chunk_size;
-        if ((size_t)i * chunk_size + toread > filesize) toread = filesize - (size_t)i * chunk_size;
-        jobs[i].id = i;
-        jobs[i].orig_size = toread;
-        jobs[i].data = (unsigned char*)malloc(toread);
-        if (!jobs[i].data) { fprintf(stderr, "OOM allocating chunk buffer\n"); fclose(fin); return 1; }
-        size_t r = fread(jobs[i].data, 1, toread, fin);
-        if (r != toread) { fprintf(stderr, "short read\n"); fclose(fin); return 1; }
-        jobs[i].cdata = NULL;
-        jobs[i].csize = 0;
-    }
-    fclose(fin);
+    int num_chunks = 0, num_holes = 0;
+    ChunkJob *jobs = NULL;
+    if (container) {
+        Mp4Box *boxes = NULL;
+        int nboxes = mp4_boxes(fdin, (uint64_t)filesize, &boxes);
+        if (nboxes > 0) {
+            // the level --max-memory fitted caps the metadata level too
+            int meta_level = zstd_level < MP4_META_LEVEL ? zstd_level : MP4_META_LEVEL, meta_chunks = 0;
+            jobs = plan_mp4(boxes, nboxes, chunk_size, meta_level, &num_chunks, &meta_chunks);
+            if (!jobs) { fprintf(stderr, "OOM planning chunks\n"); free(boxes); close(fdin); return 1; }
+            printf("MP4: %d top-level boxes, %d metadata chunks at level %d, %d media chunks at level %d\n",
+                   nboxes, meta_chunks, meta_level, num_chunks - meta_chunks, MP4_MEDIA_LEVEL);
+        } else {
+            fprintf(stderr, "%s: not an MP4 file; chunking it as plain data\n", inpath);
+            container = 0;
+        }
+        free(boxes);
+    }
+    if (!jobs) jobs = plan_chunks(fdin, (uint64_t)filesize, chunk_size, !deterministic, &num_chunks,
+                                        &num_holes);
+    if (!jobs) { fprintf(stderr, "OOM planning chunks\n"); close(fdin); return 1; }
+
+    printf("File: %s, size=%zu bytes, chunk=%zu, chunks=%d, holes=%d, seek frames=%zu\n", inpath, filesize, chunk_size,
+           num_chunks, num_holes, frame_size);
+
+    // every volume holds at least one record, so there are at most num_chunks
+    VolumeSet vols;
+    snprintf(vols.prefix, sizeof(vols.prefix), "%s", out_cmp);
+    vols.split = volume_size > 0;
+    vols.cap = (uint32_t)num_chunks;
+    vols.fds = (int*)malloc((size_t)vols.cap * sizeof(int));
+    if (!vols.fds) { fprintf(stderr, "OOM\n"); close(fdin); return 1; }
+    for (uint32_t v = 0; v < vols.cap; ++v) vols.fds[v] = -1;
+    pthread_mutex_init(&vols.lock, NULL);
+
+    int first_chunk = 0;
+    uint64_t first_offset = CMP_HEADER_SIZE;
+    uint32_t last_vol = 0;
+    uint64_t last_vol_start = 0;
+    if (resume) {
+        first_chunk = checkpoint_load(out_ckpt, jobs, num_chunks, &st, chunk_size, volume_size, frame_size,
+                                      container, &hash_algo, &first_offset);
+        if (first_chunk < 0) { close(fdin); return 1; }
+        uint64_t end = layout_records(jobs, first_chunk, volume_size, &last_vol, &last_vol_start);
+        if (end != first_offset
+            || verify_tail(&vols, jobs, first_chunk, last_vol, end - last_vol_start, hash_algo,
+                           (uint64_t)filesize, chunk_size, num_chunks) != 0) {
+            fprintf(stderr, "%s does not match checkpoint %s; cannot resume\n", out_cmp, out_ckpt);
+            volumes_close(&vols); close(fdin); return 1;
+        }
+        // anything past the checkpoint may be torn; it is redone, and later
+        // volumes are truncated when the first new record lands in them
+        if (ftruncate(volume_fd(&vols, last_vol, 0), (off_t)(end - last_vol_start)) != 0) {
+            perror("truncate cmp"); volumes_close(&vols); close(fdin); return 1;
+        }
+        printf("Resuming at chunk %d of %d (cmp offset %" PRIu64 ")\n", first_chunk, num_chunks, first_offset);
+    } else {
+        int fdcmp = volume_fd(&vols, 0, 1);
+        if (fdcmp < 0) { perror("open cmp"); close(fdin); return 1; }
+
+        // Binary header of .cmp: original size (8), chunk_size (8), num_chunks (4)
+        unsigned char hdr[CMP_HEADER_SIZE];
+        uint64_t fs64 = (uint64_t)filesize;
+        uint64_t cs64 = (uint64_t)chunk_size;
+        uint32_t nch32 = (uint32_t)num_chunks;
+        memcpy(hdr, &fs64, sizeof(uint64_t));
+        memcpy(hdr + 8, &cs64, sizeof(uint64_t));
+        memcpy(hdr + 16, &nch32, sizeof(uint32_t));
+        struct iovec hiov = { hdr, sizeof(hdr) };
+        if (pwritev_full(fdcmp, &hiov, 1, 0) != 0) { perror("write cmp"); volumes_close(&vols); close(fdin); return 1; }
+    }
+    FILE *fmeta = fopen(out_meta, "w");
+    if (!fmeta) { perror("open meta"); volumes_close(&vols); close(fdin); return 1; }
 
     // prepare job queue and worker threads
     JobQueue queue;
-    jobqueue_init(&queue, jobs, num_chunks);
-
-    int nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
-    if (nthreads < 1) nthreads = 1;
-    // Cap threads to a reasonable number
-    if (nthreads > 16) nthreads = 16;
+    jobqueue_init(&queue, num_chunks);
+    queue.next_idx = first_chunk;
 
     pthread_t *threads = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+    FillCache fills;
+    pthread_mutex_init(&fills.lock, NULL);
+    fills.n = 0;
+
     WorkerArg warg;
     warg.queue = &queue;
-    // choose max zstd level intelligently but safe
-    int zstd_max_level = ZSTD_maxCLevel(); // recommended maximum
-    // but ZSTD_maxCLevel() can be large; choose 19 or system max whichever smaller
-    int zstd_level = (zstd_max_level > 19) ? 19 : zstd_max_level;
+    warg.jobs = jobs;
+    warg.fills = &fills;
+    warg.fdin = fdin;
+    warg.sparse = (uint64_t)st.st_blocks * 512 < (uint64_t)filesize;
+    atomic_init(&warg.read_err, 0);
     warg.zstd_level = zstd_level;
+    warg.hash_algo = hash_algo;
+    // when there are fewer chunks than threads, spare cores hash inside chunks
+    warg.hash_threads = num_chunks < nthreads ? nthreads / num_chunks : 1;
+    warg.fused = fused;
+    warg.frame_size = frame_size;
+    warg.filter = filter;
+    warg.filter_auto = filter_auto;
+    warg.huge_mode = huge_mode;
+    warg.perf = NULL;
+#ifdef PERF_COUNTERS
+    PerfTotals perf_totals;
+    if (perf) {
+        // probe on this thread, so a missing PMU is reported once
+        PerfGroup probe;
+        if (perf_group_open(&probe) != 0) {
+            fprintf(stderr, "perf counters unavailable: %s\n", strerror(errno));
+        } else {
+            perf_group_close(&probe);
+            perf_totals_init(&perf_totals);
+            warg.perf = &perf_totals;
+        }
+    }
+#endif
+    EmitState emit;
+    warg.emit = NULL;
+    if (parallel_emit) {
+        emit_init(&emit, jobs, num_chunks, &vols, volume_size, first_chunk, first_offset, last_vol, last_vol_start);
+        warg.emit = &emit;
+        if (max_memory) {
+            queue.frontier = &emit.frontier;
+            queue.window = 2 * nthreads;
+        }
+    }
+
+    Checkpointer cp;
+    pthread_t cp_thread;
+    if (checkpoint_secs > 0) {
+        snprintf(cp.path, sizeof(cp.path), "%s", out_ckpt);
+        cp.es = &emit;
+        cp.vols = &vols;
+        cp.interval = checkpoint_secs;
+        cp.filesize = (uint64_t)filesize;
+        cp.mtime = st.st_mtim;
+        cp.chunk_size = chunk_size;
+        cp.frame_size = frame_size;
+        cp.hash_algo = hash_algo;
+        cp.container = container;
+        cp.done = first_chunk;
+        cp.stop = 0;
+        pthread_mutex_init(&cp.lock, NULL);
+        pthread_cond_init(&cp.cond, NULL);
+        pthread_create(&cp_thread, NULL, checkpoint_thread, &cp);
+    }
 
-    printf("Launching %d worker threads; ZSTD level=%d\n", nthreads, zstd_level);
+    char filter_desc[64] = "";
+    if (filter_auto || filter.type != FILTER_NONE) {
+        char fname[32];
+        if (filter_auto) snprintf(fname, sizeof(fname), "auto");
+        else filter_name(&filter, fname, sizeof(fname));
+        snprintf(filter_desc, sizeof(filter_desc), "; filter=%s (%s)", fname, filter_simd_name());
+    }
+    printf("Launching %d worker threads (%d CPUs available); ZSTD level=%d; emit=%s; hash=%s%s%s%s\n", nthreads, ncpus,
+           zstd_level, parallel_emit ? "parallel" : "ordered", hash_algo_name(hash_algo), fused ? " (fused)" : "",
+           filter_desc, deterministic ? "; deterministic" : "");
+    long long throttled_start = cpu_throttled_usec();
 
     for (int t = 0; t < nthreads; ++t) {
         pthread_create(&threads[t], NULL, worker_thread, &warg);
@@ -180,51 +1473,119 @@ int main(int argc, char **argv) {
 
     // wait for workers
     for (int t = 0; t < nthreads; ++t) pthread_join(threads[t], NULL);
+    close(fdin);
+    int rerr = atomic_load(&warg.read_err);
+    long long throttled_end = cpu_throttled_usec();
+    if (throttled_start >= 0 && throttled_end >= throttled_start)
+        printf("CPU quota throttling while compressing: %.1f ms\n", (double)(throttled_end - throttled_start) / 1000.0);
+#ifdef PERF_COUNTERS
+    if (warg.perf) {
+        perf_totals_report(stdout, warg.perf);
+        perf_totals_destroy(warg.perf);
+    }
+#endif
 
-    // prepare output filenames
-    const char *base = get_basename(inpath);
-    char out_cmp[1024], out_meta[1024];
-    snprintf(out_cmp, sizeof(out_cmp), "%s/%s.cmp", outdir, base);
-    snprintf(out_meta, sizeof(out_meta), "%s/%s.meta", outdir, base);
+    if (checkpoint_secs > 0) {
+        pthread_mutex_lock(&cp.lock);
+        cp.stop = 1;
+        pthread_cond_signal(&cp.cond);
+        pthread_mutex_unlock(&cp.lock);
+        pthread_join(cp_thread, NULL);
+        // on failure, record as much progress as possible for --resume
+        if ((rerr || atomic_load(&emit.err)) && checkpoint_write(&cp) != 0) perror("checkpoint");
+    }
+    if (rerr) { fprintf(stderr, "input read failed\n"); volumes_close(&vols); fclose(fmeta); return 1; }
 
-    FILE *fcmp = fopen(out_cmp, "wb");
-    if (!fcmp) { perror("open cmp"); return 1; }
-    FILE *fmeta = fopen(out_meta, "w");
-    if (!fmeta) { perror("open meta"); fclose(fcmp); return 1; }
+    if (parallel_emit) {
+        int eerr = atomic_load(&emit.err);
+        emit_destroy(&emit);
+        if (eerr) { fprintf(stderr, "write cmp: %s\n", strerror(eerr)); volumes_close(&vols); fclose(fmeta); return 1; }
+    } else {
+        // Each chunk record is comp_size (8) followed by the data, so record
+        // offsets are a prefix sum of the compressed sizes.
+        layout_records(jobs, num_chunks, volume_size, &last_vol, &last_vol_start);
 
-    // Write binary header to .cmp: original size (8), chunk_size (8), num_chunks (4)
-    fwrite(&filesize, sizeof(uint64_t), 1, fcmp);
-    uint64_t cs64 = (uint64_t)chunk_size;
-    fwrite(&cs64, sizeof(uint64_t), 1, fcmp);
-    uint32_t nch32 = (uint32_t)num_chunks;
-    fwrite(&nch32, sizeof(uint32_t), 1, fcmp);
+        // Records go straight from the worker buffers to the file with pwritev;
+        // with several writers each gets a disjoint run of chunks.
+        if (nwriters > num_chunks) nwriters = num_chunks;
+        pthread_t *wthreads = (pthread_t*)malloc(nwriters * sizeof(pthread_t));
+        WriterArg *wargs = (WriterArg*)calloc((size_t)nwriters, sizeof(WriterArg));
+        for (int w = 0; w < nwriters; ++w) {
+            wargs[w].jobs = jobs;
+            wargs[w].first = (int)((int64_t)num_chunks * w / nwriters);
+            wargs[w].last = (int)((int64_t)num_chunks * (w + 1) / nwriters);
+            wargs[w].vols = &vols;
+            pthread_create(&wthreads[w], NULL, writer_thread, &wargs[w]);
+        }
+        int werr = 0;
+        for (int w = 0; w < nwriters; ++w) {
+            pthread_join(wthreads[w], NULL);
+            if (wargs[w].err && !werr) werr = wargs[w].err;
+        }
+        free(wthreads);
+        free(wargs);
+        if (werr) { fprintf(stderr, "write cmp: %s\n", strerror(werr)); volumes_close(&vols); fclose(fmeta); return 1; }
+    }
 
-    // For each chunk write comp_size (8) then data; write meta line per chunk: id orig_size comp_size sha256hex
-    for (int i = 0; i < num_chunks; ++i) {
-        // ensure job has compressed data
-        size_t csize = jobs[i].csize;
-        uint64_t csize64 = (uint64_t)csize;
-        fwrite(&csize64, sizeof(uint64_t), 1, fcmp);
-        if (csize > 0) fwrite(jobs[i].cdata, 1, csize, fcmp);
+    // Merkle root over the chunk hashes the workers already produced, so a
+    // whole-file digest costs no extra pass over the data
+    unsigned char (*hashes)[HASH_SIZE] = malloc((size_t)num_chunks * HASH_SIZE);
+    if (!hashes) { fprintf(stderr, "OOM\n"); volumes_close(&vols); fclose(fmeta); return 1; }
+    for (int i = 0; i < num_chunks; ++i) memcpy(hashes[i], jobs[i].digest, HASH_SIZE);
+    unsigned char root[HASH_SIZE];
+    merkle_root((const unsigned char (*)[HASH_SIZE])hashes, (size_t)num_chunks, root);
+    free(hashes);
+    char hex[2 * HASH_SIZE + 1];
+    hash_to_hex(root, hex);
+    if (hash_algo != HASH_SHA256) fprintf(fmeta, "# hash %s\n", hash_algo_name(hash_algo));
+    fprintf(fmeta, "# merkle_root %s\n", hex);
+    // the last record's volume is the last volume; earlier ones may have been
+    // written before a resume and so not be open here
+    uint32_t nvol = jobs[num_chunks - 1].vol + 1;
+    if (vols.split) fprintf(fmeta, "# volume_size %" PRIu64 "\n# volumes %u\n", volume_size, nvol);
+    if (frame_size) fprintf(fmeta, "# frame_size %zu\n", frame_size);
 
-        // write meta line: id orig_size comp_size sha256hex
-        char hex[65]; hex[64] = 0;
-        for (int b = 0; b < 32; ++b) sprintf(hex + b*2, "%02x", jobs[i].sha256[b]);
-        fprintf(fmeta, "%d %" PRIu64 " %" PRIu64 " %s\n", jobs[i].id, (uint64_t)jobs[i].orig_size, (uint64_t)csize64, hex);
+    // write meta line per chunk: id orig_size comp_size digesthex [kind],
+    // then its seek table if it was split into frames
+    for (int i = 0; i < num_chunks; ++i) {
+        MetaEntry e;
+        job_meta(&jobs[i], &e);
+        meta_write_line(fmeta, &e);
+        if (jobs[i].nframes) meta_write_seek(fmeta, i, jobs[i].frame_csize, jobs[i].nframes);
     }
 
-    fclose(fcmp);
-    fclose(fmeta);
+    if (volumes_close(&vols) < 0) { perror("close cmp"); fclose(fmeta); return 1; }
+    if (fclose(fmeta) != 0) { perror("close meta"); return 1; }
+    if (checkpoint_secs > 0) unlink(out_ckpt);
 
-    printf("Compression complete: %s and %s\n", out_cmp, out_meta);
+    hash_to_hex(root, hex);
+    printf("Merkle root: %s\n", hex);
+    if (filter_auto || filter.type != FILTER_NONE) {
+        int filtered = 0;
+        for (int i = 0; i < num_chunks; ++i) filtered += jobs[i].filter.type != FILTER_NONE;
+        printf("Filtered chunks: %d of %d\n", filtered, num_chunks);
+    }
+    if (vols.split) {
+        // drop volumes left over from an earlier, longer run
+        char path[1100];
+        for (uint32_t v = nvol; ; ++v) {
+            volume_name(&vols, v, path, sizeof(path));
+            if (unlink(path) != 0) break;
+        }
+        printf("Compression complete: %s.001 .. %s.%03u (%u volumes) and %s\n", out_cmp, out_cmp, nvol, nvol, out_meta);
+    } else {
+        printf("Compression complete: %s and %s\n", out_cmp, out_meta);
+    }
 
     // free memory
     for (int i = 0; i < num_chunks; ++i) {
         if (jobs[i].data) free(jobs[i].data);
         if (jobs[i].cdata) free(jobs[i].cdata);
+        free(jobs[i].frame_csize);
     }
     free(jobs);
     free(threads);
+    free(vols.fds);
 
     return 0;
 }
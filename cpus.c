@@ -0,0 +1,127 @@
+// cpus.c
+// CPU count from sched_getaffinity and the cgroup CPU quota.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include "cpus.h"
+
+// Directory of this process's cgroup for the cpu controller, with the length
+// of its mount point in *root (ancestors are walked up to there). Returns 2
+// for cgroup v2, 1 for v1, 0 if there is none.
+static int cgroup_dir(char *out, size_t len, size_t *root) {
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (!f) return 0;
+    char line[1024], v1_ctrl[256] = "", v1_path[768] = "", v2_path[768] = "";
+    int have_v1 = 0, have_v2 = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = 0;
+        // "id:controllers:path"
+        char *c1 = strchr(line, ':'), *c2 = c1 ? strchr(c1 + 1, ':') : NULL;
+        if (!c2) continue;
+        *c2 = 0;
+        const char *ctrl = c1 + 1, *path = c2 + 1;
+        if (!*ctrl) {
+            snprintf(v2_path, sizeof(v2_path), "%s", path);
+            have_v2 = 1;
+            continue;
+        }
+        char tok[256];
+        snprintf(tok, sizeof(tok), "%s", ctrl);
+        for (char *save, *t = strtok_r(tok, ",", &save); t; t = strtok_r(NULL, ",", &save)) {
+            if (strcmp(t, "cpu") == 0) {
+                snprintf(v1_ctrl, sizeof(v1_ctrl), "%s", ctrl);
+                snprintf(v1_path, sizeof(v1_path), "%s", path);
+                have_v1 = 1;
+            }
+        }
+    }
+    fclose(f);
+
+    // Inside a container the path may be the host's view; the mount point
+    // itself is then the container's cgroup.
+    if (have_v1) {
+        const char *mounts[2] = { v1_ctrl, "cpu" };
+        for (int m = 0; m < 2; ++m) {
+            char base[512];
+            snprintf(base, sizeof(base), "/sys/fs/cgroup/%s", mounts[m]);
+            if (access(base, F_OK) != 0) continue;
+            *root = strlen(base);
+            snprintf(out, len, "%s%s", base, v1_path);
+            if (access(out, F_OK) != 0) snprintf(out, len, "%s", base);
+            return 1;
+        }
+    }
+    if (have_v2 && access("/sys/fs/cgroup/cgroup.controllers", F_OK) == 0) {
+        *root = strlen("/sys/fs/cgroup");
+        snprintf(out, len, "/sys/fs/cgroup%s", v2_path);
+        if (access(out, F_OK) != 0) snprintf(out, len, "/sys/fs/cgroup");
+        return 2;
+    }
+    return 0;
+}
+
+static int read_file(const char *dir, const char *name, char *buf, size_t len) {
+    char path[1400];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    size_t n = fread(buf, 1, len - 1, f);
+    fclose(f);
+    buf[n] = 0;
+    return 0;
+}
+
+// CPUs' worth of quota set on 'dir' itself, or 0 for none.
+static int dir_quota(int version, const char *dir) {
+    char buf[128];
+    long long quota = -1, period = 0;
+    if (version == 2) {
+        char max[32];
+        if (read_file(dir, "cpu.max", buf, sizeof(buf)) != 0 || sscanf(buf, "%31s %lld", max, &period) != 2) return 0;
+        if (strcmp(max, "max") != 0) quota = atoll(max);
+    } else {
+        if (read_file(dir, "cpu.cfs_quota_us", buf, sizeof(buf)) != 0) return 0;
+        quota = atoll(buf);
+        if (read_file(dir, "cpu.cfs_period_us", buf, sizeof(buf)) != 0) return 0;
+        period = atoll(buf);
+    }
+    if (quota <= 0 || period <= 0) return 0;
+    return (int)((quota + period - 1) / period);
+}
+
+int available_cpus(void) {
+    int n = 0;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) n = CPU_COUNT(&set);
+    if (n < 1) n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    char dir[1024];
+    size_t root;
+    int version = cgroup_dir(dir, sizeof(dir), &root);
+    // the tightest quota on the way up to the root applies
+    while (version) {
+        int q = dir_quota(version, dir);
+        if (q > 0 && q < n) n = q;
+        char *slash = strrchr(dir, '/');
+        if (!slash || (size_t)(slash - dir) < root) break;
+        *slash = 0;
+    }
+    return n < 1 ? 1 : n;
+}
+
+long long cpu_throttled_usec(void) {
+    char dir[1024], buf[1024];
+    size_t root;
+    int version = cgroup_dir(dir, sizeof(dir), &root);
+    if (!version || read_file(dir, "cpu.stat", buf, sizeof(buf)) != 0) return -1;
+    // v2 reports microseconds, v1 nanoseconds
+    const char *key = version == 2 ? "throttled_usec " : "throttled_time ";
+    const char *p = strstr(buf, key);
+    if (!p) return -1;
+    long long v = atoll(p + strlen(key));
+    return version == 2 ? v : v / 1000;
+}
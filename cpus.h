@@ -0,0 +1,18 @@
+// cpus.h
+// How many CPUs this process can really use. sysconf(_SC_NPROCESSORS_ONLN)
+// counts the host's CPUs, which in a container with a CPU limit means far
+// more threads than the quota can run, and heavy throttling.
+
+#ifndef CPUS_H
+#define CPUS_H
+
+// The affinity mask (which cpusets narrow), capped by the CFS quota of this
+// process's cgroup and its ancestors (cgroup v2 cpu.max, v1
+// cpu.cfs_quota_us / cpu.cfs_period_us), rounded up. At least 1.
+int available_cpus(void);
+
+// Total time this process's cgroup has been throttled by its CPU quota, in
+// microseconds, or -1 if the cgroup does not report it.
+long long cpu_throttled_usec(void);
+
+#endif
@@ -0,0 +1,139 @@
+// decode.c
+// Chunk payload decoding with a reusable ZSTD_DCtx, and the buffer pool.
+
+#include <stdlib.h>
+#include <string.h>
+#include "decode.h"
+
+int decoder_init(Decoder *d) {
+    d->scratch = NULL;
+    d->scratch_cap = 0;
+    d->arena = huge_arena_new(HUGE_THP);
+    d->dctx = d->arena ? ZSTD_createDCtx_advanced(huge_arena_mem(d->arena)) : NULL;
+    if (d->dctx) return 0;
+    huge_arena_free(d->arena);
+    d->arena = NULL;
+    return -1;
+}
+
+void decoder_free(Decoder *d) {
+    ZSTD_freeDCtx(d->dctx);
+    huge_arena_free(d->arena);
+    free(d->scratch);
+    d->scratch = NULL;
+    d->scratch_cap = 0;
+    d->dctx = NULL;
+    d->arena = NULL;
+}
+
+static unsigned char *decoder_scratch(Decoder *d, size_t size) {
+    if (size > d->scratch_cap) {
+        free(d->scratch);
+        d->scratch = (unsigned char*)huge_buffer_alloc(size ? size : 1);
+        d->scratch_cap = d->scratch ? size : 0;
+    }
+    return d->scratch;
+}
+
+long long decode_chunk(Decoder *d, const MetaEntry *e, const unsigned char *cbuf, size_t csize, unsigned char *outbuf) {
+    if (e->kind == CHUNK_HOLE) {
+        if (csize != 0) return -1;
+        memset(outbuf, 0, e->orig_size);
+        return (long long)e->orig_size;
+    }
+    if (e->kind == CHUNK_FILL) {
+        if (csize != 1) return -1;
+        memset(outbuf, cbuf[0], e->orig_size);
+        return (long long)e->orig_size;
+    }
+    if (e->kind == CHUNK_RAW) {
+        if (csize != e->orig_size) return -1;
+        memcpy(outbuf, cbuf, csize);
+        return (long long)csize;
+    }
+    if (e->filter.type != FILTER_NONE) {
+        // each ZSTD frame is one filter block, so the first frame's size is
+        // the block size (the whole chunk unless it is framed)
+        unsigned long long block = ZSTD_getFrameContentSize(cbuf, csize);
+        unsigned char *tmp = decoder_scratch(d, (size_t)e->orig_size);
+        if (!tmp || block == ZSTD_CONTENTSIZE_UNKNOWN || block == ZSTD_CONTENTSIZE_ERROR) return -1;
+        size_t r = ZSTD_decompressDCtx(d->dctx, tmp, e->orig_size, cbuf, csize);
+        if (ZSTD_isError(r)) return -1;
+        filter_decode(&e->filter, outbuf, tmp, r, (size_t)block);
+        return (long long)r;
+    }
+    size_t r = ZSTD_decompressDCtx(d->dctx, outbuf, e->orig_size, cbuf, csize);
+    if (ZSTD_isError(r)) return -1;
+    return (long long)r;
+}
+
+int decode_frame(Decoder *d, const MetaEntry *e, const unsigned char *cbuf, size_t csize, unsigned char *outbuf,
+                 size_t size) {
+    unsigned char *dst = e->filter.type != FILTER_NONE ? decoder_scratch(d, size) : outbuf;
+    if (!dst) return -1;
+    size_t r = ZSTD_decompressDCtx(d->dctx, dst, size, cbuf, csize);
+    if (ZSTD_isError(r) || r != size) return -1;
+    if (dst != outbuf) filter_decode(&e->filter, outbuf, dst, size, 0);
+    return 0;
+}
+
+void bufpool_init(BufPool *p) {
+    pthread_mutex_init(&p->lock, NULL);
+    p->n = 0;
+}
+
+void bufpool_destroy(BufPool *p) {
+    for (int i = 0; i < p->n; ++i) free(p->slot[i].buf);
+    p->n = 0;
+    pthread_mutex_destroy(&p->lock);
+}
+
+// Sizes are rounded up to a power of two (at least 4 KiB), so chunks of
+// similar size share buffers.
+static size_t bufpool_class(size_t size) {
+    size_t c = 4096;
+    while (c < size) c <<= 1;
+    return c;
+}
+
+unsigned char *bufpool_get(BufPool *p, size_t size, size_t *cap) {
+    size_t want = bufpool_class(size);
+    pthread_mutex_lock(&p->lock);
+    // smallest pooled buffer that fits
+    int best = -1;
+    for (int i = 0; i < p->n; ++i)
+        if (p->slot[i].cap >= want && (best < 0 || p->slot[i].cap < p->slot[best].cap)) best = i;
+    if (best >= 0) {
+        unsigned char *buf = p->slot[best].buf;
+        *cap = p->slot[best].cap;
+        p->slot[best] = p->slot[--p->n];
+        pthread_mutex_unlock(&p->lock);
+        return buf;
+    }
+    pthread_mutex_unlock(&p->lock);
+    *cap = want;
+    return (unsigned char*)huge_buffer_alloc(want);
+}
+
+void bufpool_put(BufPool *p, unsigned char *buf, size_t cap) {
+    if (!buf) return;
+    pthread_mutex_lock(&p->lock);
+    if (p->n < BUFPOOL_SLOTS) {
+        p->slot[p->n].buf = buf;
+        p->slot[p->n].cap = cap;
+        p->n++;
+        buf = NULL;
+    } else {
+        // full: keep the larger buffer, which fits more requests
+        int small = 0;
+        for (int i = 1; i < p->n; ++i) if (p->slot[i].cap < p->slot[small].cap) small = i;
+        if (p->slot[small].cap < cap) {
+            unsigned char *old = p->slot[small].buf;
+            p->slot[small].buf = buf;
+            p->slot[small].cap = cap;
+            buf = old;
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    free(buf);
+}
@@ -0,0 +1,53 @@
+// decode.h
+// Chunk payload decoding and buffer recycling, shared by decompressor.c and
+// decode_bench.c.
+
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <zstd.h>
+#include "archive.h"
+#include "hugemem.h"
+
+// One per thread. Keeping the ZSTD_DCtx alive avoids the context setup and
+// window allocation that one-shot ZSTD_decompress() repeats for every chunk.
+// Its allocations go through a per-thread transparent huge page arena.
+// Filtered payloads are decoded into 'scratch' and un-filtered from there.
+typedef struct {
+    HugeArena *arena;
+    ZSTD_DCtx *dctx;
+    unsigned char *scratch;
+    size_t scratch_cap;
+} Decoder;
+
+int decoder_init(Decoder *d);
+void decoder_free(Decoder *d);
+
+// Expand one chunk payload into outbuf (orig_size bytes). Returns the number
+// of bytes produced, or -1.
+long long decode_chunk(Decoder *d, const MetaEntry *e, const unsigned char *cbuf, size_t csize, unsigned char *outbuf);
+
+// Expand one seek frame of framed chunk e into outbuf, which must hold
+// exactly the frame's 'size' input bytes. Returns 0 or -1.
+int decode_frame(Decoder *d, const MetaEntry *e, const unsigned char *cbuf, size_t csize, unsigned char *outbuf,
+                 size_t size);
+
+// Free list of buffers shared between threads, so steady-state decoding does
+// not go back to malloc for every chunk. Buffers of 2 MiB and up are huge page
+// backed, like the decoders' output buffers. Buffers come back through
+// bufpool_put() with the capacity bufpool_get() reported.
+#define BUFPOOL_SLOTS 64
+typedef struct {
+    pthread_mutex_t lock;
+    int n;
+    struct { unsigned char *buf; size_t cap; } slot[BUFPOOL_SLOTS];
+} BufPool;
+
+void bufpool_init(BufPool *p);
+void bufpool_destroy(BufPool *p);
+unsigned char *bufpool_get(BufPool *p, size_t size, size_t *cap);
+void bufpool_put(BufPool *p, unsigned char *buf, size_t cap);
+
+#endif
@@ -0,0 +1,125 @@
+// decode_bench.c
+// Microbenchmark for the decompressor's per-chunk overhead: one-shot
+// ZSTD_decompress() with malloc/free of both buffers per chunk (the old
+// path) against a persistent Decoder and pooled buffers (decode.c).
+// Runs 1 MiB chunks and small content-defined-chunking sized chunks
+// (2..16 KiB), where the fixed per-chunk cost dominates.
+//
+// Usage: decode_bench [total_MiB] [rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <zstd.h>
+#include "decode.h"
+#include "bench_util.h"
+
+typedef struct {
+    MetaEntry e;
+    unsigned char *cdata;   // compressed payload, stands in for the record just read
+} BenchChunk;
+
+static BenchChunk *make_chunks(const unsigned char *data, size_t total, size_t min, size_t max, int *count) {
+    int cap = (int)(total / min) + 1, n = 0;
+    BenchChunk *c = (BenchChunk*)calloc((size_t)cap, sizeof(BenchChunk));
+    for (size_t off = 0; off < total && c; ++n) {
+        size_t len = min == max ? min : min + rng() % (max - min + 1);
+        if (len > total - off) len = total - off;
+        size_t bound = ZSTD_compressBound(len);
+        c[n].cdata = (unsigned char*)malloc(bound);
+        c[n].e.id = n;
+        c[n].e.orig_size = len;
+        c[n].e.comp_size = ZSTD_compress(c[n].cdata, bound, data + off, len, 3);
+        c[n].e.kind = CHUNK_ZSTD;
+        off += len;
+    }
+    *count = n;
+    return c;
+}
+
+// the old decompressor loop body
+static int run_oneshot(const BenchChunk *c, int n) {
+    for (int i = 0; i < n; ++i) {
+        unsigned char *cbuf = (unsigned char*)malloc(c[i].e.comp_size);
+        unsigned char *outbuf = (unsigned char*)malloc(c[i].e.orig_size);
+        if (!cbuf || !outbuf) return -1;
+        memcpy(cbuf, c[i].cdata, c[i].e.comp_size);
+        size_t r = ZSTD_decompress(outbuf, c[i].e.orig_size, cbuf, c[i].e.comp_size);
+        free(outbuf);
+        free(cbuf);
+        if (ZSTD_isError(r) || r != c[i].e.orig_size) return -1;
+    }
+    return 0;
+}
+
+// the current decode worker: pooled record buffers, a reused output buffer
+// and one ZSTD_DCtx
+static int run_reused(const BenchChunk *c, int n, Decoder *dec, BufPool *pool) {
+    static unsigned char *outbuf;
+    static size_t ocap;
+    for (int i = 0; i < n; ++i) {
+        size_t cap;
+        unsigned char *cbuf = bufpool_get(pool, c[i].e.comp_size, &cap);
+        if (c[i].e.orig_size > ocap) {
+            free(outbuf);
+            outbuf = (unsigned char*)malloc(c[i].e.orig_size);
+            ocap = c[i].e.orig_size;
+        }
+        if (!cbuf || !outbuf) return -1;
+        memcpy(cbuf, c[i].cdata, c[i].e.comp_size);
+        long long r = decode_chunk(dec, &c[i].e, cbuf, c[i].e.comp_size, outbuf);
+        bufpool_put(pool, cbuf, cap);
+        if (r < 0 || (uint64_t)r != c[i].e.orig_size) return -1;
+    }
+    return 0;
+}
+
+static int bench(const char *label, const unsigned char *data, size_t total, size_t min, size_t max, int rounds) {
+    int n = 0;
+    BenchChunk *c = make_chunks(data, total, min, max, &n);
+    if (!c) { fprintf(stderr, "OOM\n"); return 1; }
+    Decoder dec;
+    BufPool pool;
+    if (decoder_init(&dec) != 0) { fprintf(stderr, "OOM\n"); return 1; }
+    bufpool_init(&pool);
+
+    double best_old = 1e30, best_new = 1e30;
+    int rc = 0;
+    for (int r = 0; r < rounds && rc == 0; ++r) {
+        double t0 = now_sec();
+        rc |= run_oneshot(c, n);
+        double t1 = now_sec();
+        rc |= run_reused(c, n, &dec, &pool);
+        double t2 = now_sec();
+        if (t1 - t0 < best_old) best_old = t1 - t0;
+        if (t2 - t1 < best_new) best_new = t2 - t1;
+    }
+    if (rc != 0) fprintf(stderr, "%s: decode failed\n", label);
+    else
+        printf("%-14s %8d chunks  one-shot %8.1f MB/s %7.0f ns/chunk  reused %8.1f MB/s %7.0f ns/chunk  x%.2f\n",
+               label, n, total / best_old / 1e6, best_old * 1e9 / n, total / best_new / 1e6, best_new * 1e9 / n,
+               best_old / best_new);
+
+    for (int i = 0; i < n; ++i) free(c[i].cdata);
+    free(c);
+    bufpool_destroy(&pool);
+    decoder_free(&dec);
+    return rc != 0;
+}
+
+int main(int argc, char **argv) {
+    size_t total = (size_t)(argc > 1 ? atoi(argv[1]) : 64) << 20;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    if (total == 0 || rounds < 1) { fprintf(stderr, "Usage: %s [total_MiB] [rounds]\n", argv[0]); return 1; }
+    unsigned char *data = (unsigned char*)malloc(total);
+    if (!data) { fprintf(stderr, "OOM\n"); return 1; }
+    fill_data(data, total, 0);
+
+    printf("decode_bench: %zu MiB, best of %d rounds\n", total >> 20, rounds);
+    int rc = bench("1MiB", data, total, 1 << 20, 1 << 20, rounds);
+    rc |= bench("cdc-2..16KiB", data, total, 2 << 10, 16 << 10, rounds);
+    free(data);
+    return rc;
+}
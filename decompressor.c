@@ -1,5 +1,7 @@
 // decompressor.c
-// Decompress files created by compressor.c
+// Decompress files created by compressor.c. Reader threads stream the .cmp
+// (each volume of a multi-volume archive concurrently) with an adaptive
+// read-ahead window, and a pool of workers decodes and writes the chunks.
 
 #define _GNU_SOURCE
 #include <stdio.h>
@@ -10,6 +12,395 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "hash.h"
+#include "archive.h"
+#include "decode.h"
+#include "cpus.h"
+
+static void collect_hashes(const MetaIndex *mi, unsigned char (*hashes)[HASH_SIZE]) {
+    for (uint32_t i = 0; i < mi->count; ++i) memcpy(hashes[i], mi->entries[i].hash, HASH_SIZE);
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, off_t off) {
+    const unsigned char *p = (const unsigned char*)buf;
+    while (len > 0) {
+        ssize_t w = pwrite(fd, p, len, off);
+        if (w <= 0) return -1;
+        p += w; len -= (size_t)w; off += w;
+    }
+    return 0;
+}
+
+// Zero runs of at least a page, page-aligned in the output file, are not
+// written: the output starts empty and is extended to its full length at
+// the end, so they stay holes, as the zeros of a sparse input's partly-hole
+// chunks were.
+#define SPARSE_PAGE 4096
+
+static int all_zero(const unsigned char *p, size_t n) {
+    return n == 0 || (p[0] == 0 && memcmp(p, p + 1, n - 1) == 0);
+}
+
+static int pwrite_sparse(int fd, const unsigned char *buf, size_t len, off_t off) {
+    size_t pos = 0, run = 0;   // [run, pos) is data still to be written
+    while (pos < len) {
+        size_t next = (size_t)(((uint64_t)off + pos) / SPARSE_PAGE + 1) * SPARSE_PAGE - (size_t)off;
+        if (next > len) next = len;
+        if (next - pos == SPARSE_PAGE && all_zero(buf + pos, SPARSE_PAGE)) {
+            if (pos > run && pwrite_full(fd, buf + run, pos - run, off + (off_t)run) != 0) return -1;
+            run = next;
+        }
+        pos = next;
+    }
+    return pos > run ? pwrite_full(fd, buf + run, pos - run, off + (off_t)run) : 0;
+}
+
+typedef struct {
+    const MetaIndex *mi;
+    const VolumeMap *vm;
+    atomic_uint next;
+    atomic_uint bad;
+} VerifyState;
+
+// Chunks are independent, so verification just fans them out over threads:
+// decompress, hash and compare against the .meta entry.
+static void *verify_thread(void *varg) {
+    VerifyState *vs = (VerifyState*)varg;
+    Decoder dec;
+    if (decoder_init(&dec) != 0) { fprintf(stderr, "OOM\n"); atomic_fetch_add(&vs->bad, 1); return NULL; }
+    unsigned char *cbuf = NULL, *outbuf = NULL;
+    size_t ccap = 0, ocap = 0;
+    // holes are nearly all chunk_size long: hash their zeros once per length
+    uint64_t zero_len = UINT64_MAX;
+    unsigned char zero_hash[HASH_SIZE];
+    for (;;) {
+        unsigned int i = atomic_fetch_add(&vs->next, 1);
+        if (i >= vs->mi->count) break;
+        const MetaEntry *e = &vs->mi->entries[i];
+        int ok = 0;
+        int fd = vs->vm->fds[vs->vm->vol[i]];
+        off_t off = (off_t)vs->vm->off[i];
+        if (e->kind == CHUNK_HOLE) {
+            // nothing stored: the record must be empty and the digest that of
+            // the zeros
+            if (e->orig_size != zero_len) {
+                hash_zeros(vs->mi->hash_algo, e->orig_size, zero_hash);
+                zero_len = e->orig_size;
+            }
+            uint64_t csize64 = 1;
+            ok = e->comp_size == 0
+                 && memcmp(e->hash, zero_hash, HASH_SIZE) == 0
+                 && pread_full(fd, &csize64, sizeof(csize64), off) == 0 && csize64 == 0;
+            if (!ok) {
+                fprintf(stderr, "chunk %u: verification FAILED\n", i);
+                atomic_fetch_add(&vs->bad, 1);
+            }
+            continue;
+        }
+        uint64_t csize64 = 0;
+        if (e->comp_size > ccap) {
+            free(cbuf);
+            cbuf = (unsigned char*)malloc((size_t)e->comp_size);
+            ccap = cbuf ? (size_t)e->comp_size : 0;
+        }
+        if (e->orig_size > ocap) {
+            free(outbuf);
+            outbuf = (unsigned char*)huge_buffer_alloc((size_t)e->orig_size);
+            ocap = outbuf ? (size_t)e->orig_size : 0;
+        }
+        if (ccap >= e->comp_size && ocap >= e->orig_size
+            && pread_full(fd, &csize64, sizeof(csize64), off) == 0
+            && csize64 == e->comp_size
+            && pread_full(fd, cbuf, e->comp_size, off + (off_t)sizeof(uint64_t)) == 0) {
+            long long r = decode_chunk(&dec, e, cbuf, e->comp_size, outbuf);
+            if (r >= 0 && (uint64_t)r == e->orig_size) {
+                unsigned char h[HASH_SIZE];
+                hash_chunk(vs->mi->hash_algo, outbuf, (size_t)r, h, 1);
+                ok = memcmp(h, e->hash, HASH_SIZE) == 0;
+            }
+        }
+        if (!ok) {
+            fprintf(stderr, "chunk %u: verification FAILED\n", i);
+            atomic_fetch_add(&vs->bad, 1);
+        }
+    }
+    free(cbuf);
+    free(outbuf);
+    decoder_free(&dec);
+    return NULL;
+}
+
+static int verify_archive(const VolumeMap *vm, const MetaIndex *mi) {
+    unsigned char (*hashes)[HASH_SIZE] = malloc(((size_t)mi->count + 1) * HASH_SIZE);
+    if (!hashes) { fprintf(stderr, "OOM\n"); return 1; }
+
+    VerifyState vs;
+    vs.mi = mi;
+    vs.vm = vm;
+    atomic_init(&vs.next, 0);
+    atomic_init(&vs.bad, 0);
+
+    int nthreads = available_cpus();
+    if (nthreads > 16) nthreads = 16;
+    pthread_t *threads = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+    for (int t = 0; t < nthreads; ++t) pthread_create(&threads[t], NULL, verify_thread, &vs);
+    for (int t = 0; t < nthreads; ++t) pthread_join(threads[t], NULL);
+    free(threads);
+
+    unsigned int bad = atomic_load(&vs.bad);
+    int root_ok = 1;
+    if (mi->has_root) {
+        unsigned char root[HASH_SIZE];
+        collect_hashes(mi, hashes);
+        merkle_root((const unsigned char (*)[HASH_SIZE])hashes, mi->count, root);
+        root_ok = memcmp(root, mi->root, HASH_SIZE) == 0;
+        if (!root_ok) fprintf(stderr, "merkle root mismatch\n");
+    }
+    free(hashes);
+
+    printf("Verified %u chunks: %u bad, merkle root %s\n", mi->count, bad,
+           mi->has_root ? (root_ok ? "OK" : "MISMATCH") : "absent");
+    return (bad == 0 && root_ok) ? 0 : 1;
+}
+
+// Print the audit path proving chunk 'idx' belongs to the recorded root; a
+// reader holding only that chunk and the root can check it with merkle_verify().
+static int print_proof(const MetaIndex *mi, uint32_t idx) {
+    if (!mi->has_root) { fprintf(stderr, "meta has no merkle root\n"); return 1; }
+    if (idx >= mi->count) { fprintf(stderr, "chunk %u out of range\n", idx); return 1; }
+    size_t depth = merkle_depth(mi->count);
+    unsigned char (*hashes)[HASH_SIZE] = malloc((size_t)mi->count * HASH_SIZE);
+    unsigned char (*path)[HASH_SIZE] = malloc((depth + 1) * HASH_SIZE);
+    if (!hashes || !path) { fprintf(stderr, "OOM\n"); free(hashes); free(path); return 1; }
+    collect_hashes(mi, hashes);
+    size_t len = merkle_proof((const unsigned char (*)[HASH_SIZE])hashes, mi->count, idx, path);
+
+    char hex[2 * HASH_SIZE + 1];
+    hash_to_hex(mi->root, hex);
+    printf("root %s\nchunks %u\nchunk %u\n", hex, mi->count, idx);
+    hash_to_hex(mi->entries[idx].hash, hex);
+    printf("hash %s\n", hex);
+    for (size_t i = 0; i < len; ++i) {
+        hash_to_hex(path[i], hex);
+        printf("path %s\n", hex);
+    }
+    int ok = merkle_verify(mi->entries[idx].hash, idx, mi->count,
+                           (const unsigned char (*)[HASH_SIZE])path, len, mi->root);
+    printf("proof %s\n", ok ? "OK" : "INVALID");
+    free(hashes);
+    free(path);
+    return ok ? 0 : 1;
+}
+
+// Read-ahead window of a volume reader, in compressed bytes. The window is
+// sized like a bandwidth-delay product: bytes the decoders consume during a
+// read, with headroom, so slow or jittery reads are hidden behind decoding.
+// Two records are always admitted, so at worst it is double buffering.
+#define READAHEAD_MIN (8ull << 20)
+#define READAHEAD_MAX (512ull << 20)
+#define READAHEAD_HEADROOM 4.0
+
+// Per reader thread; fields other than lat are guarded by the pipeline lock.
+typedef struct {
+    uint64_t inflight;     // bytes read but not yet decoded
+    int inflight_n;
+    uint64_t window;
+    uint64_t consumed;     // bytes the decoders have taken from this reader
+    double start;
+    double lat;            // moving average of seconds per read
+} VolumeReader;
+
+typedef struct ReadBuf {
+    uint32_t idx;
+    unsigned char *cbuf;   // the whole record: comp_size (8) + payload
+    size_t len;
+    size_t cap;            // capacity of cbuf, for returning it to the pool
+    VolumeReader *owner;
+    struct ReadBuf *next;
+} ReadBuf;
+
+// Reader threads (one per volume at a time) stream records into a queue that
+// decode workers drain; chunks are written at their own output offset.
+typedef struct {
+    const MetaIndex *mi;
+    const VolumeMap *vm;
+    const uint64_t *out_off;   // where each chunk starts in the output file
+    int fdout;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;      // queue gained a record, or the readers finished
+    pthread_cond_t space;      // a reader's window drained
+    ReadBuf *head, *tail;
+    BufPool pool;              // record buffers, recycled from workers back to readers
+    int readers_left;
+    atomic_uint next_vol;
+    atomic_int err;
+} Pipeline;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Called with the pipeline lock held after every read.
+static void readahead_adapt(VolumeReader *vr, double now) {
+    double rate = now > vr->start ? (double)vr->consumed / (now - vr->start) : 0;
+    double want = READAHEAD_HEADROOM * rate * vr->lat;
+    if (want < READAHEAD_MIN) want = READAHEAD_MIN;
+    if (want > READAHEAD_MAX) want = READAHEAD_MAX;
+    vr->window = (uint64_t)want;
+}
+
+static void *reader_thread(void *varg) {
+    Pipeline *pl = (Pipeline*)varg;
+    const VolumeMap *vm = pl->vm;
+    VolumeReader vr;
+    memset(&vr, 0, sizeof(vr));
+    vr.window = READAHEAD_MIN;
+    vr.start = now_sec();
+    for (;;) {
+        unsigned int v = atomic_fetch_add(&pl->next_vol, 1);
+        if (v >= vm->count || atomic_load(&pl->err)) break;
+        int fd = vm->fds[v];
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        uint64_t prefetched = 0;   // the kernel has been asked for everything below this
+        for (uint32_t i = vm->first[v]; i < vm->first[v + 1]; ++i) {
+            const MetaEntry *e = &pl->mi->entries[i];
+            size_t len = sizeof(uint64_t) + (size_t)e->comp_size;
+            uint64_t off = vm->off[i];
+
+            pthread_mutex_lock(&pl->lock);
+            while (!atomic_load(&pl->err) && vr.inflight_n >= 2 && vr.inflight + len > vr.window)
+                pthread_cond_wait(&pl->space, &pl->lock);
+            uint64_t window = vr.window;
+            pthread_mutex_unlock(&pl->lock);
+            if (atomic_load(&pl->err)) break;
+
+            // keep the device busy with the rest of the window while we
+            // copy this record out and the workers decode
+            if (prefetched < off + window / 2) {
+                if (prefetched < off) prefetched = off;
+                posix_fadvise(fd, (off_t)prefetched, (off_t)(off + window - prefetched), POSIX_FADV_WILLNEED);
+                prefetched = off + window;
+            }
+
+            size_t cap;
+            unsigned char *cbuf = bufpool_get(&pl->pool, len, &cap);
+            if (!cbuf) { fprintf(stderr, "OOM\n"); atomic_store(&pl->err, 1); break; }
+            double t0 = now_sec();
+            uint64_t csize64;
+            if (pread_full(fd, cbuf, len, (off_t)off) != 0
+                || (memcpy(&csize64, cbuf, sizeof(csize64)), csize64 != e->comp_size)) {
+                fprintf(stderr, "cmp corrupted at chunk %u\n", i);
+                bufpool_put(&pl->pool, cbuf, cap);
+                atomic_store(&pl->err, 1);
+                break;
+            }
+            double t1 = now_sec();
+            vr.lat = vr.lat > 0 ? 0.875 * vr.lat + 0.125 * (t1 - t0) : t1 - t0;
+
+            // holes, skipped (empty) records and zero runs leave the output
+            // untouched: it starts empty, so they come back as holes (zero
+            // pages inside other chunks do too, see pwrite_sparse())
+            if (e->kind == CHUNK_HOLE || csize64 == 0 || (e->kind == CHUNK_FILL && cbuf[sizeof(uint64_t)] == 0)) {
+                bufpool_put(&pl->pool, cbuf, cap);
+                continue;
+            }
+
+            ReadBuf *rb = (ReadBuf*)malloc(sizeof(ReadBuf));
+            if (!rb) { fprintf(stderr, "OOM\n"); bufpool_put(&pl->pool, cbuf, cap); atomic_store(&pl->err, 1); break; }
+            rb->idx = i;
+            rb->cbuf = cbuf;
+            rb->len = len;
+            rb->cap = cap;
+            rb->owner = &vr;
+            rb->next = NULL;
+            pthread_mutex_lock(&pl->lock);
+            vr.inflight += len;
+            vr.inflight_n++;
+            readahead_adapt(&vr, t1);
+            if (pl->tail) pl->tail->next = rb; else pl->head = rb;
+            pl->tail = rb;
+            pthread_cond_signal(&pl->ready);
+            pthread_mutex_unlock(&pl->lock);
+        }
+    }
+    // workers still hold buffers accounted to 'vr'; wait until they are done
+    pthread_mutex_lock(&pl->lock);
+    while (vr.inflight_n > 0) pthread_cond_wait(&pl->space, &pl->lock);
+    pl->readers_left--;
+    pthread_cond_broadcast(&pl->ready);
+    pthread_mutex_unlock(&pl->lock);
+    return NULL;
+}
+
+static void *decode_worker(void *varg) {
+    Pipeline *pl = (Pipeline*)varg;
+    Decoder dec;
+    if (decoder_init(&dec) != 0) { fprintf(stderr, "OOM\n"); atomic_store(&pl->err, 1); }
+    unsigned char *outbuf = NULL;
+    size_t ocap = 0;
+    for (;;) {
+        pthread_mutex_lock(&pl->lock);
+        while (!pl->head && pl->readers_left > 0) pthread_cond_wait(&pl->ready, &pl->lock);
+        ReadBuf *rb = pl->head;
+        if (rb) {
+            pl->head = rb->next;
+            if (!pl->head) pl->tail = NULL;
+        }
+        pthread_mutex_unlock(&pl->lock);
+        if (!rb) break;
+
+        const MetaEntry *e = &pl->mi->entries[rb->idx];
+        if (e->kind == CHUNK_RAW && !atomic_load(&pl->err)) {
+            // the record already holds the output bytes
+            if (rb->len - sizeof(uint64_t) != e->orig_size) {
+                fprintf(stderr, "Decompress error chunk %u\n", rb->idx);
+                atomic_store(&pl->err, 1);
+            } else if (pwrite_sparse(pl->fdout, rb->cbuf + sizeof(uint64_t), (size_t)e->orig_size, (off_t)pl->out_off[rb->idx]) != 0) {
+                perror("write out");
+                atomic_store(&pl->err, 1);
+            }
+        } else if (!atomic_load(&pl->err)) {
+            if (e->orig_size > ocap) {
+                free(outbuf);
+                outbuf = (unsigned char*)huge_buffer_alloc((size_t)e->orig_size);
+                ocap = outbuf ? (size_t)e->orig_size : 0;
+            }
+            long long r = outbuf ? decode_chunk(&dec, e, rb->cbuf + sizeof(uint64_t), rb->len - sizeof(uint64_t), outbuf) : -1;
+            if (r < 0) {
+                fprintf(stderr, "Decompress error chunk %u\n", rb->idx);
+                atomic_store(&pl->err, 1);
+            } else if (pwrite_sparse(pl->fdout, outbuf, (size_t)r, (off_t)pl->out_off[rb->idx]) != 0) {
+                perror("write out");
+                atomic_store(&pl->err, 1);
+            }
+        }
+        bufpool_put(&pl->pool, rb->cbuf, rb->cap);
+
+        pthread_mutex_lock(&pl->lock);
+        rb->owner->inflight -= rb->len;
+        rb->owner->inflight_n--;
+        rb->owner->consumed += rb->len;
+        pthread_cond_broadcast(&pl->space);
+        pthread_mutex_unlock(&pl->lock);
+        free(rb);
+    }
+    free(outbuf);
+    decoder_free(&dec);
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--volume-dir DIR]... <cmp_file> <meta_file> <decompress_dir>\n"
+                    "       %s [--volume-dir DIR]... --verify <cmp_file> <meta_file>\n"
+                    "       %s --proof <chunk> <cmp_file> <meta_file>\n", prog, prog, prog);
+}
 
 static const char* basename_from_path(const char* path) {
     const char *p = strrchr(path, '/');
@@ -17,92 +408,117 @@ static const char* basename_from_path(const char* path) {
 }
 
 int main(int argc, char **argv) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <cmp_file> <meta_file> <decompress_dir>\n", argv[0]);
+    int verify = 0;
+    long proof_idx = -1;
+    char **vol_dirs = (char**)malloc((size_t)argc * sizeof(char*));
+    int nvol_dirs = 0;
+    static const struct option longopts[] = {
+        { "verify", no_argument,       NULL, 'v' },
+        { "proof",  required_argument, NULL, 'p' },
+        { "volume-dir", required_argument, NULL, 'D' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "vp:D:", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'v': verify = 1; break;
+        case 'p': proof_idx = atol(optarg); break;
+        case 'D': vol_dirs[nvol_dirs++] = optarg; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    int check_mode = verify || proof_idx >= 0;
+    if (argc - optind != (check_mode ? 2 : 3)) {
+        usage(argv[0]);
         return 1;
     }
-    const char *cmp_path = argv[1];
-    const char *meta_path = argv[2];
-    const char *out_dir = argv[3];
+    const char *cmp_path = argv[optind];
+    const char *meta_path = argv[optind + 1];
 
-    mkdir(out_dir, 0755);
+    MetaIndex mi;
+    if (load_meta(meta_path, &mi) != 0) return 1;
+    if (proof_idx >= 0) {
+        int rc = print_proof(&mi, (uint32_t)proof_idx);
+        free_meta(&mi);
+        return rc;
+    }
+    VolumeMap vm;
+    if (open_volumes(cmp_path, &mi, vol_dirs, nvol_dirs, &vm) != 0) { free_meta(&mi); return 1; }
+    free(vol_dirs);
+    if (verify) {
+        int rc = verify_archive(&vm, &mi);
+        close_volumes(&vm);
+        free_meta(&mi);
+        return rc;
+    }
+    const char *out_dir = argv[optind + 2];
 
-    FILE *fcmp = fopen(cmp_path, "rb");
-    if (!fcmp) { perror("open cmp"); return 1; }
+    mkdir(out_dir, 0755);
 
-    // read header
-    uint64_t orig_size;
-    uint64_t chunk_size;
+    // read header (first volume)
+    unsigned char hdr[CMP_HEADER_SIZE];
     uint32_t num_chunks;
-    if (fread(&orig_size, sizeof(uint64_t), 1, fcmp) != 1) { fprintf(stderr, "bad file header\n"); fclose(fcmp); return 1; }
-    if (fread(&chunk_size, sizeof(uint64_t), 1, fcmp) != 1) { fprintf(stderr, "bad file header\n"); fclose(fcmp); return 1; }
-    if (fread(&num_chunks, sizeof(uint32_t), 1, fcmp) != 1) { fprintf(stderr, "bad file header\n"); fclose(fcmp); return 1; }
+    if (pread_full(vm.fds[0], hdr, sizeof(hdr), 0) != 0) { fprintf(stderr, "bad file header\n"); close_volumes(&vm); free_meta(&mi); return 1; }
+    memcpy(&num_chunks, hdr + 16, sizeof(uint32_t));
 
-    // Open meta to read per-chunk orig_size and comp_size order
-    FILE *fmeta = fopen(meta_path, "r");
-    if (!fmeta) { perror("open meta"); fclose(fcmp); return 1; }
+    if (num_chunks != mi.count) { fprintf(stderr, "meta/cmp chunk count mismatch\n"); close_volumes(&vm); free_meta(&mi); return 1; }
 
     // prepare output file path
-    const char *base = basename_from_path(cmp_path);
-    char outpath[1024];
+    char prefix[1024];
+    if (mi.volumes) volume_prefix(cmp_path, prefix, sizeof(prefix));
+    else snprintf(prefix, sizeof(prefix), "%s", cmp_path);
+    const char *base = basename_from_path(prefix);
+    char outpath[2048];
     snprintf(outpath, sizeof(outpath), "%s/%s", out_dir, base);
     // remove .cmp suffix if present
     size_t blen = strlen(outpath);
     if (blen > 4 && strcmp(outpath + blen - 4, ".cmp") == 0) outpath[blen - 4] = '\0';
 
-    FILE *fout = fopen(outpath, "wb");
-    if (!fout) { perror("create out"); fclose(fcmp); fclose(fmeta); return 1; }
-
-    // For each chunk, read comp_size (8) then compressed data from cmp file, and read meta entry to know orig_size
-    for (uint32_t i = 0; i < num_chunks; ++i) {
-        uint64_t csize64;
-        if (fread(&csize64, sizeof(uint64_t), 1, fcmp) != 1) { fprintf(stderr, "cmp corrupted\n"); break; }
-        size_t csize = (size_t)csize64;
-
-        // read meta line: id orig_size comp_size sha256hex
-        int mid;
-        uint64_t orig_sz_meta;
-        uint64_t comp_sz_meta;
-        char shahex[65];
-        if (fscanf(fmeta, "%d %" SCNu64 " %" SCNu64 " %64s\n", &mid, &orig_sz_meta, &comp_sz_meta, shahex) != 4) {
-            fprintf(stderr, "meta parse error\n"); break;
-        }
-        // read compressed bytes
-        unsigned char *cbuf = NULL;
-        if (csize > 0) {
-            cbuf = (unsigned char*)malloc(csize);
-            if (!cbuf) { fprintf(stderr, "OOM\n"); break; }
-            if (fread(cbuf, 1, csize, fcmp) != csize) { fprintf(stderr, "cmp read short\n"); free(cbuf); break; }
-        }
+    int fdout = open(outpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fdout < 0) { perror("create out"); close_volumes(&vm); free_meta(&mi); return 1; }
 
-        // allocate output buf for decompressed chunk
-        size_t out_size_expected = (size_t)orig_sz_meta;
-        unsigned char *outbuf = (unsigned char*)malloc(out_size_expected);
-        if (!outbuf) { fprintf(stderr, "OOM outbuf\n"); if (cbuf) free(cbuf); break; }
+    // each chunk's place in the output is a prefix sum of the original sizes
+    uint64_t *out_off = (uint64_t*)malloc(((size_t)num_chunks + 1) * sizeof(uint64_t));
+    if (!out_off) { fprintf(stderr, "OOM\n"); close(fdout); close_volumes(&vm); free_meta(&mi); return 1; }
+    out_off[0] = 0;
+    for (uint32_t i = 0; i < num_chunks; ++i) out_off[i + 1] = out_off[i] + mi.entries[i].orig_size;
 
-        if (csize == 0) {
-            // nothing compressed? write zeros or skip; here skip
-            free(outbuf);
-            if (cbuf) free(cbuf);
-            continue;
-        }
+    Pipeline pl;
+    pl.mi = &mi;
+    pl.vm = &vm;
+    pl.out_off = out_off;
+    pl.fdout = fdout;
+    pthread_mutex_init(&pl.lock, NULL);
+    pthread_cond_init(&pl.ready, NULL);
+    pthread_cond_init(&pl.space, NULL);
+    pl.head = pl.tail = NULL;
+    bufpool_init(&pl.pool);
+    atomic_init(&pl.next_vol, 0);
+    atomic_init(&pl.err, 0);
 
-        size_t r = ZSTD_decompress(outbuf, out_size_expected, cbuf, csize);
-        if (ZSTD_isError(r)) {
-            fprintf(stderr, "Decompress error chunk %d: %s\n", i, ZSTD_getErrorName(r));
-            free(outbuf); free(cbuf); break;
-        }
-        // write decompressed bytes
-        fwrite(outbuf, 1, r, fout);
+    // one reader per volume (volumes on different devices are read in
+    // parallel, each sequentially) feeding a pool of decode workers
+    int nreaders = vm.count < 16 ? (int)vm.count : 16;
+    int nworkers = available_cpus();
+    if (nworkers > 16) nworkers = 16;
+    pl.readers_left = nreaders;
+    pthread_t *threads = (pthread_t*)malloc((size_t)(nreaders + nworkers) * sizeof(pthread_t));
+    for (int t = 0; t < nreaders; ++t) pthread_create(&threads[t], NULL, reader_thread, &pl);
+    for (int t = 0; t < nworkers; ++t) pthread_create(&threads[nreaders + t], NULL, decode_worker, &pl);
+    for (int t = 0; t < nreaders + nworkers; ++t) pthread_join(threads[t], NULL);
+    free(threads);
+    bufpool_destroy(&pl.pool);
+    int err = atomic_load(&pl.err);
 
-        free(outbuf);
-        if (cbuf) free(cbuf);
-    }
+    // a trailing hole is only materialised by setting the file length
+    if (!err && ftruncate(fdout, (off_t)out_off[num_chunks]) != 0) perror("truncate out");
 
-    fclose(fout);
-    fclose(fcmp);
-    fclose(fmeta);
+    close(fdout);
+    close_volumes(&vm);
+    free(out_off);
+    free_meta(&mi);
 
+    if (err) return 1;
     printf("Decompressed to %s\n", outpath);
     return 0;
 }
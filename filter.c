@@ -0,0 +1,377 @@
+// filter.c
+// Chunk filters (see filter.h). Delta, the BCJ opcode scan and the byte
+// shuffle of 2, 4, 8 and 16-byte elements use AVX2 and SSSE3 when the build
+// targets them; the bit shuffle transposes 8x8 bit blocks inside a 64-bit
+// word.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+#include "filter.h"
+
+static const struct {
+    const char *name;
+    FilterType type;
+    int min_width;         // 0: takes no width
+} filter_names[] = {
+    { "none", FILTER_NONE, 0 },
+    { "delta", FILTER_DELTA, 1 },
+    { "bcj", FILTER_BCJ, 0 },
+    { "shuffle", FILTER_SHUFFLE, 2 },
+    { "bitshuffle", FILTER_BITSHUFFLE, 1 },
+};
+
+int filter_from_name(const char *s, Filter *f) {
+    const char *colon = strchr(s, ':');
+    size_t nlen = colon ? (size_t)(colon - s) : strlen(s);
+    for (size_t k = 0; k < sizeof(filter_names) / sizeof(filter_names[0]); ++k) {
+        if (strlen(filter_names[k].name) != nlen || strncmp(s, filter_names[k].name, nlen) != 0) continue;
+        if (!filter_names[k].min_width) {
+            if (colon) return -1;
+            f->type = filter_names[k].type;
+            f->width = 0;
+            return 0;
+        }
+        if (!colon) return -1;
+        char *end;
+        long w = strtol(colon + 1, &end, 10);
+        if (end == colon + 1 || *end || w < filter_names[k].min_width || w > FILTER_MAX_WIDTH) return -1;
+        f->type = filter_names[k].type;
+        f->width = (int)w;
+        return 0;
+    }
+    return -1;
+}
+
+void filter_name(const Filter *f, char *buf, size_t len) {
+    for (size_t k = 0; k < sizeof(filter_names) / sizeof(filter_names[0]); ++k) {
+        if (filter_names[k].type != f->type) continue;
+        if (filter_names[k].min_width) snprintf(buf, len, "%s:%d", filter_names[k].name, f->width);
+        else snprintf(buf, len, "%s", filter_names[k].name);
+        return;
+    }
+    snprintf(buf, len, "?");
+}
+
+// ---- delta ----
+
+static void delta_encode(unsigned char *dst, const unsigned char *src, size_t len, size_t n) {
+    size_t i = n < len ? n : len;
+    memcpy(dst, src, i);
+#ifdef __AVX2__
+    for (; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + i - n));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_sub_epi8(a, b));
+    }
+#endif
+    for (; i < len; ++i) dst[i] = (unsigned char)(src[i] - src[i - n]);
+}
+
+#ifdef __SSSE3__
+// Running sums of every n-th byte within 16 bytes (n divides 16).
+static inline __m128i prefix_sum16(__m128i x, size_t n) {
+    switch (n) {
+    case 1: x = _mm_add_epi8(x, _mm_slli_si128(x, 1));  // fall through
+    case 2: x = _mm_add_epi8(x, _mm_slli_si128(x, 2));  // fall through
+    case 4: x = _mm_add_epi8(x, _mm_slli_si128(x, 4));  // fall through
+    default: x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+    }
+    return x;
+}
+#endif
+
+// Decoding is a running sum with stride n. Strides that divide 16 are summed
+// 16 bytes at a time, each lane then carrying the previous block's last
+// element of its phase; strides of 32 and up have no dependency inside a
+// 32-byte vector at all.
+static void delta_decode(unsigned char *dst, const unsigned char *src, size_t len, size_t n) {
+    size_t i = n < len ? n : len;
+    memcpy(dst, src, i);
+#ifdef __AVX2__
+    if (n >= 32) {
+        for (; i + 32 <= len; i += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(src + i));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(dst + i - n));
+            _mm256_storeu_si256((__m256i*)(dst + i), _mm256_add_epi8(a, b));
+        }
+    }
+#endif
+#ifdef __SSSE3__
+    if (n <= 8 && 16 % n == 0) {
+        for (; i < 16 && i < len; ++i) dst[i] = (unsigned char)(src[i] + dst[i - n]);
+        unsigned char idx[16];
+        for (int j = 0; j < 16; ++j) idx[j] = (unsigned char)(16 - n + j % n);
+        const __m128i carry_idx = _mm_loadu_si128((const __m128i*)idx);
+        for (; i + 16 <= len; i += 16) {
+            __m128i x = prefix_sum16(_mm_loadu_si128((const __m128i*)(src + i)), n);
+            __m128i prev = _mm_loadu_si128((const __m128i*)(dst + i - 16));
+            _mm_storeu_si128((__m128i*)(dst + i), _mm_add_epi8(x, _mm_shuffle_epi8(prev, carry_idx)));
+        }
+    }
+#endif
+    for (; i < len; ++i) dst[i] = (unsigned char)(src[i] + dst[i - n]);
+}
+
+// ---- bcj ----
+
+// x86 CALL (E8) and JMP (E9) take a 32-bit displacement relative to the next
+// instruction; calls to one function from many places differ in every copy
+// but share the absolute target. Every E8/E9 byte is treated as an opcode
+// and its next 4 bytes as a displacement, which adding the position turns
+// into the target; the scan skips the 4 bytes it rewrote, so decoding finds
+// the same opcodes.
+static void bcj_convert(unsigned char *buf, size_t len, int encode) {
+    size_t i = 0;
+    while (i + 5 <= len) {
+#ifdef __AVX2__
+        if (i + 32 <= len) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(buf + i));
+            unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8((char)0xE8)), _mm256_cmpeq_epi8(v, _mm256_set1_epi8((char)0xE9))));
+            if (!m) { i += 32; continue; }
+            i += (size_t)__builtin_ctz(m);
+            if (i + 5 > len) break;
+        }
+#endif
+        if ((buf[i] & 0xFE) != 0xE8) { ++i; continue; }
+        uint32_t v;
+        memcpy(&v, buf + i + 1, 4);
+        v = encode ? v + (uint32_t)(i + 5) : v - (uint32_t)(i + 5);
+        memcpy(buf + i + 1, &v, 4);
+        i += 5;
+    }
+}
+
+// ---- byte and bit shuffle ----
+
+#ifdef __AVX2__
+// 32 elements of w = 2, 4, 8 or 16 bytes fill w vectors. A byte shuffle
+// first groups each 128-bit lane by byte index, leaving per lane a w x w
+// matrix (vector x byte index) of g = 16 / w byte units; log2(w) rounds of
+// unpacks transpose it, so vector k holds byte k of every element, the low
+// lanes' elements ahead of the high lanes'; a cross-lane permute and a
+// second byte shuffle restore element order. Unshuffling runs the same
+// steps backwards (the transpose is its own inverse).
+
+static inline __m256i unpack_lo(__m256i a, __m256i b, size_t u) {
+    switch (u) {
+    case 1: return _mm256_unpacklo_epi8(a, b);
+    case 2: return _mm256_unpacklo_epi16(a, b);
+    case 4: return _mm256_unpacklo_epi32(a, b);
+    default: return _mm256_unpacklo_epi64(a, b);
+    }
+}
+
+static inline __m256i unpack_hi(__m256i a, __m256i b, size_t u) {
+    switch (u) {
+    case 1: return _mm256_unpackhi_epi8(a, b);
+    case 2: return _mm256_unpackhi_epi16(a, b);
+    case 4: return _mm256_unpackhi_epi32(a, b);
+    default: return _mm256_unpackhi_epi64(a, b);
+    }
+}
+
+static inline void lane_transpose(__m256i *v, size_t w) {
+    __m256i t[16];
+    for (size_t s = 1, u = 16 / w; s < w; s *= 2, u *= 2) {
+        for (size_t blk = 0; blk < w; blk += 2 * s)
+            for (size_t i = 0; i < s; ++i) {
+                t[blk + 2 * i] = unpack_lo(v[blk + i], v[blk + i + s], u);
+                t[blk + 2 * i + 1] = unpack_hi(v[blk + i], v[blk + i + s], u);
+            }
+        memcpy(v, t, w * sizeof(__m256i));
+    }
+}
+
+// The per-lane byte shuffles: 'group' takes byte k of lane element e to
+// k * g + e; 'merge' interleaves the g-byte units of the two 8-byte halves
+// the cross-lane permute (0xD8) brings together.
+static void shuffle_masks(size_t w, __m256i *group, __m256i *ungroup, __m256i *merge, __m256i *unmerge) {
+    unsigned char gm[16], um[16], mm[16], xm[16];
+    size_t g = 16 / w, m = 8 / g;
+    for (size_t e = 0; e < g; ++e)
+        for (size_t k = 0; k < w; ++k) {
+            gm[k * g + e] = (unsigned char)(e * w + k);
+            um[e * w + k] = (unsigned char)(k * g + e);
+        }
+    for (size_t t = 0; t < m; ++t)
+        for (size_t b = 0; b < g; ++b) {
+            mm[2 * t * g + b] = (unsigned char)(t * g + b);
+            mm[(2 * t + 1) * g + b] = (unsigned char)((m + t) * g + b);
+            xm[t * g + b] = (unsigned char)(2 * t * g + b);
+            xm[(m + t) * g + b] = (unsigned char)((2 * t + 1) * g + b);
+        }
+    *group = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)gm));
+    *ungroup = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)um));
+    *merge = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)mm));
+    *unmerge = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)xm));
+}
+
+// Both return the number of elements done, a multiple of 32.
+static size_t shuffle_encode_avx2(unsigned char *dst, const unsigned char *src, size_t n, size_t w) {
+    __m256i group, ungroup, merge, unmerge, v[16];
+    shuffle_masks(w, &group, &ungroup, &merge, &unmerge);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        for (size_t j = 0; j < w; ++j)
+            v[j] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(src + i * w + 32 * j)), group);
+        lane_transpose(v, w);
+        for (size_t k = 0; k < w; ++k)
+            _mm256_storeu_si256((__m256i*)(dst + k * n + i),
+                                _mm256_shuffle_epi8(_mm256_permute4x64_epi64(v[k], 0xD8), merge));
+    }
+    return i;
+}
+
+static size_t shuffle_decode_avx2(unsigned char *dst, const unsigned char *src, size_t n, size_t w) {
+    __m256i group, ungroup, merge, unmerge, v[16];
+    shuffle_masks(w, &group, &ungroup, &merge, &unmerge);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        for (size_t k = 0; k < w; ++k)
+            v[k] = _mm256_permute4x64_epi64(
+                _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(src + k * n + i)), unmerge), 0xD8);
+        lane_transpose(v, w);
+        for (size_t j = 0; j < w; ++j)
+            _mm256_storeu_si256((__m256i*)(dst + i * w + 32 * j), _mm256_shuffle_epi8(v[j], ungroup));
+    }
+    return i;
+}
+
+static int shuffle_avx2_width(size_t w) {
+    return w == 2 || w == 4 || w == 8 || w == 16;
+}
+#endif
+
+// Other widths, and the elements after the last 32, are transposed a tile
+// at a time, so the w output streams and the input stay in cache.
+#define SHUFFLE_TILE 1024
+
+static void shuffle_encode(unsigned char *dst, const unsigned char *src, size_t len, size_t w) {
+    size_t n = len / w, first = 0;
+#ifdef __AVX2__
+    if (shuffle_avx2_width(w)) first = shuffle_encode_avx2(dst, src, n, w);
+#endif
+    for (size_t i0 = first; i0 < n; i0 += SHUFFLE_TILE) {
+        size_t i1 = n - i0 < SHUFFLE_TILE ? n : i0 + SHUFFLE_TILE;
+        for (size_t b = 0; b < w; ++b) {
+            unsigned char *d = dst + b * n;
+            for (size_t i = i0; i < i1; ++i) d[i] = src[i * w + b];
+        }
+    }
+    memcpy(dst + n * w, src + n * w, len - n * w);
+}
+
+static void shuffle_decode(unsigned char *dst, const unsigned char *src, size_t len, size_t w) {
+    size_t n = len / w, first = 0;
+#ifdef __AVX2__
+    if (shuffle_avx2_width(w)) first = shuffle_decode_avx2(dst, src, n, w);
+#endif
+    for (size_t i0 = first; i0 < n; i0 += SHUFFLE_TILE) {
+        size_t i1 = n - i0 < SHUFFLE_TILE ? n : i0 + SHUFFLE_TILE;
+        for (size_t b = 0; b < w; ++b) {
+            const unsigned char *s = src + b * n;
+            for (size_t i = i0; i < i1; ++i) dst[i * w + b] = s[i];
+        }
+    }
+    memcpy(dst + n * w, src + n * w, len - n * w);
+}
+
+// 8x8 bit matrix transpose: bit c of byte r moves to bit r of byte c.
+static inline uint64_t transpose8(uint64_t x) {
+    uint64_t t;
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAull;  x ^= t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCull; x ^= t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ull; x ^= t ^ (t << 28);
+    return x;
+}
+
+// Bit plane p = 8 * byte + bit of the element holds that bit of every
+// element, element i at bit i % 8 of byte i / 8. Whole groups of 8 elements
+// are transposed; the elements after them are stored as they are.
+static void bitshuffle_encode(unsigned char *dst, const unsigned char *src, size_t len, size_t w) {
+    size_t m = len / w / 8;    // bytes per bit plane
+    // one element byte at a time, so its 8 planes are written sequentially
+    for (size_t b = 0; b < w; ++b) {
+        unsigned char *p = dst + b * 8 * m;
+        for (size_t g = 0; g < m; ++g) {
+            const unsigned char *e = src + g * 8 * w + b;
+            uint64_t x = 0;
+            for (int r = 0; r < 8; ++r) x |= (uint64_t)e[(size_t)r * w] << (8 * r);
+            x = transpose8(x);
+            for (int k = 0; k < 8; ++k) p[(size_t)k * m + g] = (unsigned char)(x >> (8 * k));
+        }
+    }
+    memcpy(dst + m * 8 * w, src + m * 8 * w, len - m * 8 * w);
+}
+
+static void bitshuffle_decode(unsigned char *dst, const unsigned char *src, size_t len, size_t w) {
+    size_t m = len / w / 8;
+    for (size_t b = 0; b < w; ++b) {
+        const unsigned char *p = src + b * 8 * m;
+        for (size_t g = 0; g < m; ++g) {
+            unsigned char *e = dst + g * 8 * w + b;
+            uint64_t x = 0;
+            for (int k = 0; k < 8; ++k) x |= (uint64_t)p[(size_t)k * m + g] << (8 * k);
+            x = transpose8(x);
+            for (int r = 0; r < 8; ++r) e[(size_t)r * w] = (unsigned char)(x >> (8 * r));
+        }
+    }
+    memcpy(dst + m * 8 * w, src + m * 8 * w, len - m * 8 * w);
+}
+
+static void filter_block(const Filter *f, unsigned char *dst, const unsigned char *src, size_t len, int encode) {
+    size_t w = (size_t)f->width;
+    switch (f->type) {
+    case FILTER_DELTA:
+        if (encode) delta_encode(dst, src, len, w);
+        else delta_decode(dst, src, len, w);
+        break;
+    case FILTER_BCJ:
+        memcpy(dst, src, len);
+        bcj_convert(dst, len, encode);
+        break;
+    case FILTER_SHUFFLE:
+        if (encode) shuffle_encode(dst, src, len, w);
+        else shuffle_decode(dst, src, len, w);
+        break;
+    case FILTER_BITSHUFFLE:
+        if (encode) bitshuffle_encode(dst, src, len, w);
+        else bitshuffle_decode(dst, src, len, w);
+        break;
+    default:
+        memcpy(dst, src, len);
+    }
+}
+
+static void filter_blocks(const Filter *f, unsigned char *dst, const unsigned char *src, size_t len, size_t block,
+                          int encode) {
+    if (!block) block = len;
+    for (size_t off = 0; off < len; off += block) {
+        size_t n = len - off < block ? len - off : block;
+        filter_block(f, dst + off, src + off, n, encode);
+    }
+}
+
+void filter_encode(const Filter *f, unsigned char *dst, const unsigned char *src, size_t len, size_t block) {
+    filter_blocks(f, dst, src, len, block, 1);
+}
+
+void filter_decode(const Filter *f, unsigned char *dst, const unsigned char *src, size_t len, size_t block) {
+    filter_blocks(f, dst, src, len, block, 0);
+}
+
+const char *filter_simd_name(void) {
+#if defined(__AVX2__)
+    return "avx2";
+#elif defined(__SSSE3__)
+    return "ssse3";
+#else
+    return "portable";
+#endif
+}
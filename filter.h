@@ -0,0 +1,46 @@
+// filter.h
+// Reversible transforms applied to a chunk before ZSTD, for data whose
+// structure the match finder cannot see on its own:
+//   delta:N       each byte minus the byte N back (PCM samples, counters)
+//   bcj           x86 CALL/JMP displacements made absolute (executables)
+//   shuffle:N     byte planes of N-byte elements, as in Blosc (numeric arrays)
+//   bitshuffle:N  bit planes of N-byte elements (floats, sparse integers)
+// A filter works on independent blocks (the chunk, or each seek frame of a
+// framed chunk), so any frame can be decoded and un-filtered on its own.
+// The .meta records the filter as the chunk's kind token, e.g. "delta:2".
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stddef.h>
+
+typedef enum {
+    FILTER_NONE = 0,
+    FILTER_DELTA = 1,
+    FILTER_BCJ = 2,
+    FILTER_SHUFFLE = 3,
+    FILTER_BITSHUFFLE = 4
+} FilterType;
+
+// Element size or delta distance limit.
+#define FILTER_MAX_WIDTH 256
+
+typedef struct {
+    FilterType type;
+    int width;             // delta distance or element size; 0 for none/bcj
+} Filter;
+
+// "none", "bcj", "delta:N", "shuffle:N" or "bitshuffle:N"; returns 0 or -1.
+int filter_from_name(const char *s, Filter *f);
+// The inverse of filter_from_name(); buf should hold 32 bytes.
+void filter_name(const Filter *f, char *buf, size_t len);
+
+// Transform len bytes from src into dst (which must not overlap), block
+// bytes at a time; the last block may be shorter.
+void filter_encode(const Filter *f, unsigned char *dst, const unsigned char *src, size_t len, size_t block);
+void filter_decode(const Filter *f, unsigned char *dst, const unsigned char *src, size_t len, size_t block);
+
+// Which SIMD paths this build uses.
+const char *filter_simd_name(void);
+
+#endif
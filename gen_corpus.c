@@ -0,0 +1,329 @@
+// gen_corpus.c
+// Deterministic synthetic inputs for bench.py. The same kind, size and seed
+// always produce the same bytes, on any machine, so results can be compared
+// across commits. Data is generated in a stream, so tens of GB need no more
+// memory than a KB file.
+//
+// Kinds:
+//   text    English-like prose from a Zipf-distributed vocabulary
+//   logs    timestamped service log lines
+//   json    newline-delimited JSON records
+//   random  incompressible bytes
+//   zero    zero bytes, all written
+//   sparse  holes with a 64 KiB data island every 16 MiB
+//   vm      4 KiB blocks of a disk image: zero, duplicated and unique ones
+//   media   MP4-like boxes around high-entropy frame payloads
+//
+// Usage: gen_corpus <kind> <size> <output> [seed]
+//   size accepts K, M, G suffixes (powers of 1024)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#define OUT_BUF (1u << 20)
+
+static uint64_t rng_state;
+static uint64_t rng(void) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dull;
+}
+
+typedef struct {
+    int fd;
+    unsigned char *buf;
+    size_t len;
+    uint64_t written, limit;
+    int err;
+} Out;
+
+static void out_flush(Out *o) {
+    size_t off = 0;
+    while (off < o->len && !o->err) {
+        ssize_t w = write(o->fd, o->buf + off, o->len - off);
+        if (w < 0) { if (errno != EINTR) o->err = errno; continue; }
+        off += (size_t)w;
+    }
+    o->len = 0;
+}
+
+static int out_full(const Out *o) {
+    return o->written >= o->limit || o->err;
+}
+
+// Appends up to the size limit; the tail of the last record is cut off.
+static void out_put(Out *o, const void *data, size_t n) {
+    const unsigned char *p = (const unsigned char*)data;
+    if (n > o->limit - o->written) n = (size_t)(o->limit - o->written);
+    while (n > 0) {
+        size_t k = OUT_BUF - o->len < n ? OUT_BUF - o->len : n;
+        memcpy(o->buf + o->len, p, k);
+        o->len += k;
+        o->written += k;
+        p += k;
+        n -= k;
+        if (o->len == OUT_BUF) out_flush(o);
+    }
+}
+
+static void out_str(Out *o, const char *s) {
+    out_put(o, s, strlen(s));
+}
+
+// Pseudo-words of 2..10 letters; index 0 is the most frequent.
+#define VOCAB 4096
+static char vocab[VOCAB][12];
+
+static void make_vocab(void) {
+    static const char letters[] = "etaoinshrdlcumwfgypbvkjxqz";
+    for (int i = 0; i < VOCAB; ++i) {
+        int len = 2 + (int)(rng() % 9);
+        for (int k = 0; k < len; ++k) {
+            // bias towards the common letters
+            uint64_t r = rng();
+            vocab[i][k] = letters[(r % 26) * ((r >> 8) % 26) / 26];
+        }
+        vocab[i][len] = 0;
+    }
+}
+
+// Roughly Zipf: the cube of a uniform variate leans on low indices.
+static const char *zipf_word(void) {
+    double u = (double)(rng() >> 11) / 9007199254740992.0;
+    return vocab[(int)(u * u * u * (VOCAB - 1))];
+}
+
+static void gen_text(Out *o) {
+    make_vocab();
+    while (!out_full(o)) {
+        int words = 5 + (int)(rng() % 20);
+        for (int w = 0; w < words; ++w) {
+            const char *s = zipf_word();
+            if (w == 0) {
+                char cap[12];
+                snprintf(cap, sizeof(cap), "%s", s);
+                cap[0] = (char)(cap[0] - 'a' + 'A');
+                out_str(o, cap);
+            } else {
+                out_str(o, " ");
+                out_str(o, s);
+            }
+        }
+        out_str(o, rng() % 8 == 0 ? ".\n\n" : ". ");
+    }
+}
+
+static void gen_logs(Out *o) {
+    static const char *levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+    static const char *paths[] = { "/api/v1/users", "/api/v1/orders", "/api/v1/items", "/healthz", "/api/v2/search",
+                                   "/static/app.js", "/login", "/api/v1/cart" };
+    static const int status[] = { 200, 200, 200, 200, 201, 204, 304, 400, 404, 500 };
+    uint64_t ms = 1767225600000ull;   // 2026-01-01T00:00:00Z
+    char line[512];
+    while (!out_full(o)) {
+        ms += rng() % 40;
+        uint64_t s = ms / 1000;
+        int sec = (int)(s % 60), min = (int)(s / 60 % 60), hour = (int)(s / 3600 % 24), day = 1 + (int)((s - 1767225600ull) / 86400 % 28);
+        uint64_t r = rng();
+        int n = snprintf(line, sizeof(line),
+                         "2026-01-%02dT%02d:%02d:%02d.%03dZ %-5s [worker-%d] req=%016" PRIx64 " %s %s status=%d latency_ms=%d bytes=%d\n",
+                         day, hour, min, sec, (int)(ms % 1000), levels[r % 6], (int)((r >> 8) % 16), rng(),
+                         (r >> 16) % 5 ? "GET" : "POST", paths[(r >> 20) % 8], status[(r >> 24) % 10],
+                         (int)((r >> 32) % 900), (int)((r >> 42) % 65536));
+        out_put(o, line, (size_t)n);
+    }
+}
+
+static void gen_json(Out *o) {
+    static const char *tags[] = { "alpha", "beta", "gamma", "delta", "prod", "staging", "eu", "us", "mobile", "web" };
+    make_vocab();
+    char rec[512];
+    for (uint64_t id = 1; !out_full(o); ++id) {
+        uint64_t r = rng();
+        int n = snprintf(rec, sizeof(rec),
+                         "{\"id\":%" PRIu64 ",\"user\":\"%s_%s\",\"email\":\"%s@%s.com\",\"tags\":[\"%s\",\"%s\"],"
+                         "\"score\":%d.%02d,\"active\":%s,\"created\":%" PRIu64 "}\n",
+                         id, zipf_word(), zipf_word(), zipf_word(), zipf_word(), tags[r % 10], tags[(r >> 4) % 10],
+                         (int)((r >> 8) % 1000), (int)((r >> 20) % 100), (r >> 30) & 1 ? "true" : "false",
+                         (uint64_t)(1767225600ull + id * 17));
+        out_put(o, rec, (size_t)n);
+    }
+}
+
+static void put_random(Out *o, size_t n) {
+    uint64_t block[512];
+    while (n > 0 && !out_full(o)) {
+        size_t k = n < sizeof(block) ? n : sizeof(block);
+        for (size_t i = 0; i < (k + 7) / 8; ++i) block[i] = rng();
+        out_put(o, block, k);
+        n -= k;
+    }
+}
+
+static void gen_random(Out *o) {
+    while (!out_full(o)) put_random(o, OUT_BUF);
+}
+
+static void gen_zero(Out *o) {
+    static const unsigned char zeros[65536];
+    while (!out_full(o)) out_put(o, zeros, sizeof(zeros));
+}
+
+// Written directly with pwrite; the rest stays a hole after ftruncate.
+static int gen_sparse(int fd, uint64_t size) {
+    if (ftruncate(fd, (off_t)size) != 0) return -1;
+    unsigned char *island = (unsigned char*)malloc(65536);
+    if (!island) return -1;
+    for (uint64_t off = 0; off < size; off += 16u << 20) {
+        size_t n = size - off < 65536 ? (size_t)(size - off) : 65536;
+        // half text-like, half random, so islands are neither trivial nor incompressible
+        for (size_t i = 0; i < n; ++i) island[i] = i < n / 2 ? (unsigned char)("sparse island "[i % 14]) : (unsigned char)rng();
+        if (pwrite(fd, island, n, (off_t)off) != (ssize_t)n) { free(island); return -1; }
+    }
+    free(island);
+    return 0;
+}
+
+// A raw VM disk: a base image's blocks recur (installed files shared across
+// snapshots), many blocks are zero, a few are unique.
+static void gen_vm(Out *o) {
+    enum { BLOCK = 4096, POOL = 1024 };
+    unsigned char *pool = (unsigned char*)malloc((size_t)POOL * BLOCK);
+    if (!pool) { o->err = ENOMEM; return; }
+    make_vocab();
+    for (int b = 0; b < POOL; ++b) {
+        unsigned char *p = pool + (size_t)b * BLOCK;
+        if (b % 3 == 0) {
+            // "binary": small opcodes and pointers
+            for (int i = 0; i < BLOCK; ++i) p[i] = (unsigned char)(rng() % (i % 8 < 4 ? 16 : 256));
+        } else {
+            // "config and text files"
+            int i = 0;
+            while (i < BLOCK) {
+                const char *w = zipf_word();
+                while (*w && i < BLOCK) p[i++] = (unsigned char)*w++;
+                if (i < BLOCK) p[i++] = rng() % 10 ? ' ' : '\n';
+            }
+        }
+    }
+    static const unsigned char zeros[BLOCK];
+    while (!out_full(o)) {
+        uint64_t r = rng();
+        // zero runs come in extents of up to 64 blocks
+        if (r % 100 < 35) {
+            for (uint64_t k = 1 + (r >> 8) % 64; k > 0 && !out_full(o); --k) out_put(o, zeros, BLOCK);
+        } else if (r % 100 < 90) {
+            out_put(o, pool + (size_t)((r >> 8) % POOL) * BLOCK, BLOCK);
+        } else {
+            put_random(o, BLOCK);
+        }
+    }
+    free(pool);
+}
+
+// A box of the given size, or with size 0 ("to the end of the file") when no
+// further box header would fit after it; returns 1 for that last box, whose
+// payload the caller must then run up to the size limit.
+static int put_box(Out *o, uint32_t size, const char *type) {
+    int last = o->limit - o->written < (uint64_t)size + 8;
+    if (last) size = 0;
+    unsigned char h[8] = { (unsigned char)(size >> 24), (unsigned char)(size >> 16), (unsigned char)(size >> 8),
+                           (unsigned char)size, (unsigned char)type[0], (unsigned char)type[1],
+                           (unsigned char)type[2], (unsigned char)type[3] };
+    out_put(o, h, 8);
+    return last;
+}
+
+// ftyp and moov up front, then mdat boxes of frames. Each frame is an
+// Annex-B start code and NAL header, then entropy-coded (random) payload;
+// keyframes are larger. Like real video, only the headers compress. The
+// boxes tile the file exactly, so any size from 8 bytes up is valid ISO-BMFF.
+static void gen_media(Out *o) {
+    static const unsigned char ftyp[] = "isomiso2avc1mp41";
+    int last = put_box(o, 8 + 16, "ftyp");
+    out_put(o, ftyp, 16);
+    if (!last && !out_full(o)) {
+        last = put_box(o, 8 + 4096, "moov");
+        for (int i = 0; i < 4096 / 16; ++i) {
+            char entry[17];
+            snprintf(entry, sizeof(entry), "trak%04dstsz%04d", i, i);
+            out_put(o, entry, 16);
+        }
+    }
+    for (uint32_t gop = 0; !last && !out_full(o); ++gop) {
+        // one mdat per group of 24 frames
+        uint32_t sizes[24], total = 8;
+        for (int f = 0; f < 24; ++f) {
+            sizes[f] = f == 0 ? 150000 + (uint32_t)(rng() % 50000) : 8000 + (uint32_t)(rng() % 30000);
+            total += 5 + sizes[f];
+        }
+        last = put_box(o, total, "mdat");
+        for (int f = 0; f < 24 && !out_full(o); ++f) {
+            unsigned char nal[5] = { 0, 0, 0, 1, (unsigned char)(f == 0 ? 0x65 : 0x41) };
+            out_put(o, nal, 5);
+            put_random(o, sizes[f]);
+        }
+    }
+    // the last box absorbs the few bytes too short for another header
+    while (!out_full(o)) put_random(o, OUT_BUF);
+}
+
+static uint64_t parse_size(const char *s) {
+    char *end;
+    uint64_t v = strtoull(s, &end, 10);
+    switch (*end) {
+    case 'K': case 'k': v <<= 10; ++end; break;
+    case 'M': case 'm': v <<= 20; ++end; break;
+    case 'G': case 'g': v <<= 30; ++end; break;
+    default: break;
+    }
+    return *end ? 0 : v;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4 || argc > 5) {
+        fprintf(stderr, "Usage: %s text|logs|json|random|zero|sparse|vm|media <size> <output> [seed]\n", argv[0]);
+        return 1;
+    }
+    const char *kind = argv[1];
+    uint64_t size = parse_size(argv[2]);
+    uint64_t seed = argc == 5 ? strtoull(argv[4], NULL, 0) : 1;
+    if (size == 0) { fprintf(stderr, "bad size %s\n", argv[2]); return 1; }
+    // the kind is part of the seed, so kinds sharing a generator differ
+    rng_state = 0x9e3779b97f4a7c15ull ^ (seed * 0xbf58476d1ce4e5b9ull);
+    for (const char *k = kind; *k; ++k) rng_state = (rng_state ^ (unsigned char)*k) * 0x100000001b3ull;
+    if (rng_state == 0) rng_state = 1;
+
+    int fd = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { perror(argv[3]); return 1; }
+    if (strcmp(kind, "sparse") == 0) {
+        int rc = gen_sparse(fd, size);
+        if (rc != 0) perror("write");
+        if (close(fd) != 0) { perror("close"); return 1; }
+        return rc != 0;
+    }
+
+    Out o = { fd, (unsigned char*)malloc(OUT_BUF), 0, 0, size, 0 };
+    if (!o.buf) { fprintf(stderr, "OOM\n"); close(fd); return 1; }
+    if (strcmp(kind, "text") == 0) gen_text(&o);
+    else if (strcmp(kind, "logs") == 0) gen_logs(&o);
+    else if (strcmp(kind, "json") == 0) gen_json(&o);
+    else if (strcmp(kind, "random") == 0) gen_random(&o);
+    else if (strcmp(kind, "zero") == 0) gen_zero(&o);
+    else if (strcmp(kind, "vm") == 0) gen_vm(&o);
+    else if (strcmp(kind, "media") == 0) gen_media(&o);
+    else { fprintf(stderr, "unknown kind %s\n", kind); free(o.buf); close(fd); unlink(argv[3]); return 1; }
+    out_flush(&o);
+    free(o.buf);
+    if (o.err) { fprintf(stderr, "write: %s\n", strerror(o.err)); close(fd); return 1; }
+    if (close(fd) != 0) { perror("close"); return 1; }
+    return 0;
+}
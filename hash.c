@@ -0,0 +1,156 @@
+// hash.c
+// Chunk digests (SHA256 via EVP, or BLAKE3) and the archive Merkle tree.
+
+#include <stdio.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include "hash.h"
+
+const char *hash_algo_name(HashAlgo algo) {
+    return algo == HASH_BLAKE3 ? "blake3" : "sha256";
+}
+
+int hash_algo_from_name(const char *name, HashAlgo *algo) {
+    if (strcmp(name, "sha256") == 0) { *algo = HASH_SHA256; return 0; }
+    if (strcmp(name, "blake3") == 0) { *algo = HASH_BLAKE3; return 0; }
+    return -1;
+}
+
+void compute_sha256_evp(const unsigned char *data, size_t len, unsigned char out[HASH_SIZE]) {
+    EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+    if (!mdctx) { memset(out, 0, HASH_SIZE); return; }
+    EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL);
+    EVP_DigestUpdate(mdctx, data, len);
+    unsigned int outlen = 0;
+    EVP_DigestFinal_ex(mdctx, out, &outlen);
+    EVP_MD_CTX_free(mdctx);
+}
+
+void hash_chunk(HashAlgo algo, const unsigned char *data, size_t len, unsigned char out[HASH_SIZE], int nthreads) {
+    if (algo == HASH_BLAKE3) blake3_hash(data, len, out, nthreads);
+    else compute_sha256_evp(data, len, out);
+}
+
+int hash_init(HashState *hs, HashAlgo algo) {
+    hs->algo = algo;
+    hs->evp = NULL;
+    if (algo == HASH_BLAKE3) { blake3_hasher_init(&hs->b3); return 0; }
+    EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+    if (!mdctx) return -1;
+    EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL);
+    hs->evp = mdctx;
+    return 0;
+}
+
+void hash_update(HashState *hs, const unsigned char *data, size_t len) {
+    if (hs->algo == HASH_BLAKE3) blake3_hasher_update(&hs->b3, data, len);
+    else EVP_DigestUpdate((EVP_MD_CTX*)hs->evp, data, len);
+}
+
+void hash_final(HashState *hs, unsigned char out[HASH_SIZE]) {
+    if (hs->algo == HASH_BLAKE3) { blake3_hasher_finalize(&hs->b3, out); return; }
+    unsigned int outlen = 0;
+    EVP_DigestFinal_ex((EVP_MD_CTX*)hs->evp, out, &outlen);
+    EVP_MD_CTX_free((EVP_MD_CTX*)hs->evp);
+    hs->evp = NULL;
+}
+
+void hash_zeros(HashAlgo algo, uint64_t len, unsigned char out[HASH_SIZE]) {
+    static const unsigned char zeros[65536];
+    HashState hs;
+    if (hash_init(&hs, algo) != 0) { memset(out, 0, HASH_SIZE); return; }
+    for (uint64_t pos = 0; pos < len; ) {
+        size_t n = len - pos < sizeof(zeros) ? (size_t)(len - pos) : sizeof(zeros);
+        hash_update(&hs, zeros, n);
+        pos += n;
+    }
+    hash_final(&hs, out);
+}
+
+static void merkle_leaf(const unsigned char chunk_hash[HASH_SIZE], unsigned char out[HASH_SIZE]) {
+    unsigned char buf[1 + HASH_SIZE];
+    buf[0] = 0x00;
+    memcpy(buf + 1, chunk_hash, HASH_SIZE);
+    compute_sha256_evp(buf, sizeof(buf), out);
+}
+
+static void merkle_node(const unsigned char l[HASH_SIZE], const unsigned char r[HASH_SIZE],
+                        unsigned char out[HASH_SIZE]) {
+    unsigned char buf[1 + 2 * HASH_SIZE];
+    buf[0] = 0x01;
+    memcpy(buf + 1, l, HASH_SIZE);
+    memcpy(buf + 1 + HASH_SIZE, r, HASH_SIZE);
+    compute_sha256_evp(buf, sizeof(buf), out);
+}
+
+// largest power of two strictly below n (n >= 2)
+static size_t split_point(size_t n) {
+    size_t k = 1;
+    while (k << 1 < n) k <<= 1;
+    return k;
+}
+
+void merkle_root(const unsigned char (*h)[HASH_SIZE], size_t n, unsigned char out[HASH_SIZE]) {
+    if (n == 0) { compute_sha256_evp(NULL, 0, out); return; }
+    if (n == 1) { merkle_leaf(h[0], out); return; }
+    size_t k = split_point(n);
+    unsigned char l[HASH_SIZE], r[HASH_SIZE];
+    merkle_root(h, k, l);
+    merkle_root(h + k, n - k, r);
+    merkle_node(l, r, out);
+}
+
+size_t merkle_depth(size_t n) {
+    size_t d = 0;
+    while (n > 1) { n = (n + 1) / 2; ++d; }
+    return d;
+}
+
+size_t merkle_proof(const unsigned char (*h)[HASH_SIZE], size_t n, size_t idx,
+                    unsigned char (*path)[HASH_SIZE]) {
+    if (n <= 1) return 0;
+    size_t k = split_point(n);
+    size_t len;
+    if (idx < k) {
+        len = merkle_proof(h, k, idx, path);
+        merkle_root(h + k, n - k, path[len]);
+    } else {
+        len = merkle_proof(h + k, n - k, idx - k, path);
+        merkle_root(h, k, path[len]);
+    }
+    return len + 1;
+}
+
+int merkle_verify(const unsigned char chunk_hash[HASH_SIZE], size_t idx, size_t n,
+                  const unsigned char (*path)[HASH_SIZE], size_t pathlen,
+                  const unsigned char root[HASH_SIZE]) {
+    if (idx >= n) return 0;
+    size_t fn = idx, sn = n - 1;
+    unsigned char r[HASH_SIZE];
+    merkle_leaf(chunk_hash, r);
+    for (size_t i = 0; i < pathlen; ++i) {
+        if (sn == 0) return 0;
+        if ((fn & 1) || fn == sn) {
+            merkle_node(path[i], r, r);
+            while (!(fn & 1) && fn != 0) { fn >>= 1; sn >>= 1; }
+        } else {
+            merkle_node(r, path[i], r);
+        }
+        fn >>= 1; sn >>= 1;
+    }
+    return sn == 0 && memcmp(r, root, HASH_SIZE) == 0;
+}
+
+void hash_to_hex(const unsigned char h[HASH_SIZE], char hex[2 * HASH_SIZE + 1]) {
+    for (int b = 0; b < HASH_SIZE; ++b) sprintf(hex + b*2, "%02x", h[b]);
+    hex[2 * HASH_SIZE] = 0;
+}
+
+int hex_to_hash(const char *hex, unsigned char h[HASH_SIZE]) {
+    for (int b = 0; b < HASH_SIZE; ++b) {
+        unsigned int v;
+        if (sscanf(hex + b*2, "%2x", &v) != 1) return -1;
+        h[b] = (unsigned char)v;
+    }
+    return 0;
+}
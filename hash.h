@@ -0,0 +1,64 @@
+// hash.h
+// Chunk digests and the Merkle tree built over them, shared by compressor.c
+// and decompressor.c.
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "blake3.h"
+
+#define HASH_SIZE 32
+
+// Chunk digest algorithm, recorded as "# hash <name>" in the .meta header
+// (archives without the line use SHA256).
+typedef enum {
+    HASH_SHA256 = 0,
+    HASH_BLAKE3 = 1
+} HashAlgo;
+
+const char *hash_algo_name(HashAlgo algo);
+int hash_algo_from_name(const char *name, HashAlgo *algo);
+
+void compute_sha256_evp(const unsigned char *data, size_t len, unsigned char out[HASH_SIZE]);
+
+// Digest of one chunk; 'nthreads' > 1 lets BLAKE3 hash subtrees of a large
+// chunk in parallel (SHA256 is inherently serial and ignores it).
+void hash_chunk(HashAlgo algo, const unsigned char *data, size_t len, unsigned char out[HASH_SIZE], int nthreads);
+
+// Incremental form of hash_chunk() for callers that stream a chunk in slices.
+typedef struct {
+    HashAlgo algo;
+    void *evp;             // EVP_MD_CTX* for SHA256
+    Blake3Hasher b3;
+} HashState;
+
+int hash_init(HashState *hs, HashAlgo algo);
+void hash_update(HashState *hs, const unsigned char *data, size_t len);
+void hash_final(HashState *hs, unsigned char out[HASH_SIZE]);
+
+// Digest of len zero bytes, streamed from a small buffer: what a hole chunk
+// hashes to, so holes count in the Merkle root like the zeros they restore.
+void hash_zeros(HashAlgo algo, uint64_t len, unsigned char out[HASH_SIZE]);
+
+// Merkle tree over per-chunk hashes (RFC 6962 shape): leaves are
+// SHA256(0x00 || chunk_hash), interior nodes SHA256(0x01 || left || right),
+// and a range of n leaves splits at the largest power of two below n.
+void merkle_root(const unsigned char (*chunk_hashes)[HASH_SIZE], size_t n, unsigned char out[HASH_SIZE]);
+
+// Audit path for leaf 'idx', deepest sibling first. 'path' must hold at least
+// merkle_depth(n) entries. Returns the number of entries written.
+size_t merkle_depth(size_t n);
+size_t merkle_proof(const unsigned char (*chunk_hashes)[HASH_SIZE], size_t n, size_t idx,
+                    unsigned char (*path)[HASH_SIZE]);
+
+// Returns 1 if 'chunk_hash' at 'idx' of an n-chunk archive hashes up to 'root'.
+int merkle_verify(const unsigned char chunk_hash[HASH_SIZE], size_t idx, size_t n,
+                  const unsigned char (*path)[HASH_SIZE], size_t pathlen,
+                  const unsigned char root[HASH_SIZE]);
+
+void hash_to_hex(const unsigned char h[HASH_SIZE], char hex[2 * HASH_SIZE + 1]);
+int hex_to_hash(const char *hex, unsigned char h[HASH_SIZE]);
+
+#endif
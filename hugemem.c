@@ -0,0 +1,127 @@
+// hugemem.c
+// Per-thread huge page arena for ZSTD contexts.
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "hugemem.h"
+
+#define HUGE_PAGE (2u << 20)
+// smaller blocks (context structs, small-level tables) come from malloc
+#define HUGE_MIN_ALLOC (256u << 10)
+// freed mappings kept for the next context resize, instead of unmapping
+#define ARENA_SLOTS 4
+// in front of every block: how to free it
+#define HDR_SIZE 64
+
+struct HugeArena {
+    HugeMode mode;
+    int n;
+    struct { void *base; size_t len; } slot[ARENA_SLOTS];
+};
+
+typedef struct {
+    void *base;        // NULL: malloc'd, the header is the start of the block
+    size_t len;
+} BlockHdr;
+
+// A 2 MiB-aligned mapping of len bytes (a multiple of HUGE_PAGE).
+static void *map_huge(HugeMode mode, size_t len) {
+    if (mode == HUGE_EXPLICIT) {
+        void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) return p;
+    }
+    // over-map by a page and trim, so the huge pages line up
+    size_t span = len + HUGE_PAGE;
+    unsigned char *p = (unsigned char*)mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+    unsigned char *aligned = (unsigned char*)(((uintptr_t)p + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+    if (aligned > p) munmap(p, (size_t)(aligned - p));
+    size_t tail = (size_t)(p + span - (aligned + len));
+    if (tail) munmap(aligned + len, tail);
+    madvise(aligned, len, MADV_HUGEPAGE);
+    return aligned;
+}
+
+static void *arena_alloc(void *opaque, size_t size) {
+    HugeArena *a = (HugeArena*)opaque;
+    if (a->mode == HUGE_OFF || size < HUGE_MIN_ALLOC) {
+        unsigned char *p = (unsigned char*)malloc(size + HDR_SIZE);
+        if (!p) return NULL;
+        ((BlockHdr*)p)->base = NULL;
+        return p + HDR_SIZE;
+    }
+    size_t len = (size + HDR_SIZE + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+    // smallest cached mapping that fits
+    int best = -1;
+    for (int i = 0; i < a->n; ++i)
+        if (a->slot[i].len >= len && (best < 0 || a->slot[i].len < a->slot[best].len)) best = i;
+    unsigned char *base;
+    if (best >= 0) {
+        base = (unsigned char*)a->slot[best].base;
+        len = a->slot[best].len;
+        a->slot[best] = a->slot[--a->n];
+    } else {
+        base = (unsigned char*)map_huge(a->mode, len);
+        if (!base) return NULL;
+    }
+    ((BlockHdr*)base)->base = base;
+    ((BlockHdr*)base)->len = len;
+    return base + HDR_SIZE;
+}
+
+static void arena_free(void *opaque, void *ptr) {
+    HugeArena *a = (HugeArena*)opaque;
+    if (!ptr) return;
+    BlockHdr *h = (BlockHdr*)((unsigned char*)ptr - HDR_SIZE);
+    if (!h->base) { free(h); return; }
+    if (a->n < ARENA_SLOTS) {
+        a->slot[a->n].base = h->base;
+        a->slot[a->n].len = h->len;
+        a->n++;
+    } else {
+        munmap(h->base, h->len);
+    }
+}
+
+HugeArena *huge_arena_new(HugeMode mode) {
+    HugeArena *a = (HugeArena*)calloc(1, sizeof(HugeArena));
+    if (a) a->mode = mode;
+    return a;
+}
+
+void huge_arena_free(HugeArena *a) {
+    if (!a) return;
+    for (int i = 0; i < a->n; ++i) munmap(a->slot[i].base, a->slot[i].len);
+    free(a);
+}
+
+ZSTD_customMem huge_arena_mem(HugeArena *a) {
+    ZSTD_customMem m = { arena_alloc, arena_free, a };
+    return m;
+}
+
+size_t huge_arena_footprint(HugeMode mode, size_t size) {
+    if (mode == HUGE_OFF || size < HUGE_MIN_ALLOC) return size;
+    // the live block and a full cache of blocks no larger
+    size_t len = (size + HDR_SIZE + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+    return len * (1 + ARENA_SLOTS);
+}
+
+void *huge_buffer_alloc(size_t size) {
+    if (size < HUGE_PAGE) return malloc(size);
+    size_t len = (size + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+    void *p = aligned_alloc(HUGE_PAGE, len);
+    if (p) madvise(p, len, MADV_HUGEPAGE);
+    return p;
+}
+
+int huge_mode_from_name(const char *name, HugeMode *mode) {
+    if (strcmp(name, "off") == 0) *mode = HUGE_OFF;
+    else if (strcmp(name, "thp") == 0) *mode = HUGE_THP;
+    else if (strcmp(name, "explicit") == 0) *mode = HUGE_EXPLICIT;
+    else return -1;
+    return 0;
+}
@@ -0,0 +1,39 @@
+// hugemem.h
+// ZSTD_customMem allocator backing large blocks with 2 MiB pages. A level-19
+// compression context is mostly hash and chain tables probed at random, and
+// a decoder's window is read at random offsets; on 4 KiB pages nearly every
+// probe misses the dTLB. Each thread has its own arena, so no locking.
+
+#ifndef HUGEMEM_H
+#define HUGEMEM_H
+
+#include <stddef.h>
+#define ZSTD_STATIC_LINKING_ONLY   // ZSTD_customMem
+#include <zstd.h>
+
+typedef enum {
+    HUGE_OFF,          // plain malloc
+    HUGE_THP,          // 2 MiB-aligned mappings with MADV_HUGEPAGE
+    HUGE_EXPLICIT      // MAP_HUGETLB from the reserved pool, else as HUGE_THP
+} HugeMode;
+
+typedef struct HugeArena HugeArena;
+
+HugeArena *huge_arena_new(HugeMode mode);
+// Unmaps everything the arena still caches; free the ZSTD contexts using
+// it first.
+void huge_arena_free(HugeArena *a);
+ZSTD_customMem huge_arena_mem(HugeArena *a);
+// The most an arena can hold for a context of 'size' bytes (ZSTD's
+// estimate), for memory budgets: its blocks round up to whole 2 MiB pages,
+// and freed mappings stay cached for the next resize.
+size_t huge_arena_footprint(HugeMode mode, size_t size);
+
+// malloc() replacement for large data buffers (decode output): at least
+// 2 MiB gets a 2 MiB-aligned block advised for THP. Release with free().
+void *huge_buffer_alloc(size_t size);
+
+// "off", "thp" or "explicit"; returns 0 or -1.
+int huge_mode_from_name(const char *name, HugeMode *mode);
+
+#endif
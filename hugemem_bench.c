@@ -0,0 +1,150 @@
+// hugemem_bench.c
+// ZSTD contexts and decode buffers on 4 KiB pages (malloc) against the
+// huge page arena (hugemem.c): compression throughput with one reused
+// CCtx per mode, decode throughput with a reused DCtx and output buffer,
+// and the dTLB load misses of each pass from perf_event_open() where the
+// kernel allows it (perf_event_paranoid <= 2 is enough for user-space
+// counts of our own thread). Output sizes must match across modes.
+//
+// Usage: hugemem_bench [total_MiB] [level] [chunk_MiB]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "hugemem.h"
+#include "bench_util.h"
+
+// dTLB read misses of the calling thread, user space only; -1 if the PMU
+// or the permissions are not there (VMs often expose no cache events).
+static int dtlb_open(void) {
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_HW_CACHE;
+    pe.size = sizeof(pe);
+    pe.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+              | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    pe.disabled = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+static void dtlb_start(int fd) {
+    if (fd < 0) return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static long long dtlb_stop(int fd) {
+    long long v = -1;
+    if (fd < 0) return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &v, sizeof(v)) != sizeof(v)) return -1;
+    return v;
+}
+
+static void print_misses(long long m) {
+    if (m < 0) printf("  dTLB misses      n/a");
+    else printf("  dTLB misses %8.2fM", m / 1e6);
+}
+
+#define DECODE_ROUNDS 5
+
+typedef struct {
+    const char *name;
+    HugeMode mode;
+} Mode;
+
+int main(int argc, char **argv) {
+    size_t total = (size_t)(argc > 1 ? atoi(argv[1]) : 32) << 20;
+    int level = argc > 2 ? atoi(argv[2]) : 19;
+    size_t chunk = (size_t)(argc > 3 ? atoi(argv[3]) : 8) << 20;
+    if (total == 0 || chunk == 0 || level < 1 || level > ZSTD_maxCLevel()) {
+        fprintf(stderr, "Usage: %s [total_MiB] [level] [chunk_MiB]\n", argv[0]);
+        return 1;
+    }
+    int n = (int)((total + chunk - 1) / chunk);
+    unsigned char *data = (unsigned char*)malloc(total);
+    size_t bound = ZSTD_compressBound(chunk);
+    unsigned char **cdata = (unsigned char**)calloc((size_t)n, sizeof(unsigned char*));
+    size_t *csize = (size_t*)calloc((size_t)n, sizeof(size_t));
+    if (!data || !cdata || !csize) { fprintf(stderr, "OOM\n"); return 1; }
+    for (int i = 0; i < n; ++i)
+        if (!(cdata[i] = (unsigned char*)malloc(bound))) { fprintf(stderr, "OOM\n"); return 1; }
+    fill_data(data, total, 1);
+
+    int pfd = dtlb_open();
+    printf("hugemem_bench: %zu MiB, level %d, %zu MiB chunks, dTLB counter %s\n",
+           total >> 20, level, chunk >> 20, pfd < 0 ? "unavailable" : "on");
+
+    static const Mode modes[] = { { "4k", HUGE_OFF }, { "thp", HUGE_THP }, { "explicit", HUGE_EXPLICIT } };
+    size_t ref_total = 0;
+    int rc = 0;
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]) && rc == 0; ++m) {
+        HugeArena *arena = huge_arena_new(modes[m].mode);
+        ZSTD_CCtx *cctx = arena ? ZSTD_createCCtx_advanced(huge_arena_mem(arena)) : NULL;
+        ZSTD_DCtx *dctx = arena ? ZSTD_createDCtx_advanced(huge_arena_mem(arena)) : NULL;
+        unsigned char *out = modes[m].mode == HUGE_OFF ? (unsigned char*)malloc(chunk)
+                                                       : (unsigned char*)huge_buffer_alloc(chunk);
+        if (!cctx || !dctx || !out) { fprintf(stderr, "OOM\n"); return 1; }
+
+        size_t ctotal = 0;
+        dtlb_start(pfd);
+        double t0 = now_sec();
+        for (int i = 0; i < n; ++i) {
+            size_t len = total - (size_t)i * chunk < chunk ? total - (size_t)i * chunk : chunk;
+            csize[i] = ZSTD_compressCCtx(cctx, cdata[i], bound, data + (size_t)i * chunk, len, level);
+            if (ZSTD_isError(csize[i])) { rc = 1; break; }
+            ctotal += csize[i];
+        }
+        double t1 = now_sec();
+        long long cmiss = dtlb_stop(pfd);
+
+        // decoding is fast enough to take the best of a few warm rounds;
+        // the first one also pays the output buffer's page faults
+        double dbest = 1e30;
+        long long dmiss = -1;
+        for (int round = 0; round < DECODE_ROUNDS && rc == 0; ++round) {
+            dtlb_start(pfd);
+            double t2 = now_sec();
+            for (int i = 0; i < n && rc == 0; ++i) {
+                size_t len = total - (size_t)i * chunk < chunk ? total - (size_t)i * chunk : chunk;
+                size_t r = ZSTD_decompressDCtx(dctx, out, chunk, cdata[i], csize[i]);
+                if (ZSTD_isError(r) || r != len || memcmp(out, data + (size_t)i * chunk, len) != 0) rc = 1;
+            }
+            double t3 = now_sec();
+            long long miss = dtlb_stop(pfd);
+            if (t3 - t2 < dbest) { dbest = t3 - t2; dmiss = miss; }
+        }
+
+        if (rc == 0 && ref_total && ctotal != ref_total) {
+            fprintf(stderr, "%s: output differs (%zu vs %zu bytes)\n", modes[m].name, ctotal, ref_total);
+            rc = 1;
+        }
+        if (rc != 0) { fprintf(stderr, "%s: round trip failed\n", modes[m].name); break; }
+        ref_total = ctotal;
+        printf("%-8s compress %7.2f MB/s", modes[m].name, total / (t1 - t0) / 1e6);
+        print_misses(cmiss);
+        printf("   decompress %8.1f MB/s", total / dbest / 1e6);
+        print_misses(dmiss);
+        printf("\n");
+
+        ZSTD_freeCCtx(cctx);
+        ZSTD_freeDCtx(dctx);
+        free(out);
+        huge_arena_free(arena);
+    }
+    if (pfd >= 0) close(pfd);
+    for (int i = 0; i < n; ++i) free(cdata[i]);
+    free(cdata);
+    free(csize);
+    free(data);
+    return rc;
+}
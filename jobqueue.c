@@ -0,0 +1,38 @@
+// jobqueue.c
+// Mutex and condvar work queue, windowed behind the emit frontier.
+
+#include "jobqueue.h"
+
+void jobqueue_init(JobQueue *q, int count) {
+    q->count = count;
+    q->next_idx = 0;
+    q->frontier = NULL;
+    q->window = 0;
+    q->aborted = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+}
+
+int jobqueue_pop(JobQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->window && !q->aborted && q->next_idx < q->count
+           && q->next_idx >= atomic_load(q->frontier) + q->window)
+        pthread_cond_wait(&q->cond, &q->lock);
+    if (q->aborted || q->next_idx >= q->count) { pthread_mutex_unlock(&q->lock); return -1; }
+    int idx = q->next_idx++;
+    pthread_mutex_unlock(&q->lock);
+    return idx;
+}
+
+void jobqueue_notify(JobQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void jobqueue_abort(JobQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->aborted = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
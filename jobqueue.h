@@ -0,0 +1,33 @@
+// jobqueue.h
+// Work queue handing chunk indices to the compressor's workers in input
+// order, shared with micro_bench.c.
+
+#ifndef JOBQUEUE_H
+#define JOBQUEUE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+// With a window (--max-memory), a chunk is only handed out once it is within
+// 'window' chunks of the emit frontier, which bounds the compressed chunks
+// held while they wait for their predecessors to be written.
+typedef struct {
+    int count;
+    int next_idx;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    atomic_int *frontier;  // EmitState.frontier, when windowed
+    int window;            // 0: unbounded
+    int aborted;
+} JobQueue;
+
+void jobqueue_init(JobQueue *q, int count);
+// Index of the next chunk, or -1 once all are taken or the queue is aborted.
+int jobqueue_pop(JobQueue *q);
+// The frontier may have moved: let waiting workers re-check.
+void jobqueue_notify(JobQueue *q);
+// Hand out no more chunks; a chunk that will never be published would
+// otherwise hold the frontier, and windowed workers, forever.
+void jobqueue_abort(JobQueue *q);
+
+#endif
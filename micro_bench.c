@@ -0,0 +1,400 @@
+// micro_bench.c
+// Microbenchmarks for the hot kernels, each in isolation. They run in the
+// style of Google Benchmark: a run repeats the kernel until --min-time has
+// passed, the best of three runs counts, and the report gives time per
+// operation, bytes/sec and cycles/byte. Cycles are TSC ticks (reference
+// cycles), so with turbo they are not core clocks. Kernels:
+//   sha256_evp      compute_sha256_evp(), the per-chunk SHA-256
+//   sha256_stream   hash_init/update/final, the fused path's SHA-256
+//   blake3          BLAKE3 on one thread, and on every available CPU
+//   fnv1a32         the FNV-1a of cuda_hash.cu, as a CPU loop
+//   jobqueue_pop    workers draining the JobQueue, by thread count
+//   zstd_compress   per level and chunk size, with one reused CCtx
+//   zstd_decompress the same frames, with one reused DCtx
+//   filter_encode   each chunk filter (filter.c) over 1 MiB, first checked
+//                   against a plain scalar reference
+//   filter_decode   its inverse
+//   meta_parse_line one .meta chunk line
+//   load_meta       a whole .meta file of 65536 chunks
+//
+// Usage: micro_bench [--filter SUBSTR] [--min-time SECS]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <zstd.h>
+#include "hash.h"
+#include "blake3.h"
+#include "archive.h"
+#include "jobqueue.h"
+#include "filter.h"
+#include "cpus.h"
+#include "bench_util.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+static double min_time = 0.2;
+static const char *filter;
+
+static uint64_t ticks(void) {
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// The kernel runs 'iters' operations per call; 'bytes' is what one
+// operation processes (0: report time per operation only).
+typedef void (*BenchFn)(void *arg, long iters);
+
+static void run_bench(const char *name, size_t bytes, BenchFn fn, void *arg) {
+    if (filter && !strstr(name, filter)) return;
+    // grow the iteration count until one run takes min_time
+    long iters = 1;
+    double t;
+    for (;;) {
+        double t0 = now_sec();
+        fn(arg, iters);
+        t = now_sec() - t0;
+        if (t >= min_time || iters >= (1L << 40)) break;
+        long next = t > 0 ? (long)(iters * min_time * 1.2 / t) + 1 : iters * 10;
+        iters = next > iters * 10 ? iters * 10 : next;
+    }
+    double best = t;
+    uint64_t best_ticks = UINT64_MAX;
+    for (int r = 0; r < 3; ++r) {
+        uint64_t c0 = ticks();
+        double t0 = now_sec();
+        fn(arg, iters);
+        double dt = now_sec() - t0;
+        uint64_t dc = ticks() - c0;
+        if (dt < best) best = dt;
+        if (dc < best_ticks) best_ticks = dc;
+    }
+    double ns = best * 1e9 / (double)iters;
+    printf("%-34s %12ld iters %14.1f ns/op", name, iters, ns);
+    if (bytes) {
+        printf(" %10.1f MB/s", (double)bytes * (double)iters / best / 1e6);
+#ifdef HAVE_TSC
+        printf(" %8.2f cycles/byte", (double)best_ticks / ((double)bytes * (double)iters));
+#endif
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    int threads;
+    unsigned char out[HASH_SIZE];
+} HashArg;
+
+static void bench_sha256_evp(void *varg, long iters) {
+    HashArg *a = (HashArg*)varg;
+    for (long i = 0; i < iters; ++i) compute_sha256_evp(a->data, a->len, a->out);
+}
+
+static void bench_sha256_stream(void *varg, long iters) {
+    HashArg *a = (HashArg*)varg;
+    for (long i = 0; i < iters; ++i) {
+        HashState hs;
+        if (hash_init(&hs, HASH_SHA256) != 0) return;
+        // the fused path's slicing
+        for (size_t pos = 0; pos < a->len; pos += 64 * 1024)
+            hash_update(&hs, a->data + pos, a->len - pos < 64 * 1024 ? a->len - pos : 64 * 1024);
+        hash_final(&hs, a->out);
+    }
+}
+
+static void bench_blake3(void *varg, long iters) {
+    HashArg *a = (HashArg*)varg;
+    for (long i = 0; i < iters; ++i) blake3_hash(a->data, a->len, a->out, a->threads);
+}
+
+// cuda_hash.cu's fnv1a32_device, on the CPU
+static uint32_t fnv1a32(const unsigned char *data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (uint32_t)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void bench_fnv1a32(void *varg, long iters) {
+    HashArg *a = (HashArg*)varg;
+    volatile uint32_t sink = 0;
+    for (long i = 0; i < iters; ++i) sink ^= fnv1a32(a->data, a->len);
+    (void)sink;
+}
+
+// 'threads' workers pop until the queue of 'iters' entries is empty, doing
+// nothing else, which is the worst case for the queue lock.
+typedef struct {
+    int threads;
+    JobQueue *q;
+} QueueArg;
+
+static void *queue_worker(void *varg) {
+    JobQueue *q = ((QueueArg*)varg)->q;
+    while (jobqueue_pop(q) >= 0) { }
+    return NULL;
+}
+
+static void bench_jobqueue(void *varg, long iters) {
+    QueueArg *a = (QueueArg*)varg;
+    JobQueue q;
+    jobqueue_init(&q, (int)(iters < (1L << 30) ? iters : (1L << 30)));
+    QueueArg wa = { a->threads, &q };
+    pthread_t th[64];
+    for (int t = 0; t < a->threads; ++t) pthread_create(&th[t], NULL, queue_worker, &wa);
+    for (int t = 0; t < a->threads; ++t) pthread_join(th[t], NULL);
+    pthread_mutex_destroy(&q.lock);
+    pthread_cond_destroy(&q.cond);
+}
+
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    int level;
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    unsigned char *cbuf, *out;
+    size_t cap, csize;
+} ZstdArg;
+
+static void bench_zstd_compress(void *varg, long iters) {
+    ZstdArg *a = (ZstdArg*)varg;
+    for (long i = 0; i < iters; ++i)
+        a->csize = ZSTD_compressCCtx(a->cctx, a->cbuf, a->cap, a->data, a->len, a->level);
+}
+
+static void bench_zstd_decompress(void *varg, long iters) {
+    ZstdArg *a = (ZstdArg*)varg;
+    for (long i = 0; i < iters; ++i) ZSTD_decompressDCtx(a->dctx, a->out, a->len, a->cbuf, a->csize);
+}
+
+typedef struct {
+    Filter f;
+    const unsigned char *data;
+    unsigned char *tmp, *out;
+    size_t len;
+} FilterArg;
+
+static void bench_filter_encode(void *varg, long iters) {
+    FilterArg *a = (FilterArg*)varg;
+    for (long i = 0; i < iters; ++i) filter_encode(&a->f, a->tmp, a->data, a->len, 0);
+}
+
+static void bench_filter_decode(void *varg, long iters) {
+    FilterArg *a = (FilterArg*)varg;
+    for (long i = 0; i < iters; ++i) filter_decode(&a->f, a->out, a->tmp, a->len, 0);
+}
+
+// filter_encode() written out from the definitions in filter.h, one byte
+// or bit at a time, to check the SIMD paths against.
+static void filter_encode_ref(const Filter *f, unsigned char *dst, const unsigned char *src, size_t len) {
+    size_t w = (size_t)f->width, n = w ? len / w : 0, m = w ? len / w / 8 : 0, done = 0;
+    memset(dst, 0, len);
+    switch (f->type) {
+    case FILTER_DELTA:
+        for (size_t i = 0; i < len; ++i) dst[i] = (unsigned char)(i < w ? src[i] : src[i] - src[i - w]);
+        done = len;
+        break;
+    case FILTER_BCJ:
+        memcpy(dst, src, len);
+        for (size_t i = 0; i + 5 <= len; ++i) {
+            if (src[i] != 0xE8 && src[i] != 0xE9) continue;
+            uint32_t v = (uint32_t)src[i + 1] | (uint32_t)src[i + 2] << 8 | (uint32_t)src[i + 3] << 16
+                       | (uint32_t)src[i + 4] << 24;
+            v += (uint32_t)(i + 5);
+            for (int k = 0; k < 4; ++k) dst[i + 1 + k] = (unsigned char)(v >> (8 * k));
+            i += 4;
+        }
+        done = len;
+        break;
+    case FILTER_SHUFFLE:
+        for (size_t b = 0; b < w; ++b)
+            for (size_t i = 0; i < n; ++i) dst[b * n + i] = src[i * w + b];
+        done = n * w;
+        break;
+    case FILTER_BITSHUFFLE:
+        for (size_t p = 0; p < 8 * w; ++p)
+            for (size_t i = 0; i < 8 * m; ++i)
+                dst[p * m + i / 8] |= (unsigned char)(((src[i * w + p / 8] >> (p % 8)) & 1) << (i % 8));
+        done = m * 8 * w;
+        break;
+    default:
+        break;
+    }
+    memcpy(dst + done, src + done, len - done);
+}
+
+typedef struct {
+    char (*lines)[160];
+    int n;
+    const char *path;
+} MetaArg;
+
+static void bench_meta_parse(void *varg, long iters) {
+    MetaArg *a = (MetaArg*)varg;
+    MetaEntry e;
+    for (long i = 0; i < iters; ++i) meta_parse_line(a->lines[i % a->n], &e);
+}
+
+static void bench_load_meta(void *varg, long iters) {
+    MetaArg *a = (MetaArg*)varg;
+    for (long i = 0; i < iters; ++i) {
+        MetaIndex mi;
+        if (load_meta(a->path, &mi) == 0) free_meta(&mi);
+    }
+}
+
+int main(int argc, char **argv) {
+    static const struct option longopts[] = {
+        { "filter",   required_argument, NULL, 'f' },
+        { "min-time", required_argument, NULL, 't' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:t:", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'f': filter = optarg; break;
+        case 't': min_time = atof(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [--filter SUBSTR] [--min-time SECS]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (min_time <= 0) min_time = 0.2;
+
+    const size_t max_len = 16u << 20;
+    unsigned char *data = (unsigned char*)malloc(max_len);
+    if (!data) { fprintf(stderr, "OOM\n"); return 1; }
+    fill_data(data, max_len, 0);
+    int ncpus = available_cpus();
+    printf("micro_bench: %d CPUs, blake3 %s, filters %s, zstd %s, min time %.2fs, best of 3\n",
+           ncpus, blake3_simd_name(), filter_simd_name(), ZSTD_versionString(), min_time);
+
+    char name[64];
+    static const size_t hash_sizes[] = { 4u << 10, 64u << 10, 1u << 20 };
+    for (size_t i = 0; i < 3; ++i) {
+        HashArg a = { data, hash_sizes[i], 1, { 0 } };
+        snprintf(name, sizeof(name), "sha256_evp/%zuK", hash_sizes[i] >> 10);
+        run_bench(name, a.len, bench_sha256_evp, &a);
+        snprintf(name, sizeof(name), "sha256_stream/%zuK", hash_sizes[i] >> 10);
+        run_bench(name, a.len, bench_sha256_stream, &a);
+        snprintf(name, sizeof(name), "blake3/%zuK", hash_sizes[i] >> 10);
+        run_bench(name, a.len, bench_blake3, &a);
+        snprintf(name, sizeof(name), "fnv1a32/%zuK", hash_sizes[i] >> 10);
+        run_bench(name, a.len, bench_fnv1a32, &a);
+    }
+    HashArg big = { data, max_len, ncpus, { 0 } };
+    snprintf(name, sizeof(name), "blake3/16M/threads:%d", ncpus);
+    run_bench(name, big.len, bench_blake3, &big);
+
+    static const int queue_threads[] = { 1, 2, 4, 8 };
+    for (size_t i = 0; i < 4; ++i) {
+        QueueArg a = { queue_threads[i], NULL };
+        snprintf(name, sizeof(name), "jobqueue_pop/threads:%d", queue_threads[i]);
+        run_bench(name, 0, bench_jobqueue, &a);
+    }
+
+    static const int levels[] = { 1, 3, 9, 19 };
+    static const size_t chunk_sizes[] = { 64u << 10, 1u << 20, 4u << 20 };
+    ZstdArg z;
+    memset(&z, 0, sizeof(z));
+    z.cctx = ZSTD_createCCtx();
+    z.dctx = ZSTD_createDCtx();
+    z.cap = ZSTD_compressBound(4u << 20);
+    z.cbuf = (unsigned char*)malloc(z.cap);
+    z.out = (unsigned char*)malloc(4u << 20);
+    if (!z.cctx || !z.dctx || !z.cbuf || !z.out) { fprintf(stderr, "OOM\n"); return 1; }
+    for (size_t l = 0; l < 4; ++l) {
+        for (size_t c = 0; c < 3; ++c) {
+            z.data = data;
+            z.len = chunk_sizes[c];
+            z.level = levels[l];
+            snprintf(name, sizeof(name), "zstd_compress/L%d/%zuK", levels[l], chunk_sizes[c] >> 10);
+            run_bench(name, z.len, bench_zstd_compress, &z);
+            // the frame to decode, even if the compress benchmark was filtered out
+            z.csize = ZSTD_compressCCtx(z.cctx, z.cbuf, z.cap, z.data, z.len, z.level);
+            if (ZSTD_isError(z.csize)) { fprintf(stderr, "compress failed\n"); return 1; }
+            snprintf(name, sizeof(name), "zstd_decompress/L%d/%zuK", levels[l], chunk_sizes[c] >> 10);
+            run_bench(name, z.len, bench_zstd_decompress, &z);
+        }
+    }
+    ZSTD_freeCCtx(z.cctx);
+    ZSTD_freeDCtx(z.dctx);
+    free(z.cbuf);
+    free(z.out);
+
+    static const char *const filters[] = { "delta:1", "delta:2", "delta:4", "delta:32", "bcj",
+                                           "shuffle:2", "shuffle:4", "shuffle:8", "shuffle:16", "shuffle:24",
+                                           "bitshuffle:1", "bitshuffle:4" };
+    FilterArg fa = { { FILTER_NONE, 0 }, data, (unsigned char*)malloc(1u << 20), (unsigned char*)malloc(1u << 20), 1u << 20 };
+    if (!fa.tmp || !fa.out) { fprintf(stderr, "OOM\n"); return 1; }
+    for (size_t i = 0; i < sizeof(filters) / sizeof(filters[0]); ++i) {
+        filter_from_name(filters[i], &fa.f);
+        snprintf(name, sizeof(name), "filter_encode/%s/1024K", filters[i]);
+        run_bench(name, fa.len, bench_filter_encode, &fa);
+        // the SIMD paths against the plain definition, also with a length
+        // that leaves a partial vector and a partial element at the end
+        for (size_t cut = 0; cut <= 37; cut += 37) {
+            filter_encode(&fa.f, fa.tmp, fa.data, fa.len - cut, 0);
+            filter_encode_ref(&fa.f, fa.out, fa.data, fa.len - cut);
+            if (memcmp(fa.tmp, fa.out, fa.len - cut) != 0) {
+                fprintf(stderr, "%s: encoding differs from the reference (%zu bytes)\n", filters[i], fa.len - cut);
+                return 1;
+            }
+        }
+        // the input to decode, even if the encode benchmark was filtered out
+        filter_encode(&fa.f, fa.tmp, fa.data, fa.len, 0);
+        snprintf(name, sizeof(name), "filter_decode/%s/1024K", filters[i]);
+        run_bench(name, fa.len, bench_filter_decode, &fa);
+        filter_decode(&fa.f, fa.out, fa.tmp, fa.len, 0);
+        if (memcmp(fa.out, fa.data, fa.len) != 0) { fprintf(stderr, "%s: round trip failed\n", filters[i]); return 1; }
+    }
+    free(fa.tmp);
+    free(fa.out);
+
+    // chunk lines as the compressor writes them (meta_write_line), read back
+    enum { META_CHUNKS = 65536 };
+    MetaArg m = { (char (*)[160])malloc((size_t)META_CHUNKS * 160), META_CHUNKS, NULL };
+    char path[] = "/tmp/micro_bench_meta_XXXXXX";
+    int fd = mkstemp(path);
+    FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!m.lines || !f) { fprintf(stderr, "cannot set up the .meta benchmarks\n"); return 1; }
+    for (int i = 0; i < META_CHUNKS; ++i) {
+        MetaEntry e;
+        memset(&e, 0, sizeof(e));
+        e.id = i;
+        e.orig_size = 1u << 20;
+        e.comp_size = 200000 + rng() % 200000;
+        e.kind = CHUNK_ZSTD;
+        blake3_hash(data + (size_t)i * 64, 64, e.hash, 1);
+        meta_write_line(f, &e);
+    }
+    fclose(f);
+    size_t line_bytes = 0;
+    f = fopen(path, "r");
+    for (int i = 0; f && i < META_CHUNKS && fgets(m.lines[i], 160, f); ++i) line_bytes += strlen(m.lines[i]);
+    if (f) fclose(f);
+    m.path = path;
+    run_bench("meta_parse_line", line_bytes / META_CHUNKS, bench_meta_parse, &m);
+    run_bench("load_meta/65536", line_bytes, bench_load_meta, &m);
+    unlink(path);
+    free(m.lines);
+    free(data);
+    return 0;
+}
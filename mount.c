@@ -0,0 +1,779 @@
+// mount.c
+// 4zip mount: serve archives made by compressor.c as read-only files, so
+// readers can pread any offset without restoring first. Reads go through the
+// chunk index: only the chunks a read touches are decompressed (only the seek
+// frames, for chunks stored as several), and they are kept in a sharded
+// W-TinyLFU cache (chunk_cache.c). Sequential readers get
+// the next chunks decompressed ahead of them on a prefetch thread pool.
+// Cache metrics can be read from the hidden file STATS_NAME in the mount root.
+//
+// Speaks the kernel FUSE protocol on /dev/fuse directly. Mounting needs
+// CAP_SYS_ADMIN, or fusermount3/fusermount for unprivileged users.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <linux/fuse.h>
+#include "archive.h"
+#include "decode.h"
+#include "chunk_cache.h"
+#include "cpus.h"
+
+#define ROOT_INO 1
+// not listed by readdir, but can be opened by name
+#define STATS_NAME ".4zip-stats"
+#define STATS_INO (ROOT_INO + g.narchives + 1)
+#define DEFAULT_CACHE_SIZE (256ull << 20)
+// archives never change under the mount, so the kernel may cache attributes
+// and names for a long time
+#define ATTR_TIMEOUT 3600
+// largest read the kernel sends us (FUSE_MAX_PAGES), and the request buffer
+#define MAX_READ (1u << 20)
+#define REQ_BUF_SIZE (64 * 1024)
+// sequential-read prefetch: start after this many in-order reads, and keep
+// up to PREFETCH_MAX chunks ahead; for seek frames, each step of depth is
+// PREFETCH_FRAME_BYTES worth of frames
+#define PREFETCH_AFTER 2
+#define PREFETCH_MAX 8
+#define PREFETCH_FRAME_BYTES (4u << 20)
+#define PREFETCH_QUEUE 256
+
+typedef struct {
+    char name[256];
+    MetaIndex mi;
+    VolumeMap vm;
+    // Reads, caching and prefetch work in units: a seek frame, or a whole
+    // chunk if it was stored as a single frame.
+    uint32_t nunits;
+    uint64_t *unit_off;        // unit u covers [unit_off[u], unit_off[u + 1])
+    uint32_t *unit_chunk;
+    uint64_t *unit_coff;       // start of its compressed bytes in the chunk payload
+    uint64_t *unit_csize;
+    uint32_t prefetch_units;   // units per step of prefetch depth, about a chunk's worth
+    uint64_t size;
+    struct stat st;            // of the .meta, for owner and times
+    // one decode per unit at a time; others wait for it to reach the cache
+    pthread_mutex_t load_lock;
+    pthread_cond_t load_cond;
+    unsigned char *loading;
+} Archive;
+
+// Per open file: where the next in-order read would start. For the stats
+// file, the text snapshot taken at open instead.
+typedef struct {
+    uint32_t archive;
+    char *text;
+    size_t text_len;
+    pthread_mutex_t lock;
+    uint64_t next_off;
+    int streak;
+    uint32_t prefetched;       // units below this have been queued
+} Handle;
+
+typedef struct {
+    uint32_t archive;
+    uint32_t unit;
+} PrefetchTask;
+
+typedef struct {
+    Archive *archives;
+    uint32_t narchives;
+    ChunkCache cache;
+    BufPool pool;
+    int fuse_fd;
+    const char *mountpoint;
+    int fusermount;            // mounted through the setuid helper
+    pthread_mutex_t pf_lock;
+    pthread_cond_t pf_cond;
+    PrefetchTask pf_queue[PREFETCH_QUEUE];
+    int pf_head, pf_count;
+    uint64_t prefetched;
+    int stopping;
+} MountState;
+
+static MountState g;
+
+static int load_archive(Archive *a, const char *cmp_path, const char *meta_path, char **dirs, int ndirs) {
+    memset(a, 0, sizeof(*a));
+    if (load_meta(meta_path, &a->mi) != 0) return -1;
+    if (stat(meta_path, &a->st) != 0) { perror(meta_path); return -1; }
+    if (open_volumes(cmp_path, &a->mi, dirs, ndirs, &a->vm) != 0) return -1;
+    size_t units = 0;
+    for (uint32_t i = 0; i < a->mi.count; ++i) units += a->mi.entries[i].nframes ? a->mi.entries[i].nframes : 1;
+    a->unit_off = (uint64_t*)malloc((units + 1) * sizeof(uint64_t));
+    a->unit_chunk = (uint32_t*)malloc((units + 1) * sizeof(uint32_t));
+    a->unit_coff = (uint64_t*)malloc((units + 1) * sizeof(uint64_t));
+    a->unit_csize = (uint64_t*)malloc((units + 1) * sizeof(uint64_t));
+    a->loading = (unsigned char*)calloc(units + 1, 1);
+    if (!a->unit_off || !a->unit_chunk || !a->unit_coff || !a->unit_csize || !a->loading) {
+        fprintf(stderr, "OOM\n");
+        return -1;
+    }
+    uint64_t off = 0;
+    uint32_t u = 0;
+    for (uint32_t i = 0; i < a->mi.count; ++i) {
+        const MetaEntry *e = &a->mi.entries[i];
+        uint32_t nf = e->nframes ? e->nframes : 1;
+        uint64_t coff = 0;
+        for (uint32_t f = 0; f < nf; ++f, ++u) {
+            uint64_t len = e->orig_size;
+            a->unit_csize[u] = e->comp_size;
+            if (e->nframes) {
+                len = e->orig_size - f * a->mi.frame_size;
+                if (len > a->mi.frame_size) len = a->mi.frame_size;
+                a->unit_csize[u] = a->mi.seek[e->seek_first + f];
+            }
+            a->unit_off[u] = off;
+            a->unit_chunk[u] = i;
+            a->unit_coff[u] = coff;
+            off += len;
+            coff += a->unit_csize[u];
+        }
+    }
+    a->nunits = u;
+    a->unit_off[u] = off;
+    a->size = off;
+    a->prefetch_units = 1;
+    if (a->mi.frame_size && a->mi.frame_size < PREFETCH_FRAME_BYTES)
+        a->prefetch_units = (uint32_t)(PREFETCH_FRAME_BYTES / a->mi.frame_size);
+    pthread_mutex_init(&a->load_lock, NULL);
+    pthread_cond_init(&a->load_cond, NULL);
+
+    // the file is named like the decompressor would restore it
+    char prefix[1024];
+    if (a->mi.volumes) volume_prefix(cmp_path, prefix, sizeof(prefix));
+    else snprintf(prefix, sizeof(prefix), "%s", cmp_path);
+    const char *base = strrchr(prefix, '/') ? strrchr(prefix, '/') + 1 : prefix;
+    snprintf(a->name, sizeof(a->name), "%.255s", base);
+    size_t n = strlen(a->name);
+    if (n > 4 && strcmp(a->name + n - 4, ".cmp") == 0) a->name[n - 4] = 0;
+    return 0;
+}
+
+// Unit containing byte 'off' (off < size).
+static uint32_t unit_at(const Archive *a, uint64_t off) {
+    uint32_t lo = 0, hi = a->nunits - 1;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo + 1) / 2;
+        if (a->unit_off[mid] <= off) lo = mid; else hi = mid - 1;
+    }
+    return lo;
+}
+
+// Decompressed unit u of archive 'ai', from the cache or decoded now.
+// Returns a held cache entry, or NULL on error.
+static CacheEntry *load_unit(Decoder *dec, uint32_t ai, uint32_t u, int prefetch) {
+    Archive *a = &g.archives[ai];
+    for (;;) {
+        CacheEntry *e = prefetch ? chunk_cache_peek(&g.cache, ai, u) : chunk_cache_get(&g.cache, ai, u);
+        if (e) return e;
+        pthread_mutex_lock(&a->load_lock);
+        if (a->loading[u]) {
+            while (a->loading[u]) pthread_cond_wait(&a->load_cond, &a->load_lock);
+            pthread_mutex_unlock(&a->load_lock);
+            continue;
+        }
+        a->loading[u] = 1;
+        pthread_mutex_unlock(&a->load_lock);
+        break;
+    }
+
+    uint32_t i = a->unit_chunk[u];
+    const MetaEntry *me = &a->mi.entries[i];
+    size_t size = (size_t)(a->unit_off[u + 1] - a->unit_off[u]);
+    unsigned char *out = (unsigned char*)malloc(size ? size : 1);
+    CacheEntry *e = NULL;
+    int ok;
+    size_t len, cap;
+    unsigned char *rec;
+    if (me->nframes) {
+        // just this frame's bytes
+        len = (size_t)a->unit_csize[u];
+        rec = bufpool_get(&g.pool, len, &cap);
+        ok = rec && out && pread_full(a->vm.fds[a->vm.vol[i]], rec, len,
+                                      (off_t)(a->vm.off[i] + sizeof(uint64_t) + a->unit_coff[u])) == 0
+             && decode_frame(dec, me, rec, len, out, size) == 0;
+    } else {
+        uint64_t csize64;
+        len = sizeof(uint64_t) + (size_t)me->comp_size;
+        rec = bufpool_get(&g.pool, len, &cap);
+        ok = rec && out && pread_full(a->vm.fds[a->vm.vol[i]], rec, len, (off_t)a->vm.off[i]) == 0
+             && (memcpy(&csize64, rec, sizeof(csize64)), csize64 == me->comp_size)
+             && decode_chunk(dec, me, rec + sizeof(uint64_t), (size_t)me->comp_size, out) == (long long)size;
+    }
+    if (ok) {
+        e = chunk_cache_put(&g.cache, ai, u, out, size);
+        out = NULL;
+    } else {
+        fprintf(stderr, "%s: chunk %u: read or decode failed\n", a->name, i);
+    }
+    free(out);
+    bufpool_put(&g.pool, rec, cap);
+
+    pthread_mutex_lock(&a->load_lock);
+    a->loading[u] = 0;
+    pthread_cond_broadcast(&a->load_cond);
+    pthread_mutex_unlock(&a->load_lock);
+    return e;
+}
+
+static void prefetch_push(uint32_t ai, uint32_t unit) {
+    pthread_mutex_lock(&g.pf_lock);
+    if (g.pf_count < PREFETCH_QUEUE) {
+        g.pf_queue[(g.pf_head + g.pf_count) % PREFETCH_QUEUE] = (PrefetchTask){ ai, unit };
+        g.pf_count++;
+        pthread_cond_signal(&g.pf_cond);
+    }
+    pthread_mutex_unlock(&g.pf_lock);
+}
+
+static void *prefetch_thread(void *varg) {
+    (void)varg;
+    Decoder dec;
+    if (decoder_init(&dec) != 0) return NULL;
+    for (;;) {
+        pthread_mutex_lock(&g.pf_lock);
+        while (g.pf_count == 0 && !g.stopping) pthread_cond_wait(&g.pf_cond, &g.pf_lock);
+        if (g.stopping) { pthread_mutex_unlock(&g.pf_lock); break; }
+        PrefetchTask t = g.pf_queue[g.pf_head];
+        g.pf_head = (g.pf_head + 1) % PREFETCH_QUEUE;
+        g.pf_count--;
+        g.prefetched++;
+        pthread_mutex_unlock(&g.pf_lock);
+        chunk_cache_release(&g.cache, load_unit(&dec, t.archive, t.unit, 1));
+    }
+    decoder_free(&dec);
+    return NULL;
+}
+
+// Note a read of [off, off+len) on h; once the reader has been sequential
+// for a while, queue the units after 'last' for prefetch, further ahead the
+// longer the streak.
+static void track_read(Handle *h, const Archive *a, uint64_t off, uint64_t len, uint32_t last) {
+    pthread_mutex_lock(&h->lock);
+    // the kernel's own readahead may deliver in-order reads slightly out of
+    // order, so anything at or just behind the expected offset counts
+    int seq = off <= h->next_off && off + MAX_READ >= h->next_off;
+    h->streak = seq ? h->streak + 1 : 0;
+    if (!seq || off + len > h->next_off) h->next_off = off + len;
+    uint32_t from = 0, to = 0;
+    if (h->streak >= PREFETCH_AFTER) {
+        int depth = h->streak - PREFETCH_AFTER + 1;
+        if (depth > PREFETCH_MAX) depth = PREFETCH_MAX;
+        from = last + 1 > h->prefetched ? last + 1 : h->prefetched;
+        to = last + 1 + (uint32_t)depth * a->prefetch_units;
+        if (to > a->nunits) to = a->nunits;
+        if (to > h->prefetched) h->prefetched = to;
+    } else if (!seq) {
+        h->prefetched = 0;
+    }
+    pthread_mutex_unlock(&h->lock);
+    for (uint32_t u = from; u < to; ++u) {
+        const MetaEntry *me = &a->mi.entries[a->unit_chunk[u]];
+        if (me->kind == CHUNK_ZSTD && me->comp_size) prefetch_push(h->archive, u);
+    }
+}
+
+// Copy [off, off+len) of archive 'ai' into buf; returns bytes copied or -errno.
+static ssize_t archive_read(Decoder *dec, Handle *h, uint64_t off, size_t len, unsigned char *buf) {
+    Archive *a = &g.archives[h->archive];
+    if (off >= a->size) return 0;
+    if (len > a->size - off) len = (size_t)(a->size - off);
+    size_t done = 0;
+    uint32_t u = unit_at(a, off);
+    while (done < len) {
+        uint32_t i = a->unit_chunk[u];
+        const MetaEntry *me = &a->mi.entries[i];
+        uint64_t in = off + done - a->unit_off[u];
+        size_t n = (size_t)(a->unit_off[u + 1] - a->unit_off[u] - in);
+        if (n > len - done) n = len - done;
+        if (me->kind == CHUNK_HOLE || me->comp_size == 0) {
+            // holes, and records the compressor could not store, read as zeros
+            memset(buf + done, 0, n);
+        } else if (me->kind == CHUNK_FILL) {
+            // not worth a cache slot: the fill byte is all there is
+            unsigned char b;
+            if (pread_full(a->vm.fds[a->vm.vol[i]], &b, 1, (off_t)(a->vm.off[i] + sizeof(uint64_t))) != 0) return -EIO;
+            memset(buf + done, b, n);
+        } else if (me->kind == CHUNK_RAW) {
+            // stored as is: read the bytes in place, no decode and no cache slot
+            if (me->comp_size != me->orig_size
+                || pread_full(a->vm.fds[a->vm.vol[i]], buf + done, n, (off_t)(a->vm.off[i] + sizeof(uint64_t) + in)) != 0)
+                return -EIO;
+        } else {
+            CacheEntry *e = load_unit(dec, h->archive, u, 0);
+            if (!e) return -EIO;
+            memcpy(buf + done, e->data + in, n);
+            chunk_cache_release(&g.cache, e);
+        }
+        done += n;
+        if (done < len) ++u;
+    }
+    track_read(h, a, off, len, u);
+    return (ssize_t)done;
+}
+
+static void fill_attr(struct fuse_attr *attr, uint64_t ino) {
+    memset(attr, 0, sizeof(*attr));
+    attr->ino = ino;
+    if (ino == ROOT_INO || ino == STATS_INO) {
+        // the stats file reports size 0 and is read with direct I/O
+        attr->mode = ino == ROOT_INO ? S_IFDIR | 0555 : S_IFREG | 0444;
+        attr->nlink = ino == ROOT_INO ? 2 : 1;
+        attr->uid = getuid();
+        attr->gid = getgid();
+        return;
+    }
+    const Archive *a = &g.archives[ino - ROOT_INO - 1];
+    attr->size = a->size;
+    attr->blocks = (a->size + 511) / 512;
+    attr->blksize = 4096;
+    attr->mode = S_IFREG | 0444;
+    attr->nlink = 1;
+    attr->uid = a->st.st_uid;
+    attr->gid = a->st.st_gid;
+    attr->atime = attr->mtime = (uint64_t)a->st.st_mtim.tv_sec;
+    attr->atimensec = attr->mtimensec = (uint32_t)a->st.st_mtim.tv_nsec;
+    attr->ctime = (uint64_t)a->st.st_ctim.tv_sec;
+    attr->ctimensec = (uint32_t)a->st.st_ctim.tv_nsec;
+}
+
+static int valid_ino(uint64_t ino) {
+    return ino >= ROOT_INO && ino <= STATS_INO;
+}
+
+static int format_stats(char *buf, size_t size) {
+    CacheStats st;
+    chunk_cache_stats(&g.cache, &st);
+    uint64_t lookups = st.hits + st.misses;
+    pthread_mutex_lock(&g.pf_lock);
+    uint64_t prefetched = g.prefetched;
+    pthread_mutex_unlock(&g.pf_lock);
+    return snprintf(buf, size,
+                    "cache_capacity %" PRIu64 "\n"
+                    "cache_bytes %" PRIu64 "\n"
+                    "cache_entries %" PRIu64 "\n"
+                    "hits %" PRIu64 "\n"
+                    "misses %" PRIu64 "\n"
+                    "hit_rate %.4f\n"
+                    "admitted %" PRIu64 "\n"
+                    "rejected %" PRIu64 "\n"
+                    "evicted %" PRIu64 "\n"
+                    "prefetched %" PRIu64 "\n",
+                    st.capacity, st.bytes, st.entries, st.hits, st.misses,
+                    lookups ? (double)st.hits / (double)lookups : 0.0,
+                    st.admitted, st.rejected, st.evicted, prefetched);
+}
+
+static void reply(uint64_t unique, int err, const void *data, size_t len) {
+    struct fuse_out_header oh;
+    oh.len = (uint32_t)(sizeof(oh) + (err ? 0 : len));
+    oh.error = -err;
+    oh.unique = unique;
+    struct iovec iov[2] = { { &oh, sizeof(oh) }, { (void*)data, err ? 0 : len } };
+    // ENOENT means the request was interrupted meanwhile; nothing to do
+    if (writev(g.fuse_fd, iov, err || len == 0 ? 1 : 2) < 0 && errno != ENOENT)
+        perror("fuse reply");
+}
+
+static void do_init(uint64_t unique, const struct fuse_init_in *in) {
+    struct fuse_init_out out;
+    memset(&out, 0, sizeof(out));
+    out.major = FUSE_KERNEL_VERSION;
+    out.minor = in->minor < FUSE_KERNEL_MINOR_VERSION ? in->minor : FUSE_KERNEL_MINOR_VERSION;
+    if (in->major != FUSE_KERNEL_VERSION) {
+        fprintf(stderr, "unsupported FUSE protocol %u.%u\n", in->major, in->minor);
+        reply(unique, EPROTO, NULL, 0);
+        return;
+    }
+    out.max_readahead = in->max_readahead;
+    // parallel reads on one file, and reads of up to MAX_READ at a time
+    out.flags = in->flags & (FUSE_ASYNC_READ | FUSE_MAX_PAGES);
+    out.max_pages = (uint16_t)(MAX_READ / 4096);
+    out.max_background = 16;
+    out.congestion_threshold = 12;
+    out.max_write = 4096;
+    out.time_gran = 1;
+    reply(unique, 0, &out, out.minor < 23 ? FUSE_COMPAT_22_INIT_OUT_SIZE : sizeof(out));
+}
+
+static void do_readdir(uint64_t unique, const struct fuse_read_in *in) {
+    char buf[REQ_BUF_SIZE];
+    size_t used = 0, max = in->size < sizeof(buf) ? in->size : sizeof(buf);
+    // entry k: 0 ".", 1 "..", then the archives; fuse_dirent.off is the next k
+    for (uint64_t k = in->offset; k < 2 + (uint64_t)g.narchives; ++k) {
+        const char *name = k == 0 ? "." : k == 1 ? ".." : g.archives[k - 2].name;
+        size_t namelen = strlen(name);
+        size_t entlen = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + namelen);
+        if (used + entlen > max) break;
+        struct fuse_dirent *d = (struct fuse_dirent*)(buf + used);
+        memset(d, 0, entlen);
+        d->ino = k < 2 ? ROOT_INO : ROOT_INO + k - 1;
+        d->off = k + 1;
+        d->namelen = (uint32_t)namelen;
+        d->type = k < 2 ? DT_DIR : DT_REG;
+        memcpy(d->name, name, namelen);
+        used += entlen;
+    }
+    reply(unique, 0, buf, used);
+}
+
+static void do_statfs(uint64_t unique) {
+    struct fuse_statfs_out out;
+    memset(&out, 0, sizeof(out));
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < g.narchives; ++i) total += g.archives[i].size;
+    out.st.bsize = out.st.frsize = 4096;
+    out.st.blocks = (total + 4095) / 4096;
+    out.st.files = g.narchives + 1;
+    out.st.namelen = 255;
+    reply(unique, 0, &out, sizeof(out));
+}
+
+// Handle one request; returns 0 to keep serving, 1 after FUSE_DESTROY.
+static int dispatch(Decoder *dec, unsigned char *req, unsigned char *rbuf) {
+    struct fuse_in_header *ih = (struct fuse_in_header*)req;
+    void *arg = req + sizeof(*ih);
+    uint64_t ino = ih->nodeid;
+    switch (ih->opcode) {
+    case FUSE_INIT:
+        do_init(ih->unique, (struct fuse_init_in*)arg);
+        break;
+    case FUSE_DESTROY:
+        reply(ih->unique, 0, NULL, 0);
+        return 1;
+    case FUSE_FORGET:
+    case FUSE_BATCH_FORGET:
+    case FUSE_INTERRUPT:
+        break;   // no reply expected
+    case FUSE_LOOKUP: {
+        const char *name = (const char*)arg;
+        uint32_t k = 0;
+        while (k < g.narchives && strcmp(g.archives[k].name, name) != 0) ++k;
+        int stats = k == g.narchives && strcmp(name, STATS_NAME) == 0;
+        if (ino != ROOT_INO || (k == g.narchives && !stats)) { reply(ih->unique, ENOENT, NULL, 0); break; }
+        struct fuse_entry_out out;
+        memset(&out, 0, sizeof(out));
+        out.nodeid = ROOT_INO + 1 + k;
+        out.entry_valid = ATTR_TIMEOUT;
+        out.attr_valid = stats ? 0 : ATTR_TIMEOUT;
+        fill_attr(&out.attr, out.nodeid);
+        reply(ih->unique, 0, &out, sizeof(out));
+        break;
+    }
+    case FUSE_GETATTR: {
+        if (!valid_ino(ino)) { reply(ih->unique, ENOENT, NULL, 0); break; }
+        struct fuse_attr_out out;
+        memset(&out, 0, sizeof(out));
+        out.attr_valid = ATTR_TIMEOUT;
+        fill_attr(&out.attr, ino);
+        reply(ih->unique, 0, &out, sizeof(out));
+        break;
+    }
+    case FUSE_OPEN: {
+        const struct fuse_open_in *in = (const struct fuse_open_in*)arg;
+        if (!valid_ino(ino)) { reply(ih->unique, ENOENT, NULL, 0); break; }
+        if (ino == ROOT_INO) { reply(ih->unique, EISDIR, NULL, 0); break; }
+        if ((in->flags & O_ACCMODE) != O_RDONLY) { reply(ih->unique, EROFS, NULL, 0); break; }
+        Handle *h = (Handle*)calloc(1, sizeof(Handle));
+        if (!h) { reply(ih->unique, ENOMEM, NULL, 0); break; }
+        h->archive = (uint32_t)(ino - ROOT_INO - 1);
+        pthread_mutex_init(&h->lock, NULL);
+        struct fuse_open_out out;
+        memset(&out, 0, sizeof(out));
+        out.fh = (uint64_t)(uintptr_t)h;
+        out.open_flags = FOPEN_KEEP_CACHE;   // contents never change
+        if (ino == STATS_INO) {
+            char text[1024];
+            int n = format_stats(text, sizeof(text));
+            h->text = strdup(text);
+            if (!h->text) { free(h); reply(ih->unique, ENOMEM, NULL, 0); break; }
+            h->text_len = n > 0 && (size_t)n < sizeof(text) ? (size_t)n : 0;
+            out.open_flags = FOPEN_DIRECT_IO;
+        }
+        reply(ih->unique, 0, &out, sizeof(out));
+        break;
+    }
+    case FUSE_READ: {
+        const struct fuse_read_in *in = (const struct fuse_read_in*)arg;
+        Handle *h = (Handle*)(uintptr_t)in->fh;
+        size_t len = in->size < MAX_READ ? in->size : MAX_READ;
+        if (h->text) {
+            size_t n = in->offset < h->text_len ? h->text_len - (size_t)in->offset : 0;
+            reply(ih->unique, 0, h->text + (n ? in->offset : 0), n < len ? n : len);
+            break;
+        }
+        ssize_t r = archive_read(dec, h, in->offset, len, rbuf);
+        if (r < 0) reply(ih->unique, (int)-r, NULL, 0);
+        else reply(ih->unique, 0, rbuf, (size_t)r);
+        break;
+    }
+    case FUSE_RELEASE: {
+        const struct fuse_release_in *in = (const struct fuse_release_in*)arg;
+        Handle *h = (Handle*)(uintptr_t)in->fh;
+        pthread_mutex_destroy(&h->lock);
+        free(h->text);
+        free(h);
+        reply(ih->unique, 0, NULL, 0);
+        break;
+    }
+    case FUSE_OPENDIR: {
+        if (ino != ROOT_INO) { reply(ih->unique, ENOTDIR, NULL, 0); break; }
+        struct fuse_open_out out;
+        memset(&out, 0, sizeof(out));
+        out.open_flags = FOPEN_KEEP_CACHE;
+        reply(ih->unique, 0, &out, sizeof(out));
+        break;
+    }
+    case FUSE_READDIR:
+        do_readdir(ih->unique, (const struct fuse_read_in*)arg);
+        break;
+    case FUSE_FLUSH:
+    case FUSE_RELEASEDIR:
+    case FUSE_FSYNC:
+    case FUSE_FSYNCDIR:
+        reply(ih->unique, 0, NULL, 0);
+        break;
+    case FUSE_ACCESS: {
+        const struct fuse_access_in *in = (const struct fuse_access_in*)arg;
+        reply(ih->unique, (in->mask & W_OK) ? EROFS : 0, NULL, 0);
+        break;
+    }
+    case FUSE_STATFS:
+        do_statfs(ih->unique);
+        break;
+    default:
+        reply(ih->unique, ENOSYS, NULL, 0);
+        break;
+    }
+    return 0;
+}
+
+static void *fuse_thread(void *varg) {
+    (void)varg;
+    Decoder dec;
+    unsigned char *req = (unsigned char*)malloc(REQ_BUF_SIZE);
+    unsigned char *rbuf = (unsigned char*)malloc(MAX_READ);
+    if (!req || !rbuf || decoder_init(&dec) != 0) { fprintf(stderr, "OOM\n"); free(req); free(rbuf); return NULL; }
+    for (;;) {
+        ssize_t n = read(g.fuse_fd, req, REQ_BUF_SIZE);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == ENOENT) continue;
+            if (errno != ENODEV) perror("fuse read");
+            break;   // ENODEV: unmounted
+        }
+        if ((size_t)n < sizeof(struct fuse_in_header)) continue;
+        if (dispatch(&dec, req, rbuf)) break;
+    }
+    decoder_free(&dec);
+    free(req);
+    free(rbuf);
+    return NULL;
+}
+
+// Unprivileged mount: fusermount does the mount(2) and passes the /dev/fuse
+// fd back over a socket named by _FUSE_COMMFD.
+static int fusermount_mount(const char *mountpoint, const char *opts) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return -1;
+    pid_t pid = fork();
+    if (pid < 0) { close(sv[0]); close(sv[1]); return -1; }
+    if (pid == 0) {
+        char env[32];
+        close(sv[0]);
+        snprintf(env, sizeof(env), "%d", sv[1]);
+        setenv("_FUSE_COMMFD", env, 1);
+        execlp("fusermount3", "fusermount3", "-o", opts, "--", mountpoint, (char*)NULL);
+        execlp("fusermount", "fusermount", "-o", opts, "--", mountpoint, (char*)NULL);
+        _exit(127);
+    }
+    close(sv[1]);
+    char dummy;
+    char ctl[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &dummy, 1 };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+    int fd = -1;
+    if (recvmsg(sv[0], &msg, 0) > 0) {
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        if (cm && cm->cmsg_type == SCM_RIGHTS) memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+    }
+    close(sv[0]);
+    waitpid(pid, NULL, 0);
+    return fd;
+}
+
+static int do_mount(const char *mountpoint) {
+    int fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+    if (fd < 0) { perror("/dev/fuse"); return -1; }
+    char opts[256];
+    snprintf(opts, sizeof(opts), "fd=%d,rootmode=%o,user_id=%u,group_id=%u,default_permissions%s", fd,
+             S_IFDIR | 0555, getuid(), getgid(), getuid() == 0 ? ",allow_other" : "");
+    if (mount("4zip", mountpoint, "fuse.4zip", MS_RDONLY | MS_NOSUID | MS_NODEV, opts) == 0) return fd;
+    int err = errno;
+    close(fd);
+    if (err != EPERM) { errno = err; perror("mount"); return -1; }
+    fd = fusermount_mount(mountpoint, "ro,nosuid,nodev,default_permissions,fsname=4zip,subtype=4zip");
+    if (fd < 0) fprintf(stderr, "mount: permission denied and fusermount failed\n");
+    else g.fusermount = 1;
+    return fd;
+}
+
+static void do_unmount(void) {
+    if (!g.fusermount) {
+        if (umount2(g.mountpoint, MNT_DETACH) != 0) perror("umount");
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        execlp("fusermount3", "fusermount3", "-u", "-z", "--", g.mountpoint, (char*)NULL);
+        execlp("fusermount", "fusermount", "-u", "-z", "--", g.mountpoint, (char*)NULL);
+        _exit(127);
+    }
+    if (pid > 0) waitpid(pid, NULL, 0);
+}
+
+// SIGINT/SIGTERM/SIGHUP unmount, which ends the FUSE threads' read loop.
+static void *signal_thread(void *varg) {
+    sigset_t *set = (sigset_t*)varg;
+    int sig;
+    if (sigwait(set, &sig) == 0) do_unmount();
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s mount [-f] [--cache-size BYTES] [--threads N] [--volume-dir DIR]...\n"
+                    "       <mountpoint> <cmp_file> <meta_file> [<cmp_file> <meta_file>]...\n", prog);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || strcmp(argv[1], "mount") != 0) { usage(argv[0]); return 1; }
+    int foreground = 0;
+    int nthreads = available_cpus();
+    uint64_t cache_size = DEFAULT_CACHE_SIZE;
+    char **vol_dirs = (char**)malloc((size_t)argc * sizeof(char*));
+    int nvol_dirs = 0;
+    static const struct option longopts[] = {
+        { "foreground", no_argument,       NULL, 'f' },
+        { "cache-size", required_argument, NULL, 'c' },
+        { "threads",    required_argument, NULL, 't' },
+        { "volume-dir", required_argument, NULL, 'D' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    optind = 2;
+    while ((opt = getopt_long(argc, argv, "fc:t:D:", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'f': foreground = 1; break;
+        case 'c':
+            cache_size = parse_size(optarg);
+            if (cache_size == 0) { usage(argv[0]); return 1; }
+            break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'D': vol_dirs[nvol_dirs++] = optarg; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    int nargs = argc - optind;
+    if (nargs < 3 || nargs % 2 == 0) { usage(argv[0]); return 1; }
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > 16) nthreads = 16;
+    g.mountpoint = argv[optind];
+
+    g.narchives = (uint32_t)(nargs - 1) / 2;
+    g.archives = (Archive*)calloc(g.narchives, sizeof(Archive));
+    if (!g.archives) { fprintf(stderr, "OOM\n"); return 1; }
+    for (uint32_t k = 0; k < g.narchives; ++k) {
+        if (load_archive(&g.archives[k], argv[optind + 1 + 2 * k], argv[optind + 2 + 2 * k], vol_dirs, nvol_dirs) != 0)
+            return 1;
+        for (uint32_t j = 0; j < k; ++j) {
+            if (strcmp(g.archives[j].name, g.archives[k].name) == 0) {
+                fprintf(stderr, "two archives would both be named %s\n", g.archives[k].name);
+                return 1;
+            }
+        }
+    }
+    free(vol_dirs);
+    uint64_t max_unit = 0;
+    for (uint32_t k = 0; k < g.narchives; ++k) {
+        const Archive *a = &g.archives[k];
+        // raw chunks are read in place and never cached
+        for (uint32_t u = 0; u < a->nunits; ++u)
+            if (a->mi.entries[a->unit_chunk[u]].kind != CHUNK_RAW && a->unit_off[u + 1] - a->unit_off[u] > max_unit)
+                max_unit = a->unit_off[u + 1] - a->unit_off[u];
+    }
+    if (chunk_cache_init(&g.cache, (size_t)cache_size, (size_t)max_unit) != 0) { fprintf(stderr, "OOM\n"); return 1; }
+    bufpool_init(&g.pool);
+    pthread_mutex_init(&g.pf_lock, NULL);
+    pthread_cond_init(&g.pf_cond, NULL);
+
+    g.fuse_fd = do_mount(g.mountpoint);
+    if (g.fuse_fd < 0) return 1;
+    printf("Mounted %u archive(s) on %s; cache=%" PRIu64 " bytes, threads=%d\n", g.narchives, g.mountpoint,
+           cache_size, nthreads);
+    fflush(stdout);
+    if (!foreground && daemon(0, 0) != 0) { perror("daemon"); do_unmount(); return 1; }
+
+    // threads inherit the blocked set; only signal_thread takes the signals
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    pthread_t sig_thread;
+    pthread_create(&sig_thread, NULL, signal_thread, &set);
+    pthread_detach(sig_thread);
+
+    int nprefetch = nthreads > 1 ? nthreads / 2 : 1;
+    pthread_t *threads = (pthread_t*)malloc((size_t)(nthreads + nprefetch) * sizeof(pthread_t));
+    for (int t = 0; t < nprefetch; ++t) pthread_create(&threads[nthreads + t], NULL, prefetch_thread, NULL);
+    for (int t = 0; t < nthreads; ++t) pthread_create(&threads[t], NULL, fuse_thread, NULL);
+    for (int t = 0; t < nthreads; ++t) pthread_join(threads[t], NULL);
+
+    pthread_mutex_lock(&g.pf_lock);
+    g.stopping = 1;
+    pthread_cond_broadcast(&g.pf_cond);
+    pthread_mutex_unlock(&g.pf_lock);
+    for (int t = 0; t < nprefetch; ++t) pthread_join(threads[nthreads + t], NULL);
+    free(threads);
+    close(g.fuse_fd);
+    if (foreground) {
+        char text[1024];
+        format_stats(text, sizeof(text));
+        fputs(text, stderr);
+    }
+
+    chunk_cache_destroy(&g.cache);
+    bufpool_destroy(&g.pool);
+    for (uint32_t k = 0; k < g.narchives; ++k) {
+        close_volumes(&g.archives[k].vm);
+        free_meta(&g.archives[k].mi);
+        free(g.archives[k].unit_off);
+        free(g.archives[k].unit_chunk);
+        free(g.archives[k].unit_coff);
+        free(g.archives[k].unit_csize);
+        free(g.archives[k].loading);
+    }
+    free(g.archives);
+    return 0;
+}
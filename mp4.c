@@ -0,0 +1,61 @@
+// mp4.c
+// ISO-BMFF top-level box walk.
+
+#include <stdlib.h>
+#include <string.h>
+#include "archive.h"
+#include "mp4.h"
+
+static uint64_t be32(const unsigned char *p) {
+    return (uint64_t)p[0] << 24 | (uint64_t)p[1] << 16 | (uint64_t)p[2] << 8 | p[3];
+}
+
+// Reads one box header at off; returns 0 with *len and type[] set, or -1.
+static int box_header(int fd, uint64_t off, uint64_t filesize, uint64_t *len, char type[5]) {
+    // size (4) type (4) [largesize (8) when size == 1]
+    unsigned char h[16];
+    if (filesize - off < 8 || pread_full(fd, h, 8, (off_t)off) != 0) return -1;
+    uint64_t n = be32(h), hdr = 8;
+    if (n == 1) {
+        if (filesize - off < 16 || pread_full(fd, h + 8, 8, (off_t)(off + 8)) != 0) return -1;
+        n = be32(h + 8) << 32 | be32(h + 12);
+        hdr = 16;
+    } else if (n == 0) {
+        n = filesize - off;    // the last box runs to the end of the file
+    }
+    for (int k = 4; k < 8; ++k) if (h[k] < 0x20 || h[k] > 0x7e) return -1;
+    if (n < hdr || n > filesize - off) return -1;
+    memcpy(type, h + 4, 4);
+    type[4] = 0;
+    *len = n;
+    return 0;
+}
+
+int mp4_boxes(int fd, uint64_t filesize, Mp4Box **boxes) {
+    Mp4Box *b = NULL;
+    int n = 0, cap = 0;
+    for (uint64_t off = 0; off < filesize; ) {
+        uint64_t len;
+        char type[5];
+        int ok = box_header(fd, off, filesize, &len, type) == 0 && (n > 0 || strcmp(type, "ftyp") == 0);
+        if (ok && n == cap) {
+            int ncap = cap ? cap * 2 : 16;
+            Mp4Box *nb = (Mp4Box*)realloc(b, (size_t)ncap * sizeof(Mp4Box));
+            if (nb) { b = nb; cap = ncap; } else ok = 0;
+        }
+        if (!ok) { free(b); return -1; }
+        b[n].off = off;
+        b[n].len = len;
+        memcpy(b[n].type, type, 5);
+        ++n;
+        off += len;
+    }
+    if (n == 0) return -1;
+    *boxes = b;
+    return n;
+}
+
+int mp4_is_media(const Mp4Box *b) {
+    // mdat: samples; moof fragments are metadata, their mdat follows them
+    return strcmp(b->type, "mdat") == 0;
+}
@@ -0,0 +1,25 @@
+// mp4.h
+// Top-level box layout of ISO-BMFF files (MP4, MOV, M4A, 3GP, HEIF), for
+// chunking along box boundaries: the metadata boxes (ftyp, moov, ...) are
+// small, compress well and are what players read first, while mdat holds
+// already entropy-coded media.
+
+#ifndef MP4_H
+#define MP4_H
+
+#include <stdint.h>
+
+typedef struct {
+    uint64_t off, len;     // the whole box, header included
+    char type[5];
+} Mp4Box;
+
+// The top-level boxes of the file open on fd, which must tile [0, filesize)
+// exactly and start with ftyp. Returns the number of boxes with *boxes set
+// (free() it), or -1 if the file is not ISO-BMFF.
+int mp4_boxes(int fd, uint64_t filesize, Mp4Box **boxes);
+
+// Whether a box holds media samples rather than metadata.
+int mp4_is_media(const Mp4Box *b);
+
+#endif
@@ -0,0 +1,43 @@
+// peak_rss.c
+// Runs a command for bench.py and prints its peak RSS in KiB. Linux keeps a
+// process's RSS high-water mark across exec, so a child that Python forks
+// (or vforks) and execs starts out with the interpreter's RSS as its floor.
+// This helper is small, and the command runs in a grandchild spawned from it,
+// so ru_maxrss measures the command alone.
+//
+// Usage: peak_rss <command> [args...]
+//   The command's stdout goes to /dev/null and its stderr is inherited; the
+//   peak RSS is printed on stdout, and the exit status is the command's
+//   (128 + signal if it was killed).
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <command> [args...]\n", argv[0]);
+        return 1;
+    }
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, 1, "/dev/null", O_WRONLY, 0);
+    pid_t pid;
+    int rc = posix_spawnp(&pid, argv[1], &fa, NULL, argv + 1, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", argv[1], strerror(rc));
+        return 127;
+    }
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) < 0) { perror("wait4"); return 1; }
+    printf("%ld\n", ru.ru_maxrss);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
@@ -0,0 +1,105 @@
+// perfctr.c
+// perf_event_open counter groups and the --perf report.
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "perfctr.h"
+
+// name: the total's line in the report; mpki: its per-1000-instructions line
+static const struct { uint32_t type; uint64_t config; const char *name, *mpki; } events[PERF_NEVENTS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles", NULL },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions", NULL },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache_misses", "cache_mpki" },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                          | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), "dtlb_misses", "dtlb_mpki" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch_misses", "branch_mpki" },
+};
+
+int perf_group_open(PerfGroup *g) {
+    g->nopen = 0;
+    for (int e = 0; e < PERF_NEVENTS; ++e) {
+        g->fd[e] = -1;
+        struct perf_event_attr pe;
+        memset(&pe, 0, sizeof(pe));
+        pe.type = events[e].type;
+        pe.size = sizeof(pe);
+        pe.config = events[e].config;
+        pe.exclude_kernel = 1;
+        pe.exclude_hv = 1;
+        pe.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        // the cycle counter leads; the group starts counting with it
+        int leader = e == PERF_CYCLES ? -1 : g->fd[PERF_CYCLES];
+        g->fd[e] = (int)syscall(SYS_perf_event_open, &pe, 0, -1, leader, 0);
+        if (g->fd[e] >= 0) g->nopen++;
+        else if (e == PERF_CYCLES) return -1;
+    }
+    return 0;
+}
+
+void perf_group_close(PerfGroup *g) {
+    for (int e = PERF_NEVENTS - 1; e >= 0; --e) {
+        if (g->fd[e] >= 0) close(g->fd[e]);
+        g->fd[e] = -1;
+    }
+    g->nopen = 0;
+}
+
+int perf_group_read(const PerfGroup *g, PerfSample *s) {
+    // { nr, time_enabled, time_running, value[nr] } in the order the
+    // members were opened
+    uint64_t buf[3 + PERF_NEVENTS];
+    ssize_t want = (ssize_t)((3 + g->nopen) * sizeof(uint64_t));
+    if (read(g->fd[PERF_CYCLES], buf, sizeof(buf)) != want || buf[0] != (uint64_t)g->nopen) return -1;
+    s->enabled = buf[1];
+    s->running = buf[2];
+    for (int e = 0, k = 0; e < PERF_NEVENTS; ++e) s->v[e] = g->fd[e] >= 0 ? buf[3 + k++] : 0;
+    return 0;
+}
+
+void perf_totals_init(PerfTotals *t) {
+    memset(t, 0, sizeof(*t));
+    pthread_mutex_init(&t->lock, NULL);
+}
+
+void perf_totals_destroy(PerfTotals *t) {
+    pthread_mutex_destroy(&t->lock);
+}
+
+void perf_totals_add(PerfTotals *t, const PerfGroup *g, const PerfSample *before, const PerfSample *after, uint64_t bytes) {
+    uint64_t en = after->enabled - before->enabled, run = after->running - before->running;
+    double scale = run ? (double)en / (double)run : 0.0;
+    pthread_mutex_lock(&t->lock);
+    for (int e = 0; e < PERF_NEVENTS; ++e) {
+        if (g->fd[e] < 0) continue;
+        t->have[e] = 1;
+        t->v[e] += (double)(after->v[e] - before->v[e]) * scale;
+    }
+    double cycles = (double)(after->v[PERF_CYCLES] - before->v[PERF_CYCLES]) * scale;
+    if (cycles > t->max_cycles) t->max_cycles = cycles;
+    t->chunks++;
+    t->bytes += bytes;
+    pthread_mutex_unlock(&t->lock);
+}
+
+// Totals, per-chunk means, and the ratios that separate memory-bound from
+// compute-bound runs: IPC well under 1 together with many cache and dTLB
+// misses per thousand instructions means the cores mostly wait on DRAM.
+void perf_totals_report(FILE *out, const PerfTotals *t) {
+    if (t->chunks == 0) return;
+    fprintf(out, "Perf counters (hash + compress, %" PRIu64 " chunks, %" PRIu64 " bytes):\n", t->chunks, t->bytes);
+    for (int e = 0; e < PERF_NEVENTS; ++e) {
+        if (!t->have[e]) { fprintf(out, "  %-14s n/a\n", events[e].name); continue; }
+        fprintf(out, "  %-14s %16.0f  %14.0f/chunk\n", events[e].name, t->v[e], t->v[e] / (double)t->chunks);
+    }
+    fprintf(out, "  %-14s %16.0f\n", "max_cycles", t->max_cycles);
+    double ins = t->v[PERF_INSTRUCTIONS];
+    if (t->bytes) fprintf(out, "  %-14s %16.2f\n", "cycles/byte", t->v[PERF_CYCLES] / (double)t->bytes);
+    if (!t->have[PERF_INSTRUCTIONS] || ins <= 0) return;
+    fprintf(out, "  %-14s %16.2f\n", "ipc", ins / t->v[PERF_CYCLES]);
+    for (int e = 0; e < PERF_NEVENTS; ++e)
+        if (events[e].mpki && t->have[e]) fprintf(out, "  %-14s %16.2f\n", events[e].mpki, t->v[e] * 1000.0 / ins);
+}
@@ -0,0 +1,55 @@
+// perfctr.h
+// Hardware performance counters (perf_event_open) for a region of code on
+// the calling thread, and totals across threads for the compressor's --perf
+// report. Counts are user space only, which perf_event_paranoid <= 2 allows
+// without privileges.
+
+#ifndef PERFCTR_H
+#define PERFCTR_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,     // last-level cache
+    PERF_DTLB_MISSES,      // dTLB load misses
+    PERF_BRANCH_MISSES,
+    PERF_NEVENTS
+};
+
+// One event group per thread, so all counters cover the same instructions.
+// fd[e] is -1 for events this PMU does not have.
+typedef struct {
+    int fd[PERF_NEVENTS];
+    int nopen;
+} PerfGroup;
+
+typedef struct {
+    uint64_t v[PERF_NEVENTS];
+    uint64_t enabled, running;   // ns; running < enabled when multiplexed
+} PerfSample;
+
+// Returns 0, or -1 with errno set if not even the cycle counter opens.
+int perf_group_open(PerfGroup *g);
+void perf_group_close(PerfGroup *g);
+int perf_group_read(const PerfGroup *g, PerfSample *s);
+
+typedef struct {
+    pthread_mutex_t lock;
+    int have[PERF_NEVENTS];
+    double v[PERF_NEVENTS];
+    double max_cycles;           // the most expensive single chunk
+    uint64_t chunks, bytes;
+} PerfTotals;
+
+void perf_totals_init(PerfTotals *t);
+void perf_totals_destroy(PerfTotals *t);
+// Adds after - before for one chunk of 'bytes' input bytes, scaled up for
+// the time the group was not scheduled.
+void perf_totals_add(PerfTotals *t, const PerfGroup *g, const PerfSample *before, const PerfSample *after, uint64_t bytes);
+void perf_totals_report(FILE *out, const PerfTotals *t);
+
+#endif